@@ -4,14 +4,136 @@
 #include <map>
 #include <fstream>
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <new>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <iterator>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PNG_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PNG_HAVE_MMAP 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// io_uring is used through its system calls, liburing is not needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PNG_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE   // from <linux/fs.h>, clashes with the constants below
+#endif
+#endif
+
+#if !defined(PNG_ENABLE_LOGGING) && !defined(NDEBUG)
+#define PNG_ENABLE_LOGGING 1
+#endif
+
+#ifdef PNG_ENABLE_LOGGING
+#include <sstream>
+#endif
 
 #include "PNGImage.h"
 
 namespace png {
 
-typedef unsigned int   uint_t;
-typedef unsigned short ushort_t;
-typedef unsigned char  byte_t;
+// --------------------------------------------------------
+// Diagnostics
+
+struct LogSink {
+    log_callback_t callback;
+    void* user_data;
+    LogLevel level;
+};
+
+static LogSink log_sink = { nullptr, nullptr, LogLevel::Warning };
+
+void set_log_callback(log_callback_t callback, void* user_data)
+{
+    log_sink.callback = callback;
+    log_sink.user_data = user_data;
+}
+
+void set_log_level(LogLevel level)
+{
+    log_sink.level = level;
+}
+
+#ifdef PNG_ENABLE_LOGGING
+
+static bool log_enabled(LogLevel level) 
+{ 
+    return level <= log_sink.level; 
+}
+
+static void log_message(LogLevel level, const std::string& message)
+{
+    static const char* const prefixes[] = { "error: ", "warning: ", "", "" };
+
+    if (log_sink.callback) 
+        log_sink.callback(level, message.c_str(), log_sink.user_data);
+    else 
+        std::clog << prefixes[static_cast<int>(level)] << message << '\n';
+}
+
+// message is a stream expression, it is only evaluated when the level is enabled
+#define PNG_LOG(level, message) \
+    do { \
+        if (log_enabled(LogLevel::level)) { \
+            std::ostringstream log_stream; \
+            log_stream << message; \
+            log_message(LogLevel::level, log_stream.str()); \
+        } \
+    } while (false)
+
+#else
+
+#define PNG_LOG(level, message) do {} while (false)
+
+#endif
+
+// --------------------------------------------------------
+// Buffers
+//
+// Decoding memory is kept in vectors that only grow. Growth is counted per 
+// thread, so a reused Decoder can tell that it ran without allocations.
+
+static thread_local size_t buffer_allocations = 0;
+
+// resizes buffer, running out of memory is reported instead of thrown
+template <typename T>
+static bool allocate(std::vector<T>& buffer, size_t size)
+{
+    if (size > buffer.capacity()) ++buffer_allocations;
+
+    try 
+    {
+        buffer.resize(size);
+    }
+    catch (const std::bad_alloc&)
+    {
+        PNG_LOG(Error, "Can't allocate " << size * sizeof(T) << " bytes");
+        return false;
+    }
+    return true;
+}
 
 const static int SIGNATURE_SIZE    = 8;
 const static int CHUNK_TYPE_SIZE   = 4;
@@ -58,128 +180,648 @@ const static uint_t crc_table[] =
     0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-static const ushort_t bit_mask[] = {
-    0x0000, 0x0001, 0x0003, 0x0007,
-    0x000F, 0x001F, 0x003F, 0x007F,
-    0x00FF, 0x01FF, 0x03FF, 0x07FF,
-    0x0FFF, 0x1FFF, 0x3FFF, 0x7FFF,
-    0xFFFF
+// --------------------------------------------------------
+// CPU features for runtime kernel dispatch
+
+struct CpuFeatures {
+    bool sse2;
+    bool ssse3;
+    bool sse41;
+    bool pclmul;
+    bool avx2;
+
+    CpuFeatures() : sse2(false), ssse3(false), sse41(false), pclmul(false), avx2(false)
+    {
+#ifdef PNG_X86_SIMD
+        __builtin_cpu_init();
+        sse2   = __builtin_cpu_supports("sse2");
+        ssse3  = __builtin_cpu_supports("ssse3");
+        sse41  = __builtin_cpu_supports("sse4.1");
+        pclmul = __builtin_cpu_supports("pclmul");
+        avx2   = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    static const CpuFeatures& get()
+    {
+        static const CpuFeatures features;
+        return features;
+    }
 };
 
+// --------------------------------------------------------
+// CRC32
+//
+// Kernels work on the pre-inverted crc register. The portable kernel is
+// slicing-by-8, the PCLMULQDQ kernel folds 64 bytes per iteration and is
+// used for the 16-byte aligned bulk of long buffers.
 
-enum class ChunkType : uint_t
-{
-    IHDR = 0x49484452,  // Image header
-    PLTE = 0x504c5445,  // Palette table
-    IDAT = 0x49444154,  // Image data
-    IEND = 0x49454e44,  // Image trailer
+typedef uint_t (*crc_kernel_t)(uint_t crc, const byte_t* data, size_t size);
 
-    tRNS = 0x74524e53,  // Transparency information
+struct CrcTables {
+    uint_t t[8][256];
 
-                        // Colour space information
-    cHRM = 0x6348524d,
-    gAMA = 0x67414d41,
-    iCCP = 0x69434350,
-    sBIT = 0x73424954,
-    sRGB = 0x73524742,
-                        // Textual information
-    iTXt = 0x69545874,
-    tEXt = 0x74455874,
-    zTXt = 0x7a545874,
-                        // Miscellaneous information
-    bKGD = 0x624b4744,
-    hIST = 0x68495354,
-    pHYs = 0x70485973,
-    sPLT = 0x73504c54,
-    
-    tIME = 0x74494d45  // Time stamp
+    CrcTables()
+    {
+        for (size_t n = 0; n < 256; ++n) t[0][n] = crc_table[n];
+        for (size_t k = 1; k < 8; ++k)
+            for (size_t n = 0; n < 256; ++n)
+                t[k][n] = (t[k - 1][n] >> 8) ^ crc_table[t[k - 1][n] & 0xff];
+    }
+
+    static const CrcTables& get()
+    {
+        static const CrcTables tables;
+        return tables;
+    }
 };
 
-enum class ColourType : byte_t
+static uint_t crc32_slice8(uint_t crc, const byte_t* data, size_t size)
 {
-    Greyscale   = 0,
-    TrueColour  = 2,
-    Indexed     = 3,
-    AGreyscale  = 4,
-    ATrueColour = 6
-};
+    const CrcTables& tables = CrcTables::get();
+    const uint_t (*t)[256] = tables.t;
+
+    for (; size >= 8; size -= 8, data += 8) {
+        uint_t lo = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (uint_t(data[3]) << 24));
+        uint_t hi = data[4] | (data[5] << 8) | (data[6] << 16) | (uint_t(data[7]) << 24);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; size > 0; --size) crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
 
-static const byte_t length_extra_bits[] = {
-        0,  0,0,0,0, 0,0,0,0,  1,1,1,1,     2,2,2,2,     3,3,3,3,     4,4,4,4,      5,5,5,5,         0
-};
-//  256 257 --------- 264  265 --- 268  269 --- 272  273 --- 276  277 ---- 280  281 ------- 284  285
-//  ^- bound valuse, not useed;
-static const ushort_t length_values[] = {
-        0,  3,4,5,6, 7,8,9,10, 11,13,15,17, 19,23,27,31, 35,43,51,59, 67,83,99,115, 131,163,195,227, 258
-};
+#ifdef PNG_X86_SIMD
+
+// Folding constants for the reflected CRC32 polynomial, see
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+__attribute__((target("pclmul,sse4.1")))
+static uint_t crc32_clmul(uint_t crc, const byte_t* data, size_t size)
+{
+    static const size_t MIN_SIZE = 64;
+    if (size < MIN_SIZE) return crc32_slice8(crc, data, size);
+
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    const size_t tail = size & 15;
+    size -= tail;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+    data += 64;
+    size -= 64;
+
+    // fold 4 x 128 bits in parallel
+    for (; size >= 64; size -= 64, data += 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+        y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+        y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+        y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    }
+
+    // fold into 128 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold remaining 16 byte blocks
+    for (; size >= 16; size -= 16, data += 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    }
+
+    // fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = static_cast<uint_t>(_mm_extract_epi32(x1, 1));
+    return crc32_slice8(crc, data, tail);
+}
+
+#endif
+
+static crc_kernel_t select_crc_kernel()
+{
+#ifdef PNG_X86_SIMD
+    const CpuFeatures& cpu = CpuFeatures::get();
+    if (cpu.pclmul && cpu.sse41) return crc32_clmul;
+#endif
+    return crc32_slice8;
+}
+
+// returns CRC of data appended to a buffer with CRC equal to seed
+uint_t crc32(const byte_t* data, size_t size, uint_t seed = 0)
+{
+    static const crc_kernel_t kernel = select_crc_kernel();
+    return kernel(seed ^ 0xFFFFFFFF, data, size) ^ 0xFFFFFFFF;
+}
+
+static uint_t gf2_matrix_times(const uint_t* mat, uint_t vec)
+{
+    uint_t sum = 0;
+    for (; vec; vec >>= 1, ++mat) if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(uint_t* square, const uint_t* mat)
+{
+    for (size_t n = 0; n < 32; ++n) square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// returns CRC of two concatenated buffers given CRC of each of them and the size of the second one
+uint_t crc32_combine(uint_t crc1, uint_t crc2, size_t size2)
+{
+    if (size2 == 0) return crc1;
+
+    uint_t even[32];    // even-power-of-two zeros operator
+    uint_t odd[32];     // odd-power-of-two zeros operator
+
+    // operator for one zero bit
+    odd[0] = 0xEDB88320;
+    for (size_t n = 1, row = 1; n < 32; ++n, row <<= 1) odd[n] = row;
+
+    gf2_matrix_square(even, odd);   // two zero bits
+    gf2_matrix_square(odd, even);   // four zero bits
+
+    // apply size2 zero bytes to crc1
+    do {
+        gf2_matrix_square(even, odd);
+        if (size2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        size2 >>= 1;
+        if (size2 == 0) break;
+
+        gf2_matrix_square(odd, even);
+        if (size2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+// --------------------------------------------------------
+// Adler-32
+//
+// Sums are reduced modulo 65521 only once per NMAX bytes. The SIMD kernels
+// take 32 bytes per step: byte sums go to s1 with _mm_sad_epu8, position
+// weighted sums go to s2 with _mm_maddubs_epi16.
+
+static const uint_t ADLER_BASE = 65521;
+static const size_t ADLER_NMAX = 5552;   // max bytes before s2 may overflow 32 bits
+
+typedef uint_t (*adler_kernel_t)(uint_t adler, const byte_t* data, size_t size);
+
+static uint_t adler32_scalar(uint_t adler, const byte_t* data, size_t size)
+{
+    uint_t s1 = adler & 0xFFFF;
+    uint_t s2 = adler >> 16;
+
+    while (size > 0) {
+        size_t n = std::min(size, ADLER_NMAX);
+        size -= n;
+        for (; n >= 8; n -= 8, data += 8) {
+            s1 += data[0]; s2 += s1;
+            s1 += data[1]; s2 += s1;
+            s1 += data[2]; s2 += s1;
+            s1 += data[3]; s2 += s1;
+            s1 += data[4]; s2 += s1;
+            s1 += data[5]; s2 += s1;
+            s1 += data[6]; s2 += s1;
+            s1 += data[7]; s2 += s1;
+        }
+        for (; n > 0; --n) { s1 += *data++; s2 += s1; }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+    return (s2 << 16) | s1;
+}
+
+#ifdef PNG_X86_SIMD
+
+__attribute__((target("ssse3")))
+static uint_t adler32_ssse3(uint_t adler, const byte_t* data, size_t size)
+{
+    static const size_t BLOCK_SIZE = 32;
+
+    uint_t s1 = adler & 0xFFFF;
+    uint_t s2 = adler >> 16;
+
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    size_t blocks = size / BLOCK_SIZE;
+    size -= blocks * BLOCK_SIZE;
+
+    while (blocks > 0) {
+        size_t n = std::min(blocks, ADLER_NMAX / BLOCK_SIZE);
+        blocks -= n;
+
+        // v_ps collects s1 before every block, each of them adds 32 * s1 to s2
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, static_cast<int>(s1 * n));
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, static_cast<int>(s2));
+        __m128i v_s1 = zero;
+
+        for (; n > 0; --n, data += BLOCK_SIZE) {
+            const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+        }
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += _mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_cvtsi128_si32(v_s2);
+
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    return adler32_scalar((s2 << 16) | s1, data, size);
+}
+
+__attribute__((target("avx2")))
+static uint_t adler32_avx2(uint_t adler, const byte_t* data, size_t size)
+{
+    static const size_t BLOCK_SIZE = 32;
+
+    uint_t s1 = adler & 0xFFFF;
+    uint_t s2 = adler >> 16;
+
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    size_t blocks = size / BLOCK_SIZE;
+    size -= blocks * BLOCK_SIZE;
+
+    while (blocks > 0) {
+        size_t n = std::min(blocks, ADLER_NMAX / BLOCK_SIZE);
+        blocks -= n;
 
-static const size_t DIST_CODE_SIZE = 5;
-static const byte_t dist_extra_bits[] = {
-        0,0, 0,0, 1,1, 2,2,  3,3,   4,4,   5,5,   6,6,     7,7,     8,8,     9,9,       10,10,     11,11,     12,12,      13,13
+        __m256i v_ps = _mm256_setr_epi32(static_cast<int>(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s2 = _mm256_setr_epi32(static_cast<int>(s2), 0, 0, 0, 0, 0, 0, 0);
+        __m256i v_s1 = zero;
+
+        for (; n > 0; --n, data += BLOCK_SIZE) {
+            const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+        }
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        __m128i h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += _mm_cvtsi128_si32(h_s1);
+
+        __m128i h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_cvtsi128_si32(h_s2);
+
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+
+    return adler32_scalar((s2 << 16) | s1, data, size);
+}
+
+#endif
+
+static adler_kernel_t select_adler_kernel()
+{
+#ifdef PNG_X86_SIMD
+    const CpuFeatures& cpu = CpuFeatures::get();
+    if (cpu.avx2)  return adler32_avx2;
+    if (cpu.ssse3) return adler32_ssse3;
+#endif
+    return adler32_scalar;
+}
+
+// returns Adler-32 of data appended to a buffer with checksum equal to seed
+uint_t adler32(const byte_t* data, size_t size, uint_t seed = 1)
+{
+    static const adler_kernel_t kernel = select_adler_kernel();
+    return kernel(seed, data, size);
+}
+
+// returns Adler-32 of two concatenated buffers given Adler-32 of each of them and the size of the second one
+uint_t adler32_combine(uint_t adler1, uint_t adler2, size_t size2)
+{
+    // s1 of the second part grows by s1 of the first, s2 by size2 times s1 of the first
+    const uint_t rem = static_cast<uint_t>(size2 % ADLER_BASE);
+    uint_t s1 = adler1 & 0xFFFF;
+    uint_t s2 = (rem * s1) % ADLER_BASE;
+
+    s1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    s2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+    if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+    if (s2 >= 2 * ADLER_BASE) s2 -= 2 * ADLER_BASE;
+    if (s2 >= ADLER_BASE) s2 -= ADLER_BASE;
+    return s2 << 16 | s1;
+}
+
+// --------------------------------------------------------
+// Stage timing and statistics
+//
+// PNG_STAT wraps every statement that only updates DecodeStats, so that 
+// PNG_DISABLE_STATS removes them along with the timers.
+
+#ifdef PNG_DISABLE_STATS
+#define PNG_STAT(statement) do {} while (false)
+#else
+#define PNG_STAT(statement) do { statement; } while (false)
+#endif
+
+static uint64_t now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef PNG_DISABLE_STATS
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(uint64_t&)
+    {}
 };
-    //  0 1  2 3  4 5  6 7   8 9    10 11  12 13  14  15   16  17   18  19   20   21    22   23    24   25    26   27     28    29
-static const ushort_t dist_values[] = {
-        1,2, 3,4, 5,7, 9,13, 17,25, 33,49, 65,97, 129,193, 257,385, 513,769, 1025,1537, 2049,3073, 4097,6145, 8193,12289, 16385,24577
+
+#else
+
+// adds the lifetime of the object to a counter
+class ScopedTimer {
+public:
+    explicit ScopedTimer(uint64_t& counter) : total(counter), start(now_ns())
+    {}
+
+    ~ScopedTimer() { total += now_ns() - start; }
+
+private:
+    uint64_t& total;
+    uint64_t start;
 };
 
+#endif
+
+DecodeStats::DecodeStats() : 
+    bytes_read(0), chunks(), idat_bytes(0), inflated_bytes(0), stored_blocks(0), fixed_blocks(0), dynamic_blocks(0), 
+    literals(0), matches(0), match_bytes(0), timings()
+{}
+
+// position of a chunk type in DecodeStats::chunks
+static size_t chunk_index(ChunkType type)
+{
+    switch (type)
+    {
+        case ChunkType::IHDR : return 0;
+        case ChunkType::PLTE : return 1;
+        case ChunkType::IDAT : return 2;
+        case ChunkType::IEND : return 3;
+        case ChunkType::tRNS : return 4;
+        case ChunkType::cHRM : return 5;
+        case ChunkType::gAMA : return 6;
+        case ChunkType::iCCP : return 7;
+        case ChunkType::sBIT : return 8;
+        case ChunkType::sRGB : return 9;
+        case ChunkType::iTXt : return 10;
+        case ChunkType::tEXt : return 11;
+        case ChunkType::zTXt : return 12;
+        case ChunkType::bKGD : return 13;
+        case ChunkType::hIST : return 14;
+        case ChunkType::pHYs : return 15;
+        case ChunkType::sPLT : return 16;
+        case ChunkType::tIME : return 17;
+    }
+    return DecodeStats::CHUNK_TYPES;
+}
+
+uint64_t DecodeStats::chunk_count(ChunkType type) const
+{
+    return chunks[chunk_index(type)];
+}
 
 // --------------------------------------------------------
 // File read / write support
+//
+// Image data is accessed in memory: files are mapped (or read in one go where
+// mapping is not available) and caller-provided buffers are borrowed as is.
+// Chunk payloads are handed out as views into that memory without copying.
+
+// view of a part of the image data
+struct DataView {
+    const byte_t* data;
+    size_t size;
+
+    DataView() : data(nullptr), size(0)
+    {}
+
+    DataView(const byte_t* d, size_t s) : data(d), size(s)
+    {}
+};
 
 class ImageFile {
 public:
-    ImageFile() : ifs(), crc(0)
+    ImageFile() : begin(nullptr), pos(nullptr), end(nullptr), opened(false), failed(false), 
+                  mapped(nullptr), mapped_size(0), buffer(), crc(0), verify_crc(true)
     {}
 
     ~ImageFile() { close(); } 
 
-    bool open (const std::string& file) 
-    {
-        ifs.open(file, std::ios::in | std::ios::binary);
-        return is_open();
-    }
+    bool open (const std::string& file);
+    bool open (const byte_t* data, size_t size);
     
-    void close() { if (ifs.is_open()) ifs.close(); }
+    void close();
 
-    void reset_crc() { crc = 0xFFFFFFFF; }
-    uint_t get_crc() const { return crc ^ 0xffffffffL; }
+    void reset_crc() { crc = 0; }
+    uint_t get_crc() const { return crc; }
+
+    // chunk checksums are neither computed nor compared when disabled
+    void set_verify_crc(bool verify) { verify_crc = verify; }
+    bool verifies_crc() const { return verify_crc; }
   
-    bool eof() { return ifs.eof() || ifs.peek() == EOF; }
-    bool is_open() const { return ifs && ifs.is_open(); }
+    bool eof() const { return pos >= end; }
+    bool is_open() const { return opened && !failed; }
+
+    size_t position() const { return pos - begin; }
+    // everything opened, independent of the read position
+    DataView contents() const { return DataView(begin, end - begin); }
     
     template <typename T>
     void read(T& val);
 
-    void read(std::vector<byte_t>& data, size_t size);
+    // returns view of the next size bytes
+    DataView view(size_t size);
     
     void skip(size_t count);
 
 private:
-    void update_crc(byte_t val);
+    ImageFile(const ImageFile&);
+    ImageFile& operator= (const ImageFile&);
+
+    void update_crc(const byte_t* data, size_t size) { if (verify_crc) crc = crc32(data, size, crc); }
+
+    bool take(size_t size);
     
-    std::fstream ifs;
-    uint_t       crc;
+    const byte_t* begin;
+    const byte_t* pos;
+    const byte_t* end;
+    bool opened;
+    bool failed;     // read past the end of data
+
+    void* mapped;
+    size_t mapped_size;
+    std::vector<byte_t> buffer;   // file content when it can't be mapped
+
+    uint_t crc;
+    bool verify_crc;
 };
 
-void ImageFile::update_crc(byte_t val)
+bool ImageFile::open(const std::string& file)
+{
+    close();
+
+#ifdef PNG_HAVE_MMAP
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+            mapped = p;
+            mapped_size = static_cast<size_t>(st.st_size);
+        }
+    }
+    ::close(fd);
+
+    if (mapped) return open(static_cast<const byte_t*>(mapped), mapped_size);
+#endif
+
+    std::ifstream ifs(file, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs) return false;
+
+    std::streamoff size = ifs.tellg();
+    if (size < 0 || !allocate(buffer, static_cast<size_t>(size))) return false;
+    ifs.seekg(0);
+    if (size > 0 && !ifs.read(reinterpret_cast<char*>(buffer.data()), size)) return false;
+
+    return open(buffer.data(), buffer.size());
+}
+
+bool ImageFile::open(const byte_t* data, size_t size)
+{
+    if (data == nullptr && size != 0) return false;
+    begin = pos = data;
+    end = data + size;
+    opened = true;
+    failed = false;
+    return true;
+}
+
+void ImageFile::close()
+{
+#ifdef PNG_HAVE_MMAP
+    if (mapped) munmap(mapped, mapped_size);
+#endif
+    mapped = nullptr;
+    mapped_size = 0;
+    buffer.clear();
+    begin = pos = end = nullptr;
+    opened = false;
+    failed = false;
+}
+
+bool ImageFile::take(size_t size)
 {
-    crc = crc_table[(crc ^ val) & 0xff] ^ (crc >> 8);
+    if (static_cast<size_t>(end - pos) < size)
+    {
+        pos = end;
+        failed = true;
+        return false;
+    }
+    return true;
 }
 
 template <typename T>
 void ImageFile::read(T& val)
 {
-    if (!eof())
-    {   
-        byte_t data[sizeof(T)];
-        ifs.read(reinterpret_cast<char*>(&data[0]), sizeof(T));
-        val = {};
-        for (size_t i = 0; i < sizeof(T); ++i)
-        {
-            val = (val << 8) | static_cast<T>(data[i]); 
-            update_crc(data[i]);
-        }
-    }   
+    val = {};
+    if (!take(sizeof(T))) return;
+
+    for (size_t i = 0; i < sizeof(T); ++i)
+    {
+        val = (val << 8) | static_cast<T>(pos[i]); 
+    }
+    update_crc(pos, sizeof(T));
+    pos += sizeof(T);
 }
 
 template <>
@@ -196,20 +838,20 @@ void ImageFile::read(ColourType& val)
     val = static_cast<ColourType>(type);
 }
 
-void ImageFile::read(std::vector<byte_t>& data, size_t size)
+DataView ImageFile::view(size_t size)
 {
-    if (!eof())
-    {
-        data.resize(size);
-        ifs.read(reinterpret_cast<char*>(&data[0]), size);
-	    if (ifs) for (auto& v : data) update_crc(v);
-    }
+    if (!take(size)) return DataView();
+
+    DataView res(pos, size);
+    update_crc(pos, size);
+    pos += size;
+    return res;
 }
 
 void ImageFile::skip(size_t count)
 {
-    std::cout << std::dec << "\tskip " <<  count << "\n";
-    ifs.seekg(count, std::ios::cur);
+    PNG_LOG(Trace, "\tskip " << count);
+    if (take(count)) pos += count;
 }
 
 template <typename T>
@@ -223,7 +865,13 @@ bool check_crc(ImageFile& file)
 {   
     uint_t data_crc = file.get_crc();
     uint_t file_crc; file >> file_crc;
-    return file_crc == data_crc;
+    return !file.verifies_crc() || file_crc == data_crc;
+}
+
+bool is_png_file(ImageFile& file)
+{
+    DataView file_sign = file.view(SIGNATURE_SIZE);
+    return file_sign.size == SIGNATURE_SIZE && std::equal(file_sign.data, file_sign.data + SIGNATURE_SIZE, PNG_SIGNATURE);
 }
 
 template <typename T>
@@ -235,676 +883,6818 @@ T reverce_bits(T v, size_t count)
 }
 
 // --------------------------------------------------------
-// reading a given number of bits from ImageFile
+// reading a given number of bits from a borrowed byte buffer
+//
+// Bits are kept in a 64-bit buffer, least significant bit first. While at
+// least 8 input bytes remain the buffer is refilled with a single unaligned
+// little-endian load, near the end of input it falls back to byte-wise
+// refill and pads with zero bits once the data is exhausted.
+
+inline uint64_t load_le64(const byte_t* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+class BitStream {
+public:
+    // max count of bits guaranteed to be available after refill()
+    static const size_t MAX_PEEK_BITS = 56;
+
+    BitStream() : pos(nullptr), end(nullptr), buf(0), bits(0), padding(0), overrun(false)
+    {}
+
+    BitStream(const byte_t* data, size_t size) : pos(data), end(data + size), buf(0), bits(0), padding(0), overrun(false)
+    {
+        refill();
+    }
 
-struct BitStream {
-    BitStream(std::vector<byte_t> f) : file(f), buf(0), bpos(0), dpos(0)
+    // continues the stream with the next piece of input, buffered bits are kept
+    void feed(const byte_t* data, size_t size)
     {
-        if (!eof()) buf += file[dpos++];
-        if (!eof()) buf += (file[dpos++] << 8);
-        if (!eof()) buf += (file[dpos++] << 16);
-        if (!eof()) buf += (file[dpos++] << 24);
+        assert(pos == end);
+        bits -= padding;
+        buf &= bits ? ~uint64_t(0) >> (64 - bits) : 0;
+        padding = 0;
+        overrun = false;
+        pos = data;
+        end = data + size;
     }
 
-    ushort_t get (size_t count)
-    {   		
-        assert(count >= 0 && count <= sizeof(ushort_t) * 8);
-		if (count == 0) return 0;
-		if (eof()) return 0;
-		
-        ushort_t res = static_cast<ushort_t>((buf >> bpos) & bit_mask[count]);
-        bpos += count;
-        while (bpos > 7) {
-            buf >>= 8; bpos -= 8;
-            if (dpos < file.size()) {
-				uint_t bb = (file[dpos++] << 24);
-				buf += bb;
-			}
+    // tops the buffer up to at least MAX_PEEK_BITS bits
+    void refill()
+    {
+        if (end - pos >= 8) {
+            buf |= load_le64(pos) << bits;
+            pos += (63 - bits) >> 3;
+            bits |= MAX_PEEK_BITS;
+        } else {
+            refill_slow();
         }
+    }
+
+    void ensure(size_t count) { if (bits < count) refill(); }
+
+    // true if count bits of real input are available
+    bool need(size_t count)
+    {
+        ensure(count);
+        return bits - padding >= count;
+    }
+
+    size_t bytes_left() const { return end - pos; }
+
+    // returns next count bits without removing them from the stream
+    uint_t peek(size_t count) const
+    {
+        assert(count <= 32 && count <= bits);
+        return static_cast<uint_t>(buf & ((uint64_t(1) << count) - 1));
+    }
+
+    void consume(size_t count)
+    {
+        assert(count <= bits);
+        if (count > bits - padding) overrun = true;
+        buf >>= count;
+        bits -= count;
+        padding = std::min(padding, bits);
+    }
+
+    uint_t get(size_t count)
+    {
+        ensure(count);
+        uint_t res = peek(count);
+        consume(count);
         return res;
     }
-	
-	ushort_t get_huffman(size_t count)
+
+	uint_t get_huffman(size_t count)
 	{
 		return reverce_bits(get(count), count);
 	}
 
-    bool eof() { return dpos >= file.size() && bpos >= sizeof(uint_t) * 8; }
+    // skip any remaining bits in current partially processed byte
+    void align_to_byte() { consume(bits & 7); }
 
-private:
-    std::vector<byte_t> file;
-    uint_t buf;
-    size_t bpos;
-    size_t dpos;
-};
+    // copies up to count bytes at a byte boundary, the buffered ones first and the rest straight 
+    // from the input; returns the count copied, less than count when the input runs out
+    size_t read_bytes(byte_t* dst, size_t count)
+    {
+        assert((bits & 7) == 0);
+        size_t copied = 0;
+        for (; copied < count && bits - padding >= 8; ++copied) {
+            dst[copied] = static_cast<byte_t>(buf);
+            buf >>= 8;
+            bits -= 8;
+        }
+        // input is only left while the buffer holds no padding, which comes after the last byte
+        const size_t direct = std::min(count - copied, bytes_left());
+        if (direct > 0) {
+            // refill loads bytes past the buffered bits, they are stale once pos moves
+            assert(bits == 0);
+            buf = 0;
+            std::memcpy(dst + copied, pos, direct);
+            pos += direct;
+        }
+        return copied + direct;
+    }
 
-// --------------------------------------------------------
-//
-class InflateState {
-public:
-    InflateState (size_t available_length)
-    {}
-
-
-    struct Code {
-        size_t code;
-        size_t length;
-        Code (size_t c, size_t l) : code(c), length(l)
-        {}
-        bool operator< (const Code& rhs)
-        {
-            return length < rhs.length || code < rhs.code;
-        }
-        bool operator== (const Code& rhs)
-        {
-            return length == rhs.length && code == rhs.code;
-        }
-    };
+    // true if more bits were consumed than the input holds
+    bool eof() const { return overrun; }
 
-    typedef std::map<Code, size_t> huffman_alphabet_t;
-
-    std::vector<size_t> read_code_lengths(BitStream& bs, size_t count, huffman_alphabet_t code_alphabet)
+private:
+    void refill_slow()
     {
-        std::vector<size_t>code_lengths(count);
-        for (size_t i = 0; i < count; ++i) {
-            Code hcode(0,0);
-            while (!code_alphabet.count(hcode)) {
-                hcode.code = (hcode.code << 1) + bs.get_huffman(1);
-                hcode.length++;
-            }
-            size_t lit_code = code_alphabet[hcode];
-
-            if (lit_code == 16) {
-                // Copy the previous code length 3 - 6 times (2 bits)
-                if (i == 0) {
-                    std::cout << "Wrong code_length size" << std::endl;
-                    return std::vector<size_t>();
-                }
-                for (size_t times = bs.get(2) + 3; times > 0; times--, ++i)
-                    code_lengths[i] = code_lengths[i - 1];
-            } else if (lit_code == 17) {
-                // Repeat a code length of 0 for 3 - 10 times (3 bits)
-                i += bs.get(3) + 3 - 1;
-            } else if (lit_code == 18) {
-                // Repeat a code length of 0 for 11 - 138 times (7 bits)
-                i += bs.get(7) + 11 - 1;
+        while (bits < MAX_PEEK_BITS) {
+            if (pos < end) {
+                buf |= uint64_t(*pos++) << bits;
             } else {
-                // 0 - 15: Represent code lengths of 0 - 15
-                code_lengths[i] = lit_code;
+                padding += 8;
             }
+            bits += 8;
         }
-        return code_lengths;
     }
 
-    std::vector<byte_t> read_huffman_code()
-    {}
-    huffman_alphabet_t generate_huffman_codes(const std::vector<size_t> &code_lengths)
-    {
-        // Count the number of codes for each code length
-        std::vector<size_t> bl_count(1);
-        for (const auto& l : code_lengths) {
-            if (l >= bl_count.size()) bl_count.resize(l+1, 0);
-            if (l) bl_count[l]++;
-        }
-        bl_count[0] = 0;
+    const byte_t* pos;
+    const byte_t* end;
+    uint64_t buf;
+    size_t bits;
+    size_t padding;   // zero bits appended past the end of input
+    bool overrun;
+};
 
-        // Find the numerical value of the smallest code for each code length
-        std::vector<size_t> code_value (bl_count.size());
-        for (size_t bits = 1, code = 0; bits < bl_count.size(); ++bits) {
-            code = (code + bl_count[bits - 1]) << 1;
-            code_value[bits] = code;
-        }
+// --------------------------------------------------------
+// Huffman decoding tables
+//
+// Codes are resolved by peeking `bits` bits from the stream and looking them
+// up in the primary table. Codes longer than that are resolved with a second
+// probe into a subtable linked from the primary entry.
+//
+// Each entry is packed into one uint_t:
+//   bits  0..3  - code length to consume (for links: subtable index bits)
+//   bits  4..7  - number of extra bits following the code
+//   bits  8..11 - entry kind
+//   bits 16..31 - symbol, base value or subtable offset
+
+typedef uint_t huffman_entry_t;
+
+enum HuffmanKind : uint_t {
+    HUFFMAN_LITERAL  = 0,  // literal byte or code length symbol
+    HUFFMAN_BASE     = 1,  // length or distance base value + extra bits
+    HUFFMAN_END      = 2,  // end of block
+    HUFFMAN_SUBTABLE = 3,  // link to subtable
+    HUFFMAN_INVALID  = 4   // code not used by the alphabet
+};
 
-        // Assign numerical values to all codes
-        std::map<Code, size_t> code_alphabet;
-        for (size_t n = 0, len = 0;  n < code_lengths.size(); ++n) {
-            if ((len = code_lengths[n]) != 0) {
-                code_alphabet[Code(code_value[len], len)] = n;
-                ++code_value[len];
-            }
-        }
+static const size_t MAX_CODE_BITS   = 15;
+static const size_t LIT_TABLE_BITS  = 10;
+static const size_t DIST_TABLE_BITS = 8;
+static const size_t CLEN_TABLE_BITS = 7;
 
-        return code_alphabet;
-    }
+static const size_t LIT_ALPHABET_SIZE  = 288;
+static const size_t DIST_ALPHABET_SIZE = 32;
+static const size_t CLEN_ALPHABET_SIZE = MAX_HCLEN;
+
+constexpr huffman_entry_t make_huffman_entry(uint_t kind, uint_t value, uint_t extra, uint_t length)
+{
+    return (value << 16) | (kind << 8) | (extra << 4) | length;
+}
 
+constexpr uint_t entry_length(huffman_entry_t e) { return e & 0x0F; }
+constexpr uint_t entry_extra (huffman_entry_t e) { return (e >> 4) & 0x0F; }
+constexpr uint_t entry_kind  (huffman_entry_t e) { return (e >> 8) & 0x0F; }
+constexpr uint_t entry_value (huffman_entry_t e) { return e >> 16; }
+
+constexpr huffman_entry_t base_entry(uint_t base, uint_t extra) { return make_huffman_entry(HUFFMAN_BASE, base, extra, 0); }
+
+// base length and extra bits of length symbols 257 - 285, one load gives both
+static constexpr huffman_entry_t LENGTH_BASES[] = {
+    base_entry(  3, 0), base_entry(  4, 0), base_entry(  5, 0), base_entry(  6, 0),   // 257 - 260
+    base_entry(  7, 0), base_entry(  8, 0), base_entry(  9, 0), base_entry( 10, 0),   // 261 - 264
+    base_entry( 11, 1), base_entry( 13, 1), base_entry( 15, 1), base_entry( 17, 1),   // 265 - 268
+    base_entry( 19, 2), base_entry( 23, 2), base_entry( 27, 2), base_entry( 31, 2),   // 269 - 272
+    base_entry( 35, 3), base_entry( 43, 3), base_entry( 51, 3), base_entry( 59, 3),   // 273 - 276
+    base_entry( 67, 4), base_entry( 83, 4), base_entry( 99, 4), base_entry(115, 4),   // 277 - 280
+    base_entry(131, 5), base_entry(163, 5), base_entry(195, 5), base_entry(227, 5),   // 281 - 284
+    base_entry(258, 0)                                                                // 285
+};
 
+// base distance and extra bits of distance symbols 0 - 29
+static constexpr huffman_entry_t DIST_BASES[] = {
+    base_entry(   1,  0), base_entry(    2,  0), base_entry(    3,  0), base_entry(    4,  0),   //  0 -  3
+    base_entry(   5,  1), base_entry(    7,  1), base_entry(    9,  2), base_entry(   13,  2),   //  4 -  7
+    base_entry(  17,  3), base_entry(   25,  3), base_entry(   33,  4), base_entry(   49,  4),   //  8 - 11
+    base_entry(  65,  5), base_entry(   97,  5), base_entry(  129,  6), base_entry(  193,  6),   // 12 - 15
+    base_entry( 257,  7), base_entry(  385,  7), base_entry(  513,  8), base_entry(  769,  8),   // 16 - 19
+    base_entry(1025,  9), base_entry( 1537,  9), base_entry( 2049, 10), base_entry( 3073, 10),   // 20 - 23
+    base_entry(4097, 11), base_entry( 6145, 11), base_entry( 8193, 12), base_entry(12289, 12),   // 24 - 27
+    base_entry(16385, 13), base_entry(24577, 13)                                                 // 28 - 29
 };
 
+// table entry of every symbol without the code length, for fixed and dynamic tables alike
+typedef huffman_entry_t (*symbol_entry_t)(uint_t symbol);
 
+constexpr huffman_entry_t lit_symbol_entry(uint_t symbol)
+{
+    return symbol < 256  ? make_huffman_entry(HUFFMAN_LITERAL, symbol, 0, 0)
+         : symbol == 256 ? make_huffman_entry(HUFFMAN_END, 0, 0, 0)
+         : symbol <= 285 ? LENGTH_BASES[symbol - 257]
+         :                 make_huffman_entry(HUFFMAN_INVALID, 0, 0, 0);   // 286 and 287 take part in the fixed code only
+}
 
-// --------------------------------------------------------
-// Image header
+constexpr huffman_entry_t dist_symbol_entry(uint_t symbol)
+{
+    return symbol < 30 ? DIST_BASES[symbol] : make_huffman_entry(HUFFMAN_INVALID, 0, 0, 0);
+}
+
+// 0 - 15 code lengths, 16 - 18 repeat codes with 2, 3 and 7 extra bits
+constexpr huffman_entry_t clen_symbol_entry(uint_t symbol)
+{
+    return make_huffman_entry(HUFFMAN_LITERAL, symbol, symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0, 0);
+}
+
+// decoding view of a table, tables built at compile time are only used through it
+struct HuffmanLookup {
+    const huffman_entry_t* entries;   // primary table followed by subtables
+    size_t bits;                      // primary table index size
+};
 
-struct Header {
-    uint_t width;       
-    uint_t height;      
-    byte_t bit_depth;
-    ColourType colour_type;
-    byte_t compression;  
-    byte_t filter;       
-    byte_t interlace;    
+struct HuffmanTable {
+    size_t bits;                            // primary table index size
+    std::vector<huffman_entry_t> entries;   // primary table followed by subtables
 
-    Header() : width(0), height (0), bit_depth(0), colour_type(ColourType::ATrueColour), compression(0), filter(0), interlace(0)
+    HuffmanTable() : bits(0), entries()
     {}
 
-    bool from_file(ImageFile& file);
+    HuffmanLookup lookup() const { return HuffmanLookup{ entries.data(), bits }; }
 };
 
-bool Header::from_file(ImageFile& file)
+// builds decoding table from the code lengths of a canonical Huffman code
+bool generate_huffman_codes(const byte_t* code_lengths, size_t count, symbol_entry_t symbol_entry,
+                            size_t table_bits, HuffmanTable& table)
 {
-    if (!file.is_open() || file.eof()) return false;
+    assert(table_bits <= LIT_TABLE_BITS);
+
+    // Count the number of codes for each code length
+    size_t bl_count[MAX_CODE_BITS + 1] = {};
+    size_t max_length = 0;
+    for (size_t n = 0; n < count; ++n) {
+        if (code_lengths[n] > MAX_CODE_BITS) return false;
+        bl_count[code_lengths[n]]++;
+        max_length = std::max<size_t>(max_length, code_lengths[n]);
+    }
+    bl_count[0] = 0;
 
-    uint_t length, type;
-    file.read(length);
-    file.reset_crc();
-    file.read(type);
-    
-    if (length <= 0) 
-    {
-        std::cout << "Wrong header chunk size" << std::endl;
-        return false;
+    // reject over-subscribed code sets, incomplete ones are decoded until an unused code is met
+    for (size_t len = 1, left = 1; len <= MAX_CODE_BITS; ++len) {
+        left <<= 1;
+        if (bl_count[len] > left) return false;
+        left -= bl_count[len];
     }
 
-    if (static_cast<ChunkType>(type) != ChunkType::IHDR) 
-    {
-        std::cout << "Wrong header chunk type" << std::endl;
-        return false;
+    // Find the numerical value of the smallest code for each code length
+    size_t next_code[MAX_CODE_BITS + 1] = {};
+    for (size_t len = 1, code = 0; len <= MAX_CODE_BITS; ++len) {
+        code = (code + bl_count[len - 1]) << 1;
+        next_code[len] = code;
     }
 
-    std::cout << "Parsing header" << std::endl;
+    size_t& bits = table.bits;
+    bits = std::max<size_t>(1, std::min(table_bits, max_length));
+    const size_t primary_size = size_t(1) << bits;
+    const size_t primary_mask = primary_size - 1;
+
+    // Find the subtable size for every primary index shared by long codes
+    assert(count <= LIT_ALPHABET_SIZE);
+    byte_t sub_bits[size_t(1) << LIT_TABLE_BITS] = {};
+    size_t codes[LIT_ALPHABET_SIZE];
+    for (size_t n = 0; n < count; ++n) {
+        size_t len = code_lengths[n];
+        if (len == 0) continue;
+        // codes are packed starting with the most significant bit, table is indexed by stream order
+        codes[n] = reverce_bits(next_code[len]++, len);
+        if (len > bits) {
+            byte_t& sb = sub_bits[codes[n] & primary_mask];
+            sb = std::max<byte_t>(sb, len - bits);
+        }
+    }
 
-    file >> width 
-         >> height
-         >> bit_depth  
-         >> colour_type
-         >> compression
-         >> filter     
-         >> interlace;   
-    
-    // check image size
-    if (!check_crc(file))
+    size_t total_size = primary_size;
+    for (size_t i = 0; i < primary_size; ++i) if (sub_bits[i]) total_size += size_t(1) << sub_bits[i];
+
+    std::vector<huffman_entry_t>& entries = table.entries;
+    if (!allocate(entries, total_size)) return false;
+    // unused codes consume all peeked bits, so a lookup that ran into missing input can be told from bad data
+    std::fill_n(entries.begin(), primary_size, make_huffman_entry(HUFFMAN_INVALID, 0, 0, bits));
+
+    for (size_t i = 0, offset = primary_size; i < primary_size; ++i) {
+        if (sub_bits[i]) {
+            entries[i] = make_huffman_entry(HUFFMAN_SUBTABLE, offset, 0, sub_bits[i]);
+            std::fill_n(entries.begin() + offset, size_t(1) << sub_bits[i], make_huffman_entry(HUFFMAN_INVALID, 0, 0, sub_bits[i]));
+            offset += size_t(1) << sub_bits[i];
+        }
+    }
+
+    // Replicate every code over all the indexes it is a prefix of
+    for (size_t n = 0; n < count; ++n) {
+        size_t len = code_lengths[n];
+        if (len == 0) continue;
+        if (len <= bits) {
+            for (size_t i = codes[n]; i < primary_size; i += size_t(1) << len)
+                entries[i] = symbol_entry(n) | len;
+        } else {
+            huffman_entry_t link = entries[codes[n] & primary_mask];
+            size_t offset = entry_value(link);
+            size_t size = size_t(1) << entry_length(link);
+            for (size_t i = codes[n] >> bits; i < size; i += size_t(1) << (len - bits))
+                entries[offset + i] = symbol_entry(n) | (len - bits);
+        }
+    }
+
+    return true;
+}
+
+// --------------------------------------------------------
+// Compile-time Huffman tables
+//
+// Canonical codes as in generate_huffman_codes, written as C++11 constexpr
+// functions, so the compiler fills the primary table of a code whose codes
+// all fit into it. First codes and the code of every symbol are computed
+// once into arrays; a table entry is then the symbol whose code starts the
+// entry index. Recursions walk symbols in blocks to stay far below the
+// constexpr depth limit.
+
+constexpr uint_t reverse_code(uint_t code, uint_t length)
+{
+    return length == 0 ? 0 : ((code & 1) << (length - 1)) | reverse_code(code >> 1, length - 1);
+}
+
+// std::index_sequence is C++14
+template <size_t... I> struct IndexList {};
+
+template <typename A, typename B> struct JoinIndexes;
+
+template <size_t... A, size_t... B>
+struct JoinIndexes<IndexList<A...>, IndexList<B...>> {
+    typedef IndexList<A..., (sizeof...(A) + B)...> type;
+};
+
+// 0 ... N - 1, built by halves to keep the template recursion shallow
+template <size_t N>
+struct MakeIndexes {
+    typedef typename JoinIndexes<typename MakeIndexes<N / 2>::type, typename MakeIndexes<N - N / 2>::type>::type type;
+};
+
+template <> struct MakeIndexes<0> { typedef IndexList<> type; };
+template <> struct MakeIndexes<1> { typedef IndexList<0> type; };
+
+template <size_t Size>
+struct ConstTable {
+    uint_t values[Size];
+};
+
+// F::value(0) ... F::value(Size - 1)
+template <typename F, size_t... I>
+constexpr ConstTable<sizeof...(I)> make_const_table(IndexList<I...>)
+{
+    return ConstTable<sizeof...(I)>{ { F::value(I)... } };
+}
+
+template <typename F, size_t Size>
+constexpr ConstTable<Size> make_const_table()
+{
+    return make_const_table<F>(typename MakeIndexes<Size>::type());
+}
+
+// Code gives SIZE, the alphabet size, BITS, its longest code, and length(symbol) and symbol_entry(symbol)
+template <typename Code>
+struct CanonicalCode {
+    static constexpr uint_t BLOCK = 16;
+
+    // symbols in [n, n + size) with code length len
+    static constexpr uint_t count_block(uint_t len, uint_t n, uint_t size)
     {
-        std::cout << "Checksum does not match" << std::endl;
-        return false;   
+        return size == 0 ? 0 : (Code::length(n) == len ? 1 : 0) + count_block(len, n + 1, size - 1);
     }
 
-    if (width <= 0 || height <= 0) 
+    // symbols below n with code length len
+    static constexpr uint_t count(uint_t len, uint_t n)
     {
-        std::cout << "Wrong image size" << std::endl;
-        return false; 
+        return n <= BLOCK ? count_block(len, 0, n) : count(len, n - BLOCK) + count_block(len, n - BLOCK, BLOCK);
     }
 
-    // check color type and bit depth
-    std::vector<byte_t> allowed_bit_depths;
+    // smallest code of length len
+    struct FirstCode {
+        static constexpr uint_t value(uint_t len)
+        {
+            return len <= 1 ? 0 : (value(len - 1) + count(len - 1, Code::SIZE)) << 1;
+        }
+    };
 
-    switch (colour_type)
-    {
-        case ColourType::Greyscale : 
-            allowed_bit_depths = {1,2,4,8,16};  
-            break;
-        case ColourType::Indexed :     
-            allowed_bit_depths = {1,2,4,8};
-            break;
-        case ColourType::TrueColour : 
-        case ColourType::AGreyscale :         
-        case ColourType::ATrueColour : 
-            allowed_bit_depths = {8,16};
-            break;
+    static constexpr ConstTable<MAX_CODE_BITS + 1> FIRST_CODES = make_const_table<FirstCode, MAX_CODE_BITS + 1>();
+
+    // code of a symbol in stream bit order
+    struct SymbolCode {
+        static constexpr uint_t value(uint_t symbol)
+        {
+            return reverse_code(FIRST_CODES.values[Code::length(symbol)] + count(Code::length(symbol), symbol), Code::length(symbol));
+        }
     };
 
-    if (std::find(allowed_bit_depths.begin(), allowed_bit_depths.end(), bit_depth) == allowed_bit_depths.end())
+    static constexpr ConstTable<Code::SIZE> CODES = make_const_table<SymbolCode, Code::SIZE>();
+
+    static constexpr bool starts(uint_t bits, uint_t symbol)
     {
-        std::cout << "Not allowed bit depth" << std::endl;
-        return false; 
+        return Code::length(symbol) != 0 && (bits & ((1u << Code::length(symbol)) - 1)) == CODES.values[symbol];
     }
 
-    // only compression method 0 (deflate/inflate) is defined in International Standard
-    if (compression != 0)
+    // symbol in [n, n + size) whose code starts bits, SIZE when there is none
+    static constexpr uint_t find_in_block(uint_t bits, uint_t n, uint_t size)
     {
-        std::cout << "Compressoin type " << compression << " not allowed" << std::endl;
-        return false; 
+        return size == 0 ? Code::SIZE : starts(bits, n) ? n : find_in_block(bits, n + 1, size - 1);
     }
 
-    // only filter method 0 (adaptive filtering with five basic filter types) is defined in International Standard
-    if (filter != 0)
+    static constexpr uint_t find_from(uint_t bits, uint_t n, uint_t found)
     {
-        std::cout << "Filter type " << filter << " not allowed" << std::endl;
-        return false; 
+        return found != Code::SIZE || n >= Code::SIZE ? found : find_from(bits, n + BLOCK, find_in_block(bits, n, n + BLOCK <= Code::SIZE ? BLOCK : Code::SIZE - n));
     }
 
-    // transmission order of the image data : 0 (no interlace) or 1 (Adam7 interlace)
-    if (interlace != 0 && interlace != 1)
+    static constexpr huffman_entry_t symbol_entry(uint_t symbol)
     {
-        std::cout << "Interlace method " << interlace << " not allowed" << std::endl;
-        return false; 
+        return symbol == Code::SIZE ? make_huffman_entry(HUFFMAN_INVALID, 0, 0, Code::BITS) : Code::symbol_entry(symbol) | Code::length(symbol);
     }
 
-    std::cout << "\twidth: "       << std::dec << width            << "\n"
-              << "\theight: "      << std::dec << height           << "\n"
-              << "\tbit_depth: "   << std::hex << (int)bit_depth   << "\n"
-              << "\tcolour_type: " << std::hex << (int)colour_type << "\n"
-              << "\tcompression: " << std::hex << (int)compression << "\n"
-              << "\tfilter: "      << std::hex << (int)filter      << "\n"
-              << "\tinterlace: "   << std::hex << (int)interlace   << std::endl;
+    // primary table entry for BITS peeked stream bits
+    struct Entry {
+        static constexpr huffman_entry_t value(uint_t bits)
+        {
+            return symbol_entry(find_from(bits, 0, Code::SIZE));
+        }
+    };
+};
+
+template <typename Code> constexpr ConstTable<MAX_CODE_BITS + 1> CanonicalCode<Code>::FIRST_CODES;
+template <typename Code> constexpr ConstTable<Code::SIZE> CanonicalCode<Code>::CODES;
 
-    return true;
+// fixed Huffman codes of BTYPE_FIXED blocks, code lengths as listed in RFC 1951 3.2.6;
+// the encoder writes fixed blocks with the same lengths
+constexpr byte_t fixed_lit_length(uint_t symbol)
+{
+    return symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
 }
 
+constexpr byte_t fixed_dist_length(uint_t)
+{
+    return 5;
+}
 
+struct FixedLitCode {
+    static constexpr uint_t SIZE = LIT_ALPHABET_SIZE;
+    static constexpr uint_t BITS = 9;   // longest code, the codes need no subtables
+    static constexpr byte_t length(uint_t symbol) { return fixed_lit_length(symbol); }
+    static constexpr huffman_entry_t symbol_entry(uint_t symbol) { return lit_symbol_entry(symbol); }
+};
 
-struct Palette { 
+struct FixedDistCode {
+    static constexpr uint_t SIZE = DIST_ALPHABET_SIZE;
+    static constexpr uint_t BITS = 5;
+    static constexpr byte_t length(uint_t symbol) { return fixed_dist_length(symbol); }
+    static constexpr huffman_entry_t symbol_entry(uint_t symbol) { return dist_symbol_entry(symbol); }
 };
 
+static_assert(FixedLitCode::BITS <= LIT_TABLE_BITS && FixedDistCode::BITS <= DIST_TABLE_BITS, "fixed codes exceed the decoding tables");
+
+static constexpr ConstTable<size_t(1) << FixedLitCode::BITS> FIXED_LIT_TABLE = 
+    make_const_table<CanonicalCode<FixedLitCode>::Entry, size_t(1) << FixedLitCode::BITS>();
+static constexpr ConstTable<size_t(1) << FixedDistCode::BITS> FIXED_DIST_TABLE = 
+    make_const_table<CanonicalCode<FixedDistCode>::Entry, size_t(1) << FixedDistCode::BITS>();
+
+static constexpr HuffmanLookup FIXED_LIT_LOOKUP = { FIXED_LIT_TABLE.values, FixedLitCode::BITS };
+static constexpr HuffmanLookup FIXED_DIST_LOOKUP = { FIXED_DIST_TABLE.values, FixedDistCode::BITS };
+
 // --------------------------------------------------------
-// PNG implementation
+// Resumable zlib stream decoder
+//
+// The zlib stream of an image is split over any number of IDAT chunks. The
+// state keeps the bit buffer, current block, Huffman tables and the output
+// window between calls, so symbols and back-references may straddle chunk
+// boundaries. Every decoding step needs at most 48 bits: when the input runs
+// out in the middle of a step the stream is rewound to the step start, the
+// remaining bytes stay in the bit buffer and the step is repeated once the
+// next chunk is fed.
+
+// longest back-reference
+static const size_t MAX_MATCH_LENGTH = 258;
+// bytes copy_match may write past the end of the match
+static const size_t MATCH_COPY_OVERRUN = 32;
+// free output space that lets a back-reference be copied without bound checks
+static const ptrdiff_t FAST_OUTPUT_MARGIN = MAX_MATCH_LENGTH + MATCH_COPY_OVERRUN;
+
+// copies a back-reference with wide stores, runs with a period of 1, 2 or 4 bytes 
+// (single colour pixels) are written as a splatted pattern
+static inline void copy_match(byte_t* dst, size_t distance, size_t length)
+{
+    const byte_t* src = dst - distance;
+    byte_t* const end = dst + length;
+
+    if (distance >= 32) {
+        do { std::memcpy(dst, src, 32); dst += 32; src += 32; } while (dst < end);
+    } else if (distance >= 16) {
+        do { std::memcpy(dst, src, 16); dst += 16; src += 16; } while (dst < end);
+    } else if (distance >= 8) {
+        do { std::memcpy(dst, src, 8); dst += 8; src += 8; } while (dst < end);
+    } else if (distance == 1 || distance == 2 || distance == 4) {
+        uint64_t pattern;
+        if (distance == 1) {
+            pattern = src[0] * 0x0101010101010101ull;
+        } else if (distance == 2) {
+            uint16_t p; std::memcpy(&p, src, 2);
+            pattern = p * 0x0001000100010001ull;
+        } else {
+            uint32_t p; std::memcpy(&p, src, 4);
+            pattern = p * 0x0000000100000001ull;
+        }
+        do { 
+            std::memcpy(dst, &pattern, 8); 
+            std::memcpy(dst + 8, &pattern, 8); 
+            dst += 16; 
+        } while (dst < end);
+    } else {
+        // periods of 3, 5, 6 and 7 bytes, each store holds as many whole periods as fit into 8 bytes
+        byte_t pattern[8];
+        for (size_t i = 0; i < 8; ++i) pattern[i] = src[i % distance];
+        const size_t step = 8 / distance * distance;
+        do { std::memcpy(dst, pattern, 8); dst += step; } while (dst < end);
+    }
+}
 
-struct PNGImage::Impl {
-    Header head;
-    Palette palette;
-    std::vector<byte_t> data;
+class InflateState {
+public:
+    enum Status { NEED_INPUT, OUTPUT_FULL, DONE, ERROR };
 
+    // deflate window size, the amount of output to keep for back-references
+    static const size_t MAX_WINDOW_SIZE = 32768;
 
-    Impl() : head(), palette(), data()
-    {}
-    
-    bool from_file(ImageFile& file);
+    InflateState();
 
-    bool is_png_file(ImageFile& file);
+    // decodes the next piece of the zlib stream
+    Status inflate(const DataView& input);
 
-    bool inflate(ImageFile& file, size_t length);
+    // continues the stream with the next piece of input, the previous one must be used up
+    void feed(const DataView& input) { bs.feed(input.data, input.size); }
 
-};
+    // decodes fed input until it runs out or the output buffer is full
+    Status run();
 
-bool PNGImage::Impl::from_file(ImageFile& file)
-{
-    if (file.is_open())
-    {
-        if (!is_png_file(file))                    // check signature 
-        {
-            std::cout << "Is not PNG file" << std::endl;
-            return false;      
-        }
-        if (!head.from_file(file)) return false;   // read header
+    // decoded data goes to buffer[pos, size), buffer[0, pos) must hold the earlier output 
+    // that back-references may point to; can be changed between calls
+    void set_output(byte_t* buffer, size_t pos, size_t size) 
+    { 
+        out_begin = buffer; 
+        out_pos = buffer + pos; 
+        out_end = buffer + size; 
+    }
 
-        bool has_IEND = false;
-        bool has_IDAT = false;
-        bool has_PLTE = false;
-        while (!file.eof() && file.is_open())      // read image data
-        {           
-            uint_t length; file.read(length);
-            file.reset_crc();
-            ChunkType type; file.read(type);
+    size_t output_pos() const { return out_pos - out_begin; }
 
-            std::cout << "Chunk: " << std::hex << static_cast<uint_t>(type) 
-                      << " Size: "  << std::dec << length << std::endl;
+    // the Adler-32 of the output is computed and compared with the stream trailer when enabled
+    void set_verify_checksum(bool verify) { verify_adler = verify; }
 
-            switch (type)
-            {
-                case ChunkType::IDAT :
-                    std::cout << "Process IDAT chunk" << std::endl;
-                    has_IDAT = inflate(file, length);
-                    break;
+    bool done() const { return mode == MODE_DONE; }
 
-                case ChunkType::IEND : 
-                    std::cout << "Find IEND" << std::endl;
-                    has_IEND = check_crc(file);
-                    break;
+    // starts over with a new stream, table memory is kept
+    void reset();
 
-                default:
-                    std::cout << "\tNo implemented action" << std::endl;
-                    file.skip(length + CHUNK_CRC_SIZE);
-                    
-            break;
-            }
-        }   
-        
-        if (!has_IDAT) 
-        {
-            std::cout << "Image data was not found" << std::endl;
-            return false;
-        }
+    // adds the block and symbol counts of the stream so far
+    void add_stats(DecodeStats& stats) const;
 
-        if (!has_IEND)
-        {
-            std::cout << "Wrong file ending" << std::endl;  
-            return false;
-        }
+private:
+    enum Mode { 
+        MODE_ZLIB_HEADER, 
+        MODE_BLOCK_HEADER, 
+        MODE_TABLE_COUNTS, 
+        MODE_TABLE_CLEN, 
+        MODE_TABLE_LENGTHS, 
+        MODE_STORED_LENGTH,
+        MODE_STORED,
+        MODE_CODES, 
+        MODE_ADLER32,
+        MODE_DONE, 
+        MODE_ERROR 
+    };
 
-        std::cout << "END" << std::endl;
-        return true;
+    enum Step { STEP_OK, STEP_BLOCK_END, STEP_NEED_INPUT, STEP_OUTPUT_FULL, STEP_ERROR };
 
+    // resolves one symbol with one or two table probes
+    static huffman_entry_t read_huffman_code(BitStream& bs, const HuffmanLookup& table)
+    {
+        bs.ensure(MAX_CODE_BITS);
+        huffman_entry_t entry = table.entries[bs.peek(table.bits)];
+        if (entry_kind(entry) == HUFFMAN_SUBTABLE) {
+            bs.consume(table.bits);
+            entry = table.entries[entry_value(entry) + bs.peek(entry_length(entry))];
+        }
+        bs.consume(entry_length(entry));
+        return entry;
     }
-    std::cout << "File not open" << std::endl; 
-    return false;
-}
-
-bool PNGImage::Impl::is_png_file(ImageFile& file)
-{
-    std::vector<byte_t> file_sign;
-    file.read(file_sign, SIGNATURE_SIZE);
-    return std::equal(file_sign.begin(), file_sign.end(), PNG_SIGNATURE);
-}
 
-bool PNGImage::Impl::inflate(ImageFile& file, size_t length)
-{
-    static bool all_data = false;
-    
-    static const size_t uncompressed_block_limit = 65535;
-    static const size_t MAX_WINDOW_SIZE = 32768;
+    Status need_input();
+    Status fail(const char* message);
 
-    if (file.is_open() && !file.eof())
-    {
-
-        /*
-          do
-               read block header from input stream.
-               if stored with no compression
-                  skip any remaining bits in current partially processed byte
-                  read LEN and NLEN (see next section)
-                  copy LEN bytes of data to output
-               otherwise
-                  if compressed with dynamic Huffman codes
-                     read representation of code trees (see
-                        subsection below)
-                  loop (until end of block code recognized)
-                     decode literal/length value from input stream
-                     if value < 256
-                        copy value (literal byte) to output stream
-                     otherwise
-                        if value = end of block (256)
-                           break from loop
-                        otherwise (value = 257..285)
-                           decode distance from input stream
-
-                           move backwards distance bytes in the output
-                           stream, and copy length bytes from this
-                           position to the output stream.
-                  end loop
-            while not last block
-         */
-
-        // read zlib heder
-        byte_t cmf, flg;
-        file >> cmf >> flg;
-        byte_t cm     = (byte_t) (cmf & 0x0F);
-        byte_t cinfo  = (byte_t) ((cmf >> 4) & 0x0F);
-        byte_t fcheck = (byte_t) (flg & 0x1F);
-        byte_t fdict  = (byte_t) ((flg >> 5) & 1);
-        byte_t flevel = (byte_t) ((flg >> 6) & 0x03);
-
-        size_t sliding_window_size = (size_t) pow(2, (cinfo + 8));
-        
-        const int BFINAL = 1;
-
-        enum {BTYPE_NO, BTYPE_FIXED, BTYPE_DYNAMIC, BTYPE_ERROR };
-        
-        // CM = 8 denotes the "deflate" compression method
-        // fdict = 0, The additional flags shall not specify a preset dictionary 
-        if ((cmf * 256 + flg) % 31 != 0 || cm != 8 || sliding_window_size > MAX_WINDOW_SIZE || fdict != 0)
-        {
-            std::cout << "Wrong compression params" << std::endl;
-        }
-
-        std::cout << "\tcm: "    << std::hex << (int)cm     << "\n"
-                  << "\tcinfo: "  << std::hex << (int)cinfo  << "\n"
-                  << "\tfcheck: " << std::hex << (int)fcheck << "\n"
-                  << "\tfdict: "  << std::hex << (int)fdict  << "\n"
-                  << "\tflevel: " << std::hex << (int)flevel << "\n"
-                  << "\twindow_size: " << std::dec << (int)sliding_window_size << "\n";
-
-        file.skip(length - 2 + CHUNK_CRC_SIZE);
-        
-        
-        /*std::vector<byte_t> data = {0b01110011, 0b01001001, 0b01001101, 0b11001011, 
-									0b01001001, 0b00101100, 0b01001001, 0b01010101, 
-									0b00000000, 0b00010001, 0b00000000};*/
-									
-									
-		std::vector<byte_t> data = {
-			0b00001100, 0b11001000, 0b01000001, 0b00001010, 0b10000000, 0b00100000, 0b00010000, 0b00000101,
-			0b11010000, 0b01111101, 0b11010000, 0b00011101, 0b11111110, 0b00001001, 0b10111010, 0b10000100,
-			0b11101011, 0b10100000, 0b00101011, 0b01001100, 0b11111010, 0b10110101, 0b00000001, 0b00011101,
-			0b00100001, 0b00100111, 0b10100001, 0b11011011, 0b11010111, 0b01011011, 0b10111110, 0b11010000,
-			0b10101101, 0b11011100, 0b11100010, 0b01001111, 0b00010101, 0b11010111, 0b01101110, 0b00000011,
-			0b11011101, 0b01110000, 0b00110010, 0b11110110, 0b10100110, 0b01010110, 0b00100000, 0b10000110,
-			0b00111101, 0b00011100, 0b00011011, 0b10001110, 0b01001010, 0b00011001, 0b11111100, 0b00011111,
-			0b10010010, 0b10100110, 0b00001110, 0b00100110, 0b11111000, 0b00100101, 0b00001110, 0b11100110,
-			0b11001100, 0b11101000, 0b00111010, 0b00001001, 0b01101101, 0b10001101, 0b01001001, 0b11000101,
-			0b01011001, 0b11011111, 0b01110101, 0b11111001, 0b00000110, 0b00000000
-		};
-        
-        byte_t btype = BTYPE_ERROR;
-        std::vector<byte_t> result;
-
-        BitStream bs(data);
-		
-		//read block header from input stream.
-        bool last_block = bs.get(1) && BFINAL;
-        btype = bs.get(2);
-
-
-        if (btype == BTYPE_NO) {   // stored with no compression
-            std::cout << "BTYPE_NO" << std::endl;
-			// skip any remaining bits in current partially processed byte
-			// read LEN and NLEN (see next section)
-			// copy LEN bytes of data to output
-/*
+    // adds output produced since from to the running checksum
+    void update_adler(size_t& from);
 
-		Any bits of input up to the next byte boundary are ignored.
-         The rest of the block consists of the following information:
-
-              0   1   2   3   4...
-            +---+---+---+---+================================+
-            |  LEN  | NLEN  |... LEN bytes of literal data...|
-            +---+---+---+---+================================+
-
-         LEN is the number of data bytes in the block.  NLEN is the
-         one's complement of LEN.
-*/
-
-        } else if (btype == BTYPE_FIXED) {
-            std::cout << "BTYPE_FIXED" << std::endl;
-			while (!bs.eof())
-			{
-				ushort_t code = bs.get_huffman(7);   
-				if (code == 0)
-				{ 
-					for (auto& x : result) std::cout << x;
-					std::cout << std::endl;
-					return last_block; // exit from decoding
-				}
-				
-				bool code_is_length = (code >= 0b0000000 && code <= 0b0010111);  // 7 bit code, Lit Value 256 - 279
-				if (!code_is_length) 
-				{
-					code = (code << 1) + bs.get_huffman(1);         // add 1 more bit
-					code_is_length = (code >= 0b11000000 && code <= 0b11000111);  // 8 bit code, Lit Value 280 - 287
-				}
-
-				if (code_is_length)  
-				{
-					byte_t length_extra_bits_count = length_extra_bits[code];
-					size_t length = length_values[code] + bs.get(length_extra_bits_count);
-					
-					byte_t dist_code = bs.get(DIST_CODE_SIZE);
-					byte_t dist_extra_bits_count = dist_extra_bits[dist_code];
-					size_t dist = dist_values[dist_code] + bs.get(dist_extra_bits_count);
-
-					if (dist < result.size())
-					{
-						for (size_t i = 0, pos = result.size() - dist, j = 0; i < length; ++i, j = 0)
-						{
-							while (j < dist && i < length) result.push_back(result[pos + j++]), ++i;
-						}
-					}
-
-					std::cout << "lenght: " << length << std::endl;   
-					std::cout << "dist: " << dist << std::endl;
-
-				} else 
-				if (code >= 0b00110000 && code <= 0b10111111)       // 8 bit code, Lit Value 0 - 143 
-				{
-					result.push_back(code - 0x30);
-					std::cout << result.back() << std::endl;
-				} else
-				{
-					code = (code << 1) + bs.get_huffman(1);         // add 1 more bit
-				
-					if (code >= 0b110010000 && code <= 0b111111111) // 9 bit code, Lit Value 144 - 255 
-					{
-						result.push_back(code - 0x100);
-						std::cout << result.back() << std::endl;
-						continue;
-					} else 
-					{
-						std::cout << " DATA READ ERRROR!!!!!" << std::endl;
-						exit(0);
-					}
-				}
-				
-			}
-			std::cout << "complete" << std::endl;
-
-        } else if (btype == BTYPE_DYNAMIC) {
-			std::cout << "BTYPE_DYNAMIC" << std::endl;
-
-			size_t HLIT = bs.get(5) + 257; //  HLIT + 257 code lengths for the literal/length alphabet
-			size_t HDIST = bs.get(5) + 1;  //  HDIST + 1 code lengths for the distance alphabet
-			size_t HCLEN = bs.get(4) + 4;  // (HCLEN + 4) x 3 bits: code lengths for the code length alphabet
-			std::cout << "HLIT " << std::dec << HLIT << "\n"
-					  << "HDIST " << std::dec <<  HDIST << "\n"
-					  << "HCLEN " << std::dec <<  HCLEN << std::endl;
-            static const byte_t code_length_indexes [] = {
-                16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
-            };
+    Step read_block_header();
+    Step read_code_length();
 
-            // Read HCLEN * 3 bits for code lengths for code length alphabet
-            std::vector<size_t> code_lengths_for_code_lengths(MAX_HCLEN);
-            for (size_t i = 0; i < HCLEN; ++i) {
-                code_lengths_for_code_lengths[code_length_indexes[i]] = bs.get(3);
-            }
-            auto code_lengths_alphabet = generate_huffman_codes(code_lengths_for_code_lengths);
+    template <bool Checked>
+    Step decode_symbol();
+    Step decode_codes();
+    void copy_pending();
 
-            auto lit_alphabet = generate_huffman_codes(read_code_lengths(bs, HLIT, code_lengths_alphabet));
-            auto dist_alphabet = generate_huffman_codes(read_code_lengths(bs, HDIST, code_lengths_alphabet));
+    BitStream bs;
+    Mode mode;
+    bool last_block;
 
-            std::vector<byte_t> text;
-            while (true) {
-                Code hcode(0,0);
-                while (!lit_alphabet.count(hcode)) {
-                    hcode.code = (hcode.code << 1) + bs.get_huffman(1);
-                    hcode.length++;
-                }
-                size_t lit_value = lit_alphabet[hcode];
-                if (lit_value == 256) break;
+    size_t hlit;
+    size_t hdist;
+    size_t hclen;
+    size_t index;     // next code length to read
 
-                if (lit_value > 256 && lit_value <= 287 ) // is lentgh / dist code
-                {
-                    size_t length_extra_bits_count = length_extra_bits[lit_value - 256];
-                    size_t length = length_values[lit_value - 256] + bs.get(length_extra_bits_count);
+    byte_t clen_lengths[MAX_HCLEN];
+    byte_t code_lengths[LIT_ALPHABET_SIZE + DIST_ALPHABET_SIZE];
 
-                    Code hcode(0,0);
-                    while (!dist_alphabet.count(hcode)) {
-                        hcode.code = (hcode.code << 1) + bs.get_huffman(1);
-                        hcode.length++;
-                    }
-                    size_t dist_code = dist_alphabet[hcode];
-                    size_t dist_extra_bits_count = dist_extra_bits[dist_code];
-                    size_t dist = dist_values[dist_code] + bs.get(dist_extra_bits_count);
+    HuffmanTable lit_table;
+    HuffmanTable dist_table;
+    HuffmanTable clen_table;
 
-                    if (dist < text.size())
-                    {
-                        for (size_t i = 0, pos = text.size() - dist, j = 0; i < length; ++i, j = 0)
-                        {
-                            while (j < dist && i < length) text.push_back(text[pos + j++]), ++i;
-                        }
-                    }
-                } else {
-                    text.push_back(lit_value);
-                }
+    // tables of the current block, either fixed or dynamic ones
+    HuffmanLookup lit;
+    HuffmanLookup dist;
 
-                for (const auto& x : text) std::cout << (char)x;
-                std::cout << std::endl;
-            }
+    byte_t* out_begin;          // output written so far serves as the sliding window
+    byte_t* out_pos;
+    byte_t* out_end;
 
-            return true;
-        } else 
-        {
-            std::cout << "Error" << std::endl;
-        }
-    }
+    size_t copy_length;         // rest of a back-reference that did not fit into the output
+    size_t copy_distance;
+    size_t stored_length;       // bytes of the current stored block still to copy
 
-    return false;
-}
+    uint_t adler;
+    bool verify_adler;
 
-// --------------------------------------------------------
-// PNGImage interface
+    // literals are not counted one by one, they are the coded output that matches did not copy
+    uint64_t block_counts[3];   // stored, fixed and dynamic blocks
+    uint64_t stored_bytes;
+    uint64_t coded_bytes;       // output of Huffman coded blocks
+    uint64_t match_count;
+    uint64_t match_bytes;
+    uint64_t huffman_time;
+};
 
-PNGImage::PNGImage() : pImpl(new Impl()) 
-{
+const size_t InflateState::MAX_WINDOW_SIZE;
 
-}
+InflateState::InflateState() : 
+    bs(), mode(MODE_ZLIB_HEADER), last_block(false), hlit(0), hdist(0), hclen(0), index(0),
+    lit_table(), dist_table(), clen_table(), lit(), dist(), 
+    out_begin(nullptr), out_pos(nullptr), out_end(nullptr), copy_length(0), copy_distance(0), 
+    stored_length(0), adler(1), verify_adler(true), block_counts(), stored_bytes(0), coded_bytes(0), match_count(0), match_bytes(0), 
+    huffman_time(0)
+{}
 
-PNGImage::PNGImage(const PNGImage& other) : pImpl(new Impl(*other.pImpl.get()))
+void InflateState::reset()
 {
-
+    bs = BitStream();
+    mode = MODE_ZLIB_HEADER;
+    last_block = false;
+    hlit = hdist = hclen = index = 0;
+    lit = dist = HuffmanLookup();
+    out_begin = out_pos = out_end = nullptr;
+    copy_length = copy_distance = 0;
+    stored_length = 0;
+    adler = 1;
+    std::fill(block_counts, block_counts + 3, 0);
+    stored_bytes = coded_bytes = match_count = match_bytes = huffman_time = 0;
 }
 
-PNGImage::PNGImage(PNGImage&& other) : pImpl(new Impl())
+void InflateState::add_stats(DecodeStats& stats) const
 {
-    pImpl.swap(other.pImpl);
+    stats.stored_blocks += block_counts[0];
+    stats.fixed_blocks += block_counts[1];
+    stats.dynamic_blocks += block_counts[2];
+    stats.inflated_bytes += stored_bytes + coded_bytes;
+    // the part of a match that did not fit into the output is not in coded_bytes yet
+    stats.literals += coded_bytes + copy_length - match_bytes;
+    stats.matches += match_count;
+    stats.match_bytes += match_bytes;
+    stats.timings.huffman += huffman_time;
 }
 
-PNGImage& PNGImage::operator= (const PNGImage& other)
+InflateState::Status InflateState::need_input()
 {
-    if (&other == this) return *this;
-    
-    PNGImage tmp(other);
-    pImpl.swap(tmp.pImpl);
-    
-    return *this;
+    // all the remaining input is moved into the bit buffer
+    bs.refill();
+    assert(bs.bytes_left() == 0);
+    return NEED_INPUT;
 }
 
-PNGImage& PNGImage::operator= (PNGImage&& other)
+InflateState::Status InflateState::fail(const char* message)
 {
-    if (&other == this) return *this;
-    
-    pImpl.swap(other.pImpl);
-    other.pImpl.reset(new Impl());
-
-    return *this;
+    PNG_LOG(Error, message);
+    mode = MODE_ERROR;
+    return ERROR;
 }
 
-PNGImage::~PNGImage()
+void InflateState::update_adler(size_t& from)
 {
-    // nothing
+    if (verify_adler) adler = adler32(out_begin + from, output_pos() - from, adler);
+    from = output_pos();
 }
 
-bool PNGImage::create(size_t Width, size_t height)
+/*
+  do
+       read block header from input stream.
+       if stored with no compression
+          skip any remaining bits in current partially processed byte
+          read LEN and NLEN (see next section)
+          copy LEN bytes of data to output
+       otherwise
+          if compressed with dynamic Huffman codes
+             read representation of code trees (see
+                subsection below)
+          loop (until end of block code recognized)
+             decode literal/length value from input stream
+             if value < 256
+                copy value (literal byte) to output stream
+             otherwise
+                if value = end of block (256)
+                   break from loop
+                otherwise (value = 257..285)
+                   decode distance from input stream
+
+                   move backwards distance bytes in the output
+                   stream, and copy length bytes from this
+                   position to the output stream.
+          end loop
+    while not last block
+ */
+InflateState::Status InflateState::inflate(const DataView& input)
 {
-    throw NotImplemented();
-    return false;
+    if (mode == MODE_ERROR) return ERROR;
+    if (mode == MODE_DONE) return DONE;
+
+    feed(input);
+    return run();
 }
 
-bool PNGImage::open(const std::string& file_name)
+InflateState::Status InflateState::run()
 {
-    ImageFile file;
-    if (file.open(file_name))
+    static const byte_t code_length_indexes [] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+
+    // the output is checksummed while it is still in cache, the caller may 
+    // drop consumed data between calls
+    size_t checked = output_pos();
+
+    for (;;)
     {
-        PNGImage tmp;
-        if (tmp.pImpl->from_file(file))
+        switch (mode)
         {
-            pImpl.swap(tmp.pImpl);  
-            return true; 
-        }
-    }
-    return false;
-}
+            case MODE_ZLIB_HEADER :
+            {
+                if (!bs.need(16)) return need_input();
 
-bool PNGImage::save_as(const std::string& file_name)
-{
-    throw NotImplemented();
-    return false;
-}
+                byte_t cmf = bs.get(8);
+                byte_t flg = bs.get(8);
+                byte_t cm     = (byte_t) (cmf & 0x0F);
+                byte_t cinfo  = (byte_t) ((cmf >> 4) & 0x0F);
+                byte_t fdict  = (byte_t) ((flg >> 5) & 1);
+
+                size_t sliding_window_size = size_t(1) << (cinfo + 8);
+
+                // CM = 8 denotes the "deflate" compression method
+                // fdict = 0, The additional flags shall not specify a preset dictionary 
+                if ((cmf * 256 + flg) % 31 != 0 || cm != 8 || sliding_window_size > MAX_WINDOW_SIZE || fdict != 0)
+                    return fail("Wrong compression params");
+
+                mode = MODE_BLOCK_HEADER;
+                break;
+            }
+
+            case MODE_BLOCK_HEADER :
+            {
+                Step step = read_block_header();
+                if (step == STEP_NEED_INPUT) return need_input();
+                if (step == STEP_ERROR) return ERROR;
+                break;
+            }
+
+            case MODE_TABLE_COUNTS :
+            {
+                if (!bs.need(14)) return need_input();
+
+                hlit  = bs.get(5) + 257; //  HLIT + 257 code lengths for the literal/length alphabet
+                hdist = bs.get(5) + 1;   //  HDIST + 1 code lengths for the distance alphabet
+                hclen = bs.get(4) + 4;   // (HCLEN + 4) x 3 bits: code lengths for the code length alphabet
+                if (hlit > 286 || hdist > 30) return fail("Wrong huffman code lengths");
+
+                std::fill(clen_lengths, clen_lengths + MAX_HCLEN, 0);
+                index = 0;
+                mode = MODE_TABLE_CLEN;
+                break;
+            }
+
+            case MODE_TABLE_CLEN :
+            {
+                // Read HCLEN * 3 bits for code lengths for code length alphabet
+                for (; index < hclen; ++index) {
+                    if (!bs.need(3)) return need_input();
+                    clen_lengths[code_length_indexes[index]] = bs.get(3);
+                }
+
+                bool built;
+                {
+                    ScopedTimer timer(huffman_time);
+                    built = generate_huffman_codes(clen_lengths, MAX_HCLEN, clen_symbol_entry, CLEN_TABLE_BITS, clen_table);
+                }
+                if (!built) return fail("Wrong huffman code lengths");
+
+                index = 0;
+                mode = MODE_TABLE_LENGTHS;
+                break;
+            }
+
+            case MODE_TABLE_LENGTHS :
+            {
+                // literal/length and distance code lengths form a single sequence, repeat codes may cross the boundary
+                while (index < hlit + hdist) {
+                    Step step = read_code_length();
+                    if (step == STEP_NEED_INPUT) return need_input();
+                    if (step == STEP_ERROR) return ERROR;
+                }
+
+                bool built;
+                {
+                    ScopedTimer timer(huffman_time);
+                    built = code_lengths[256] != 0 &&
+                        generate_huffman_codes(code_lengths, hlit, lit_symbol_entry, LIT_TABLE_BITS, lit_table) &&
+                        generate_huffman_codes(code_lengths + hlit, hdist, dist_symbol_entry, DIST_TABLE_BITS, dist_table);
+                }
+                if (!built) return fail("Wrong huffman code lengths");
+
+                lit = lit_table.lookup();
+                dist = dist_table.lookup();
+                mode = MODE_CODES;
+                break;
+            }
+
+            case MODE_STORED_LENGTH :
+            {
+                // LEN and its one's complement NLEN follow the header at a byte boundary
+                bs.align_to_byte();
+                if (!bs.need(32)) return need_input();
+
+                stored_length = bs.get(16);
+                if (bs.get(16) != (~stored_length & 0xFFFF)) return fail("Wrong stored block length");
+
+                mode = MODE_STORED;
+                break;
+            }
+
+            case MODE_STORED :
+            {
+                // copied straight from the input, a block may span several input pieces
+                const size_t count = std::min(stored_length, static_cast<size_t>(out_end - out_pos));
+                const size_t copied = bs.read_bytes(out_pos, count);
+                out_pos += copied;
+                stored_length -= copied;
+                PNG_STAT(stored_bytes += copied);
+                update_adler(checked);
+
+                if (stored_length == 0) 
+                    mode = last_block ? MODE_ADLER32 : MODE_BLOCK_HEADER;
+                else if (copied == count) 
+                    return OUTPUT_FULL;
+                else 
+                    return need_input();
+                break;
+            }
+
+            case MODE_CODES :
+            {
+                PNG_STAT(coded_bytes -= output_pos());
+                Step step = decode_codes();
+                PNG_STAT(coded_bytes += output_pos());
+                update_adler(checked);
+                if (step == STEP_NEED_INPUT) return need_input();
+                if (step == STEP_OUTPUT_FULL) return OUTPUT_FULL;
+                if (step == STEP_ERROR) return ERROR;
+                mode = last_block ? MODE_ADLER32 : MODE_BLOCK_HEADER;
+                break;
+            }
+
+            case MODE_ADLER32 :
+            {
+                // the checksum is stored big-endian after the last block, starting at a byte boundary
+                bs.align_to_byte();
+                if (!bs.need(32)) return need_input();
+
+                uint_t expected = 0;
+                for (size_t i = 0; i < 4; ++i) expected = (expected << 8) | bs.get(8);
+                if (verify_adler && expected != adler) return fail("Image data checksum does not match");
+
+                mode = MODE_DONE;
+                break;
+            }
+
+            case MODE_DONE : 
+                return DONE;
+
+            case MODE_ERROR : 
+                return ERROR;
+        }
+    }
+}
+
+InflateState::Step InflateState::read_block_header()
+{
+    enum {BTYPE_NO, BTYPE_FIXED, BTYPE_DYNAMIC, BTYPE_ERROR };
+
+    if (!bs.need(3)) return STEP_NEED_INPUT;
+
+    last_block = bs.get(1);
+    byte_t btype = bs.get(2);
+
+    if (btype == BTYPE_NO) {   // stored with no compression
+        PNG_STAT(++block_counts[BTYPE_NO]);
+        mode = MODE_STORED_LENGTH;
+    } else if (btype == BTYPE_FIXED) {
+        PNG_STAT(++block_counts[BTYPE_FIXED]);
+        lit = FIXED_LIT_LOOKUP;
+        dist = FIXED_DIST_LOOKUP;
+        mode = MODE_CODES;
+    } else if (btype == BTYPE_DYNAMIC) {
+        PNG_STAT(++block_counts[BTYPE_DYNAMIC]);
+        mode = MODE_TABLE_COUNTS;
+    } else {
+        fail("Wrong block type");
+        return STEP_ERROR;
+    }
+    return STEP_OK;
+}
+
+InflateState::Step InflateState::read_code_length()
+{
+    const BitStream checkpoint(bs);
+    bs.refill();
+
+    huffman_entry_t entry = read_huffman_code(bs, clen_table.lookup());
+    size_t extra = bs.get(entry_extra(entry));
+    if (bs.eof()) {
+        bs = checkpoint;
+        return STEP_NEED_INPUT;
+    }
+    if (entry_kind(entry) != HUFFMAN_LITERAL) {
+        fail("Wrong code length code");
+        return STEP_ERROR;
+    }
+
+    const size_t count = hlit + hdist;
+    size_t lit_code = entry_value(entry);
+
+    if (lit_code < 16) {
+        // 0 - 15: Represent code lengths of 0 - 15
+        code_lengths[index++] = lit_code;
+        return STEP_OK;
+    }
+
+    byte_t value = 0;
+    size_t times = 0;
+    if (lit_code == 16) {
+        // Copy the previous code length 3 - 6 times (2 bits)
+        if (index == 0) {
+            fail("Wrong code_length size");
+            return STEP_ERROR;
+        }
+        value = code_lengths[index - 1];
+        times = extra + 3;
+    } else if (lit_code == 17) {
+        // Repeat a code length of 0 for 3 - 10 times (3 bits)
+        times = extra + 3;
+    } else {
+        // Repeat a code length of 0 for 11 - 138 times (7 bits)
+        times = extra + 11;
+    }
+    if (index + times > count) {
+        fail("Wrong code_length size");
+        return STEP_ERROR;
+    }
+    for (; times > 0; --times) code_lengths[index++] = value;
+    return STEP_OK;
+}
+
+// decodes one literal or length/distance pair, unless Checked the input must hold enough bits for it
+template <bool Checked>
+InflateState::Step InflateState::decode_symbol()
+{
+    const BitStream checkpoint(bs);
+    bs.refill();
+
+    huffman_entry_t entry = read_huffman_code(bs, lit);
+    uint_t kind = entry_kind(entry);
+
+    if (kind == HUFFMAN_LITERAL) {
+        if (Checked && bs.eof()) {
+            bs = checkpoint;
+            return STEP_NEED_INPUT;
+        }
+        if (out_pos == out_end) {
+            bs = checkpoint;
+            return STEP_OUTPUT_FULL;
+        }
+        *out_pos++ = entry_value(entry);
+        return STEP_OK;
+    }
+
+    size_t length = 0, distance = 0;
+    if (kind == HUFFMAN_BASE) {   // is lentgh / dist code
+        length = entry_value(entry) + bs.get(entry_extra(entry));
+        entry = read_huffman_code(bs, dist);
+        kind = entry_kind(entry);
+        distance = entry_value(entry) + bs.get(entry_extra(entry));
+    }
+
+    if (Checked && bs.eof()) {
+        bs = checkpoint;
+        return STEP_NEED_INPUT;
+    }
+
+    if (kind == HUFFMAN_END) return STEP_BLOCK_END;
+
+    if (kind != HUFFMAN_BASE) {
+        fail("Wrong literal/length or distance code");
+        return STEP_ERROR;
+    }
+
+    if (distance > output_pos()) {
+        fail("Wrong distance");
+        return STEP_ERROR;
+    }
+
+    if (out_end - out_pos >= FAST_OUTPUT_MARGIN) {
+        PNG_STAT(++match_count; match_bytes += length);
+        copy_match(out_pos, distance, length);
+        out_pos += length;
+        return STEP_OK;
+    }
+
+    if (out_pos == out_end) {
+        bs = checkpoint;
+        return STEP_OUTPUT_FULL;
+    }
+
+    PNG_STAT(++match_count; match_bytes += length);
+    copy_length = length;
+    copy_distance = distance;
+    copy_pending();
+    return STEP_OK;
+}
+
+// copies as much of the pending back-reference as fits into the output
+void InflateState::copy_pending()
+{
+    const size_t count = std::min(copy_length, static_cast<size_t>(out_end - out_pos));
+    const byte_t* src = out_pos - copy_distance;
+    for (size_t i = 0; i < count; ++i) out_pos[i] = src[i];
+
+    out_pos += count;
+    copy_length -= count;
+}
+
+InflateState::Step InflateState::decode_codes()
+{
+    // a whole symbol takes up to 48 bits, which are always buffered by refill while 7 bytes are left
+    static const size_t FAST_INPUT_MARGIN = 8;
+
+    if (copy_length > 0) {
+        copy_pending();
+        if (copy_length > 0) return STEP_OUTPUT_FULL;
+    }
+
+    for (;;) {
+        Step step = bs.bytes_left() >= FAST_INPUT_MARGIN ? decode_symbol<false>() : decode_symbol<true>();
+        if (step != STEP_OK) return step == STEP_BLOCK_END ? STEP_OK : step;
+        if (copy_length > 0) return STEP_OUTPUT_FULL;
+    }
+}
+
+// --------------------------------------------------------
+// Deflate
+//
+// Compresses input that is completely in memory, so matches are searched
+// directly in the input and no window has to be slid. Levels follow zlib:
+// 0 stores, 1 probes a single hash slot per position, 2-3 search short hash
+// chains greedily and 4-9 search longer chains with lazy matching. Every
+// block is written with dynamic or fixed Huffman codes or stored, whichever
+// comes out smallest.
+
+static const size_t MIN_MATCH_LENGTH = 3;
+static const size_t WINDOW_SIZE      = 32768;
+static const size_t WINDOW_MASK      = WINDOW_SIZE - 1;
+static const size_t MAX_STORED_SIZE  = 65535;
+static const size_t HASH_BITS        = 15;
+static const size_t HASH_SIZE        = 1 << HASH_BITS;
+static const size_t BLOCK_TOKENS     = 16384;     // symbols per Huffman block
+static const size_t MAX_SKIP         = 32;        // literals level 1 may add past BLOCK_TOKENS
+static const size_t MAX_SEGMENT_SIZE = 1 << 30;   // input per deflate() call, keeps positions in 32 bits
+static const size_t END_OF_BLOCK     = 256;
+static const size_t LIT_CODES        = 286;       // literal/length codes that may occur
+static const size_t DIST_CODES       = 30;
+static const size_t MAX_CLEN_BITS    = 7;
+static const uint_t NO_POSITION      = 0xFFFFFFFF;
+static const uint_t MATCH_TOKEN      = 0x80000000;   // | (length - 3) << 16 | distance
+
+inline uint_t load_le32(const byte_t* p)
+{
+    uint_t v;
+    std::memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+inline size_t count_trailing_zeros(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    size_t n = 0;
+    for (; (v & 1) == 0; v >>= 1) ++n;
+    return n;
+#endif
+}
+
+// length of the common prefix of a and b, at most max_length
+static inline size_t common_length(const byte_t* a, const byte_t* b, size_t max_length)
+{
+    size_t n = 0;
+    for (; n + 8 <= max_length; n += 8)
+    {
+        const uint64_t diff = load_le64(a + n) ^ load_le64(b + n);
+        if (diff) return n + count_trailing_zeros(diff) / 8;
+    }
+    while (n < max_length && a[n] == b[n]) ++n;
+    return n;
+}
+
+// writing bits least significant bit first into a growing byte buffer
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<byte_t>& out) : out(out), pos(out.size()), buf(0), count(0)
+    {}
+
+    // makes room for size more bytes, put() and write() do not check bounds
+    bool reserve(size_t size)
+    {
+        return out.size() >= pos + size + 8 || allocate(out, std::max(pos + size + 8, out.size() * 2));
+    }
+
+    // value must not have bits above n set, n <= 32
+    void put(uint_t value, size_t n)
+    {
+        buf |= static_cast<uint64_t>(value) << count;
+        count += n;
+        if (count >= 32)
+        {
+            const byte_t bytes[4] = { 
+                static_cast<byte_t>(buf), static_cast<byte_t>(buf >> 8), 
+                static_cast<byte_t>(buf >> 16), static_cast<byte_t>(buf >> 24) 
+            };
+            std::memcpy(&out[pos], bytes, 4);
+            pos += 4;
+            buf >>= 32;
+            count -= 32;
+        }
+    }
+
+    // pads with zero bits to the next byte boundary
+    void align()
+    {
+        for (; count > 0; count = count > 8 ? count - 8 : 0, buf >>= 8) out[pos++] = static_cast<byte_t>(buf);
+        buf = 0;
+    }
+
+    // copies bytes, the writer has to be aligned
+    void write(const byte_t* data, size_t size)
+    {
+        assert(count == 0);
+        if (size > 0) std::memcpy(&out[pos], data, size);
+        pos += size;
+    }
+
+    void finish()
+    {
+        align();
+        out.resize(pos);
+    }
+
+private:
+    std::vector<byte_t>& out;
+    size_t pos;
+    uint64_t buf;
+    size_t count;
+};
+
+// symbol lookup for matches and the fixed Huffman codes
+struct DeflateTables {
+    byte_t length_symbol[256];   // by length - 3, symbol - 257
+    byte_t dist_symbol[512];     // by distance - 1 below 256, then by (distance - 1) >> 7
+    byte_t fixed_lit_lengths[LIT_ALPHABET_SIZE];
+    ushort_t fixed_lit_codes[LIT_ALPHABET_SIZE];
+    byte_t fixed_dist_lengths[DIST_ALPHABET_SIZE];
+    ushort_t fixed_dist_codes[DIST_ALPHABET_SIZE];
+
+    DeflateTables();
+
+    static const DeflateTables& get()
+    {
+        static const DeflateTables tables;
+        return tables;
+    }
+};
+
+static void huffman_codes(const byte_t* lengths, size_t count, ushort_t* codes);
+
+DeflateTables::DeflateTables()
+{
+    for (size_t s = 0; s < 28; ++s)
+        for (size_t n = 0; n < (1u << entry_extra(LENGTH_BASES[s])); ++n) length_symbol[entry_value(LENGTH_BASES[s]) - 3 + n] = s;
+    length_symbol[MAX_MATCH_LENGTH - 3] = 28;
+
+    for (size_t s = 0; s < DIST_CODES; ++s)
+    {
+        for (size_t n = 0; n < (1u << entry_extra(DIST_BASES[s])); ++n)
+        {
+            const size_t d = entry_value(DIST_BASES[s]) - 1 + n;
+            if (d < 256) dist_symbol[d] = s;
+            else dist_symbol[256 + (d >> 7)] = s;
+        }
+    }
+
+    for (uint_t s = 0; s < LIT_ALPHABET_SIZE; ++s) fixed_lit_lengths[s] = fixed_lit_length(s);
+    huffman_codes(fixed_lit_lengths, LIT_ALPHABET_SIZE, fixed_lit_codes);
+
+    for (uint_t s = 0; s < DIST_ALPHABET_SIZE; ++s) fixed_dist_lengths[s] = fixed_dist_length(s);
+    huffman_codes(fixed_dist_lengths, DIST_ALPHABET_SIZE, fixed_dist_codes);
+}
+
+static inline size_t dist_symbol(const DeflateTables& tables, size_t distance)
+{
+    const size_t d = distance - 1;
+    return d < 256 ? tables.dist_symbol[d] : tables.dist_symbol[256 + (d >> 7)];
+}
+
+struct HuffmanNode {
+    uint_t key;        // frequency, then code length
+    ushort_t symbol;
+};
+
+// in-place minimum redundancy code of Moffat and Katajainen: keys are frequencies
+// in ascending order on input and code lengths on output
+static void minimum_redundancy(HuffmanNode* a, int n)
+{
+    if (n == 1) 
+    {
+        a[0].key = 1;
+        return;
+    }
+
+    a[0].key += a[1].key;
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; ++next)
+    {
+        if (leaf >= n || a[root].key < a[leaf].key) { a[next].key = a[root].key; a[root++].key = next; }
+        else a[next].key = a[leaf++].key;
+
+        if (leaf >= n || (root < next && a[root].key < a[leaf].key)) { a[next].key += a[root].key; a[root++].key = next; }
+        else a[next].key += a[leaf++].key;
+    }
+
+    a[n - 2].key = 0;
+    for (int next = n - 3; next >= 0; --next) a[next].key = a[a[next].key].key + 1;
+
+    int available = 1, used = 0, depth = 0, next = n - 1;
+    root = n - 2;
+    while (available > 0)
+    {
+        while (root >= 0 && static_cast<int>(a[root].key) == depth) { ++used; --root; }
+        while (available > used) { a[next--].key = depth; --available; }
+        available = 2 * used;
+        ++depth;
+        used = 0;
+    }
+}
+
+// code lengths of a Huffman code limited to max_bits, unused symbols get 0
+static void huffman_code_lengths(const uint_t* freq, size_t count, size_t max_bits, byte_t* lengths)
+{
+    HuffmanNode nodes[LIT_ALPHABET_SIZE];
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        lengths[i] = 0;
+        if (freq[i] > 0) nodes[used++] = HuffmanNode{ freq[i], static_cast<ushort_t>(i) };
+    }
+    if (used == 0) return;
+
+    std::sort(nodes, nodes + used, [](const HuffmanNode& a, const HuffmanNode& b) { 
+        return a.key < b.key || (a.key == b.key && a.symbol < b.symbol); 
+    });
+    minimum_redundancy(nodes, static_cast<int>(used));
+
+    // longer codes are cut to max_bits, then short codes are lengthened until the code fits again
+    uint_t counts[MAX_CODE_BITS + 1] = { 0 };
+    for (size_t i = 0; i < used; ++i) ++counts[std::min<size_t>(nodes[i].key, max_bits)];
+
+    uint_t kraft = 0;
+    for (size_t b = 1; b <= max_bits; ++b) kraft += counts[b] << (max_bits - b);
+    for (; kraft > (1u << max_bits); --kraft)
+    {
+        --counts[max_bits];
+        for (size_t b = max_bits - 1; b > 0; --b)
+        {
+            if (counts[b] == 0) continue;
+            --counts[b];
+            counts[b + 1] += 2;
+            break;
+        }
+    }
+
+    // the most frequent symbols are at the end and get the shortest codes
+    size_t n = used;
+    for (size_t b = 1; b <= max_bits; ++b)
+        for (uint_t c = counts[b]; c > 0; --c) lengths[nodes[--n].symbol] = b;
+}
+
+// canonical codes for the lengths, bit-reversed for least significant bit first output
+static void huffman_codes(const byte_t* lengths, size_t count, ushort_t* codes)
+{
+    ushort_t length_count[MAX_CODE_BITS + 1] = { 0 };
+    for (size_t i = 0; i < count; ++i) ++length_count[lengths[i]];
+    length_count[0] = 0;
+
+    ushort_t next[MAX_CODE_BITS + 1] = { 0 };
+    for (size_t b = 1; b <= MAX_CODE_BITS; ++b) next[b] = (next[b - 1] + length_count[b - 1]) << 1;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t length = lengths[i];
+        ushort_t code = length ? next[length]++ : 0, reversed = 0;
+        for (size_t b = 0; b < length; ++b, code >>= 1) reversed = (reversed << 1) | (code & 1);
+        codes[i] = reversed;
+    }
+}
+
+// a complete code needs two symbols, unused ones are added with frequency 1
+static void ensure_two_symbols(uint_t* freq, size_t count)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) used += freq[i] > 0;
+    for (size_t i = 0; used < 2; ++i)
+    {
+        if (freq[i] > 0) continue;
+        freq[i] = 1;
+        ++used;
+    }
+}
+
+// search parameters of a compression level, as in zlib's configuration table
+struct DeflateLevel {
+    enum Strategy { STORE, SINGLE_PROBE, GREEDY, LAZY };
+
+    ushort_t good_length;   // chains are cut to a quarter behind a match this long
+    ushort_t max_lazy;      // lazy: no search behind a match this long, greedy: no hashing inside longer matches
+    ushort_t nice_length;   // a match this long ends the search
+    ushort_t max_chain;
+    Strategy strategy;
+};
+
+static const DeflateLevel deflate_levels[] = {
+    {  0,   0,   0,    0, DeflateLevel::STORE },
+    {  4,   4,   8,    1, DeflateLevel::SINGLE_PROBE },
+    {  4,   5,  16,    8, DeflateLevel::GREEDY },
+    {  4,   6,  32,   32, DeflateLevel::GREEDY },
+    {  4,   4,  16,   16, DeflateLevel::LAZY },
+    {  8,  16,  32,   32, DeflateLevel::LAZY },
+    {  8,  16, 128,  128, DeflateLevel::LAZY },
+    {  8,  32, 128,  256, DeflateLevel::LAZY },
+    { 32, 128, 258, 1024, DeflateLevel::LAZY },
+    { 32, 258, 258, 4096, DeflateLevel::LAZY },
+};
+
+static const int MAX_DEFLATE_LEVEL = 9;
+
+class DeflateEncoder {
+public:
+    DeflateEncoder();
+
+    // appends data[begin, end) as raw deflate blocks to out, up to 32K bytes before begin 
+    // serve as dictionary; unless final the output ends byte-aligned with an empty stored block
+    bool deflate(const byte_t* data, size_t begin, size_t end, int level, bool final, std::vector<byte_t>& out);
+
+    // appends a complete zlib stream
+    bool compress(const byte_t* data, size_t size, int level, std::vector<byte_t>& out);
+
+private:
+    DeflateEncoder(const DeflateEncoder&);
+    DeflateEncoder& operator= (const DeflateEncoder&);
+
+    // shift and xor as zlib, cheaper than a multiplicative hash and as good for 3 bytes in 15 bits
+    uint_t hash3(size_t pos) const
+    {
+        const byte_t* p = base + pos;
+        return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+    }
+
+    uint_t hash4(size_t pos) const { return (load_le32(base + pos) * 0x9E3779B1u) >> (32 - HASH_BITS); }
+
+    // adds pos to its hash chain, returns the previous chain head
+    uint_t insert(size_t pos)
+    {
+        const uint_t h = hash3(pos);
+        const uint_t head_pos = head[h];
+        prev[pos & WINDOW_MASK] = head_pos != NO_POSITION && pos - head_pos < WINDOW_SIZE ? pos - head_pos : 0;
+        head[h] = static_cast<uint_t>(pos);
+        return head_pos;
+    }
+
+    size_t longest_match(size_t pos, uint_t candidate, size_t best, size_t& distance) const;
+
+    void literal(byte_t value)
+    {
+        tokens[token_count++] = value;
+        ++lit_freq[value];
+        ++block_size;
+    }
+
+    void match(size_t length, size_t distance)
+    {
+        const DeflateTables& tables = DeflateTables::get();
+        tokens[token_count++] = MATCH_TOKEN | static_cast<uint_t>(length - MIN_MATCH_LENGTH) << 16 | static_cast<uint_t>(distance);
+        ++lit_freq[257 + tables.length_symbol[length - MIN_MATCH_LENGTH]];
+        ++dist_freq[dist_symbol(tables, distance)];
+        block_size += length;
+    }
+
+    void compress_single_probe(size_t begin);
+    void compress_greedy(size_t begin);
+    void compress_lazy(size_t begin);
+
+    void maybe_flush()
+    {
+        if (token_count >= BLOCK_TOKENS) flush_block(false);
+    }
+
+    void start_block();
+    void flush_block(bool last);
+    void write_tokens(const byte_t* lit_lengths, const ushort_t* lit_codes, const byte_t* dist_lengths, const ushort_t* dist_codes);
+    void write_stored(const byte_t* data, size_t size, bool last);
+
+    const DeflateLevel* params;
+    const byte_t* base;      // window start, positions are relative to it
+    size_t end;
+    size_t block_start;
+    size_t block_size;       // input bytes covered by the buffered tokens
+    size_t token_count;
+    BitWriter* bits;
+    bool failed;
+
+    std::vector<uint_t> head;
+    std::vector<ushort_t> prev;   // distance to the previous position in the chain, 0 ends it
+    std::vector<uint_t> tokens;
+    uint_t lit_freq[LIT_ALPHABET_SIZE];
+    uint_t dist_freq[DIST_ALPHABET_SIZE];
+};
+
+DeflateEncoder::DeflateEncoder() : 
+    params(nullptr), base(nullptr), end(0), block_start(0), block_size(0), token_count(0), bits(nullptr), failed(false),
+    head(), prev(), tokens(), lit_freq(), dist_freq()
+{}
+
+inline void append_be32(std::vector<byte_t>& out, uint_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<byte_t>(value >> shift));
+}
+
+static void append_zlib_header(std::vector<byte_t>& out, int level)
+{
+    // CM 8 with a 32K window, FLEVEL from the level and FCHECK making the header a multiple of 31
+    const uint_t cmf = 0x78;
+    uint_t flg = (level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3) << 6;
+    flg += (31 - (cmf << 8 | flg) % 31) % 31;
+    out.push_back(static_cast<byte_t>(cmf));
+    out.push_back(static_cast<byte_t>(flg));
+}
+
+bool DeflateEncoder::compress(const byte_t* data, size_t size, int level, std::vector<byte_t>& out)
+{
+    level = std::max(0, std::min(level, MAX_DEFLATE_LEVEL));
+    append_zlib_header(out, level);
+
+    size_t begin = 0;
+    do
+    {
+        const size_t end = size - begin > MAX_SEGMENT_SIZE ? begin + MAX_SEGMENT_SIZE : size;
+        if (!deflate(data, begin, end, level, end == size, out)) return false;
+        begin = end;
+    } while (begin < size);
+
+    append_be32(out, adler32(data, size));
+    return true;
+}
+
+bool DeflateEncoder::deflate(const byte_t* data, size_t begin, size_t end_pos, int level, bool final, std::vector<byte_t>& out)
+{
+    params = &deflate_levels[std::max(0, std::min(level, MAX_DEFLATE_LEVEL))];
+
+    const size_t window_start = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0;
+    base = data + window_start;
+    begin -= window_start;
+    end = end_pos - window_start;
+    assert(end < NO_POSITION);
+
+    BitWriter writer(out);
+    bits = &writer;
+    failed = false;
+
+    if (params->strategy == DeflateLevel::STORE)
+    {
+        write_stored(base + begin, end - begin, final);
+    }
+    else
+    {
+        if (!allocate(head, HASH_SIZE) || !allocate(prev, WINDOW_SIZE) || !allocate(tokens, BLOCK_TOKENS + MAX_SKIP)) return false;
+        std::fill(head.begin(), head.end(), NO_POSITION);
+        block_start = begin;
+        block_size = 0;
+        start_block();
+
+        switch (params->strategy)
+        {
+            case DeflateLevel::SINGLE_PROBE : compress_single_probe(begin); break;
+            case DeflateLevel::GREEDY :       compress_greedy(begin);       break;
+            default :                         compress_lazy(begin);         break;
+        }
+        flush_block(final);
+        if (!final && !failed) write_stored(nullptr, 0, false);
+    }
+
+    if (!failed) writer.finish();
+    bits = nullptr;
+    return !failed;
+}
+
+size_t DeflateEncoder::longest_match(size_t pos, uint_t candidate, size_t best, size_t& distance) const
+{
+    const byte_t* scan = base + pos;
+    const size_t max_length = std::min(MAX_MATCH_LENGTH, end - pos);
+    if (best >= max_length) return best;
+
+    const size_t nice_length = std::min<size_t>(params->nice_length, max_length);
+    const size_t limit = pos >= WINDOW_SIZE ? pos - WINDOW_SIZE + 1 : 0;
+    size_t chain = best >= params->good_length ? params->max_chain >> 2 : params->max_chain;
+
+    while (candidate != NO_POSITION && candidate >= limit && chain-- > 0)
+    {
+        const byte_t* match = base + candidate;
+        if (match[best] == scan[best] && match[0] == scan[0] && match[1] == scan[1])
+        {
+            const size_t length = common_length(match, scan, max_length);
+            if (length > best)
+            {
+                best = length;
+                distance = pos - candidate;
+                if (length >= nice_length) break;
+            }
+        }
+
+        const size_t delta = prev[candidate & WINDOW_MASK];
+        if (delta == 0) break;
+        candidate -= delta;
+    }
+    return best;
+}
+
+// one hash slot per 4-byte string, a match is taken as soon as one is found
+void DeflateEncoder::compress_single_probe(size_t begin)
+{
+    // every 64 probes without a match the next probe is one byte further away, 
+    // incompressible input passes quickly as in LZ4
+    static const size_t SKIP_SHIFT = 6;
+
+    for (size_t pos = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0; pos < begin && pos + 4 <= end; ++pos)
+        head[hash4(pos)] = static_cast<uint_t>(pos);
+
+    size_t pos = begin, misses = 0;
+    while (pos + 4 <= end)
+    {
+        maybe_flush();
+
+        const uint_t h = hash4(pos);
+        const uint_t candidate = head[h];
+        head[h] = static_cast<uint_t>(pos);
+
+        if (candidate != NO_POSITION && pos - candidate < WINDOW_SIZE && load_le32(base + candidate) == load_le32(base + pos))
+        {
+            const size_t length = 4 + common_length(base + candidate + 4, base + pos + 4, std::min(MAX_MATCH_LENGTH, end - pos) - 4);
+            match(length, pos - candidate);
+            pos += length;
+            misses = 0;
+        }
+        else
+        {
+            const size_t step = std::min(std::min(1 + (misses++ >> SKIP_SHIFT), MAX_SKIP), end - pos);
+            for (size_t i = 0; i < step; ++i) literal(base[pos++]);
+        }
+    }
+
+    for (; pos < end; ++pos)
+    {
+        maybe_flush();
+        literal(base[pos]);
+    }
+}
+
+// takes the longest match at each position
+void DeflateEncoder::compress_greedy(size_t begin)
+{
+    for (size_t pos = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0; pos < begin && pos + MIN_MATCH_LENGTH <= end; ++pos)
+        insert(pos);
+
+    size_t pos = begin;
+    while (pos < end)
+    {
+        maybe_flush();
+
+        size_t length = 0, distance = 0;
+        if (pos + MIN_MATCH_LENGTH <= end) length = longest_match(pos, insert(pos), MIN_MATCH_LENGTH - 1, distance);
+
+        if (length >= MIN_MATCH_LENGTH)
+        {
+            match(length, distance);
+            const size_t match_end = pos + length;
+            if (length <= params->max_lazy)
+            {
+                for (++pos; pos < match_end && pos + MIN_MATCH_LENGTH <= end; ++pos) insert(pos);
+            }
+            pos = match_end;
+        }
+        else
+        {
+            literal(base[pos++]);
+        }
+    }
+}
+
+// a match is only taken when the next position does not start a longer one
+void DeflateEncoder::compress_lazy(size_t begin)
+{
+    // short matches far away cost more than the literals they replace
+    static const size_t TOO_FAR = 4096;
+
+    for (size_t pos = begin > WINDOW_SIZE ? begin - WINDOW_SIZE : 0; pos < begin && pos + MIN_MATCH_LENGTH <= end; ++pos)
+        insert(pos);
+
+    size_t length = MIN_MATCH_LENGTH - 1, distance = 0;
+    bool literal_pending = false;   // the byte before pos is not emitted yet
+
+    size_t pos = begin;
+    while (pos < end)
+    {
+        maybe_flush();
+
+        const size_t prev_length = length, prev_distance = distance;
+        uint_t candidate = pos + MIN_MATCH_LENGTH <= end ? insert(pos) : NO_POSITION;
+
+        length = MIN_MATCH_LENGTH - 1;
+        if (candidate != NO_POSITION && prev_length < params->max_lazy)
+        {
+            length = longest_match(pos, candidate, prev_length, distance);
+            if (length <= prev_length) length = MIN_MATCH_LENGTH - 1;
+            else if (length == MIN_MATCH_LENGTH && distance > TOO_FAR) length = MIN_MATCH_LENGTH - 1;
+        }
+
+        if (prev_length >= MIN_MATCH_LENGTH && length <= prev_length)
+        {
+            match(prev_length, prev_distance);
+            const size_t match_end = pos - 1 + prev_length;
+            for (++pos; pos < match_end && pos + MIN_MATCH_LENGTH <= end; ++pos) insert(pos);
+            pos = match_end;
+
+            literal_pending = false;
+            length = MIN_MATCH_LENGTH - 1;
+        }
+        else
+        {
+            if (literal_pending) literal(base[pos - 1]);
+            literal_pending = true;
+            ++pos;
+        }
+    }
+
+    if (literal_pending) literal(base[end - 1]);
+}
+
+void DeflateEncoder::start_block()
+{
+    token_count = 0;
+    block_start += block_size;
+    block_size = 0;
+    std::fill(lit_freq, lit_freq + LIT_ALPHABET_SIZE, 0);
+    std::fill(dist_freq, dist_freq + DIST_ALPHABET_SIZE, 0);
+    lit_freq[END_OF_BLOCK] = 1;
+}
+
+void DeflateEncoder::flush_block(bool last)
+{
+    static const byte_t code_length_order[] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    static const byte_t clen_extra_bits[] = { 2, 3, 7 };   // codes 16, 17, 18
+
+    if (failed) return;
+
+    const DeflateTables& tables = DeflateTables::get();
+
+    // dynamic code
+    uint_t freq[LIT_ALPHABET_SIZE];
+    byte_t lit_lengths[LIT_ALPHABET_SIZE], dist_lengths[DIST_ALPHABET_SIZE];
+
+    std::copy(lit_freq, lit_freq + LIT_CODES, freq);
+    ensure_two_symbols(freq, LIT_CODES);
+    huffman_code_lengths(freq, LIT_CODES, MAX_CODE_BITS, lit_lengths);
+
+    std::copy(dist_freq, dist_freq + DIST_CODES, freq);
+    ensure_two_symbols(freq, DIST_CODES);
+    huffman_code_lengths(freq, DIST_CODES, MAX_CODE_BITS, dist_lengths);
+
+    size_t hlit = LIT_CODES, hdist = DIST_CODES;
+    while (hlit > 257 && lit_lengths[hlit - 1] == 0) --hlit;
+    while (hdist > 1 && dist_lengths[hdist - 1] == 0) --hdist;
+
+    // run-length coded code lengths, entries are symbol | repeat count << 8
+    byte_t all_lengths[LIT_CODES + DIST_CODES];
+    std::copy(lit_lengths, lit_lengths + hlit, all_lengths);
+    std::copy(dist_lengths, dist_lengths + hdist, all_lengths + hlit);
+
+    ushort_t runs[LIT_CODES + DIST_CODES];
+    size_t run_count = 0;
+    uint_t clen_freq[CLEN_ALPHABET_SIZE] = { 0 };
+
+    for (size_t i = 0, total = hlit + hdist; i < total;)
+    {
+        const byte_t length = all_lengths[i];
+        size_t run = 1;
+        while (i + run < total && all_lengths[i + run] == length) ++run;
+        i += run;
+
+        if (length == 0)
+        {
+            for (; run >= 11; run -= std::min<size_t>(run, 138)) runs[run_count++] = 18 | (std::min<size_t>(run, 138) - 11) << 8;
+            if (run >= 3) { runs[run_count++] = 17 | (run - 3) << 8; run = 0; }
+        }
+        else
+        {
+            runs[run_count++] = length;
+            for (--run; run >= 3; run -= std::min<size_t>(run, 6)) runs[run_count++] = 16 | (std::min<size_t>(run, 6) - 3) << 8;
+        }
+        for (; run > 0; --run) runs[run_count++] = length;
+    }
+    for (size_t i = 0; i < run_count; ++i) ++clen_freq[runs[i] & 0xFF];
+
+    byte_t clen_lengths[CLEN_ALPHABET_SIZE];
+    ushort_t clen_codes[CLEN_ALPHABET_SIZE];
+    std::copy(clen_freq, clen_freq + CLEN_ALPHABET_SIZE, freq);
+    ensure_two_symbols(freq, CLEN_ALPHABET_SIZE);
+    huffman_code_lengths(freq, CLEN_ALPHABET_SIZE, MAX_CLEN_BITS, clen_lengths);
+    huffman_codes(clen_lengths, CLEN_ALPHABET_SIZE, clen_codes);
+
+    size_t hclen = CLEN_ALPHABET_SIZE;
+    while (hclen > 4 && clen_lengths[code_length_order[hclen - 1]] == 0) --hclen;
+
+    // block sizes in bits, the extra bits of matches are the same for both Huffman variants
+    uint64_t extra = 0, dynamic_bits = 3 + 14 + 3 * hclen, fixed_bits = 3;
+    for (size_t s = 0; s < LIT_CODES; ++s)
+    {
+        if (s > 256) extra += static_cast<uint64_t>(lit_freq[s]) * entry_extra(LENGTH_BASES[s - 257]);
+        dynamic_bits += static_cast<uint64_t>(lit_freq[s]) * lit_lengths[s];
+        fixed_bits   += static_cast<uint64_t>(lit_freq[s]) * tables.fixed_lit_lengths[s];
+    }
+    for (size_t s = 0; s < DIST_CODES; ++s)
+    {
+        extra        += static_cast<uint64_t>(dist_freq[s]) * entry_extra(DIST_BASES[s]);
+        dynamic_bits += static_cast<uint64_t>(dist_freq[s]) * dist_lengths[s];
+        fixed_bits   += static_cast<uint64_t>(dist_freq[s]) * tables.fixed_dist_lengths[s];
+    }
+    for (size_t s = 0; s < CLEN_ALPHABET_SIZE; ++s) dynamic_bits += static_cast<uint64_t>(clen_freq[s]) * clen_lengths[s];
+    for (size_t s = 16; s < CLEN_ALPHABET_SIZE; ++s) dynamic_bits += static_cast<uint64_t>(clen_freq[s]) * clen_extra_bits[s - 16];
+    dynamic_bits += extra;
+    fixed_bits += extra;
+    const uint64_t stored_bits = (block_size / MAX_STORED_SIZE + 1) * (3 + 7 + 32) + 8 * static_cast<uint64_t>(block_size);
+
+    if (stored_bits <= std::min(dynamic_bits, fixed_bits))
+    {
+        write_stored(base + block_start, block_size, last);
+    }
+    else if (!bits->reserve(token_count * 6 + 512))
+    {
+        failed = true;
+    }
+    else if (fixed_bits <= dynamic_bits)
+    {
+        bits->put(last, 1);
+        bits->put(1, 2);
+        write_tokens(tables.fixed_lit_lengths, tables.fixed_lit_codes, tables.fixed_dist_lengths, tables.fixed_dist_codes);
+    }
+    else
+    {
+        bits->put(last, 1);
+        bits->put(2, 2);
+        bits->put(hlit - 257, 5);
+        bits->put(hdist - 1, 5);
+        bits->put(hclen - 4, 4);
+        for (size_t i = 0; i < hclen; ++i) bits->put(clen_lengths[code_length_order[i]], 3);
+        for (size_t i = 0; i < run_count; ++i)
+        {
+            const size_t symbol = runs[i] & 0xFF;
+            bits->put(clen_codes[symbol], clen_lengths[symbol]);
+            if (symbol >= 16) bits->put(runs[i] >> 8, clen_extra_bits[symbol - 16]);
+        }
+
+        ushort_t lit_codes[LIT_ALPHABET_SIZE], dist_codes[DIST_ALPHABET_SIZE];
+        huffman_codes(lit_lengths, LIT_CODES, lit_codes);
+        huffman_codes(dist_lengths, DIST_CODES, dist_codes);
+        write_tokens(lit_lengths, lit_codes, dist_lengths, dist_codes);
+    }
+
+    start_block();
+}
+
+void DeflateEncoder::write_tokens(const byte_t* lit_lengths, const ushort_t* lit_codes, const byte_t* dist_lengths, const ushort_t* dist_codes)
+{
+    const DeflateTables& tables = DeflateTables::get();
+
+    for (size_t i = 0; i < token_count; ++i)
+    {
+        const uint_t token = tokens[i];
+        if ((token & MATCH_TOKEN) == 0)
+        {
+            bits->put(lit_codes[token], lit_lengths[token]);
+            continue;
+        }
+
+        // code and extra bits of the length, then of the distance, at most 20 and 28 bits
+        const size_t length = ((token >> 16) & 0xFF) + MIN_MATCH_LENGTH;
+        const size_t distance = token & 0xFFFF;
+
+        const size_t l = 257 + tables.length_symbol[length - MIN_MATCH_LENGTH];
+        const huffman_entry_t length_base = LENGTH_BASES[l - 257];
+        bits->put(lit_codes[l] | (length - entry_value(length_base)) << lit_lengths[l], lit_lengths[l] + entry_extra(length_base));
+
+        const size_t d = dist_symbol(tables, distance);
+        const huffman_entry_t dist_base = DIST_BASES[d];
+        bits->put(dist_codes[d] | (distance - entry_value(dist_base)) << dist_lengths[d], dist_lengths[d] + entry_extra(dist_base));
+    }
+    bits->put(lit_codes[END_OF_BLOCK], lit_lengths[END_OF_BLOCK]);
+}
+
+void DeflateEncoder::write_stored(const byte_t* data, size_t size, bool last)
+{
+    if (!bits->reserve(size + (size / MAX_STORED_SIZE + 1) * 5))
+    {
+        failed = true;
+        return;
+    }
+
+    // an empty block is still written, it byte-aligns the stream for flushing
+    do
+    {
+        const size_t n = std::min(size, MAX_STORED_SIZE);
+        bits->put(last && n == size, 1);
+        bits->put(0, 2);
+        bits->align();
+        bits->put(static_cast<uint_t>(n), 16);
+        bits->put(static_cast<uint_t>(~n & 0xFFFF), 16);
+        bits->write(data, n);
+        data += n;
+        size -= n;
+    } while (size > 0);
+}
+
+// --------------------------------------------------------
+// Image header
+
+size_t Header::channels() const
+{
+    switch (colour_type)
+    {
+        case ColourType::Greyscale :   return 1;
+        case ColourType::TrueColour :  return 3;
+        case ColourType::Indexed :     return 1;
+        case ColourType::AGreyscale :  return 2;
+        case ColourType::ATrueColour : return 4;
+    }
+    return 0;
+}
+
+// PNG allows bit depths 1, 2, 4, 8 and 16 depending on the colour type
+static bool bit_depth_allowed(ColourType colour_type, size_t bit_depth)
+{
+    // bit n of the mask allows bit depth n
+    uint_t allowed_bit_depths = 0;
+
+    switch (colour_type)
+    {
+        case ColourType::Greyscale : 
+            allowed_bit_depths = (1 << 1) | (1 << 2) | (1 << 4) | (1 << 8) | (1 << 16);  
+            break;
+        case ColourType::Indexed :     
+            allowed_bit_depths = (1 << 1) | (1 << 2) | (1 << 4) | (1 << 8);
+            break;
+        case ColourType::TrueColour : 
+        case ColourType::AGreyscale :         
+        case ColourType::ATrueColour : 
+            allowed_bit_depths = (1 << 8) | (1 << 16);
+            break;
+    };
+
+    return bit_depth <= 16 && ((allowed_bit_depths >> bit_depth) & 1) != 0;
+}
+
+bool Header::from_file(ImageFile& file)
+{
+    if (!file.is_open() || file.eof()) return false;
+
+    uint_t length, type;
+    file.read(length);
+    file.reset_crc();
+    file.read(type);
+    
+    if (length <= 0) 
+    {
+        PNG_LOG(Error, "Wrong header chunk size");
+        return false;
+    }
+
+    if (static_cast<ChunkType>(type) != ChunkType::IHDR) 
+    {
+        PNG_LOG(Error, "Wrong header chunk type");
+        return false;
+    }
+
+    PNG_LOG(Trace, "Parsing header");
+
+    file >> width 
+         >> height
+         >> bit_depth  
+         >> colour_type
+         >> compression
+         >> filter     
+         >> interlace;   
+    
+    // check image size
+    if (!check_crc(file))
+    {
+        PNG_LOG(Error, "Checksum does not match");
+        return false;   
+    }
+
+    if (width <= 0 || height <= 0) 
+    {
+        PNG_LOG(Error, "Wrong image size");
+        return false; 
+    }
+
+    // check color type and bit depth
+    if (!bit_depth_allowed(colour_type, bit_depth))
+    {
+        PNG_LOG(Error, "Not allowed bit depth");
+        return false; 
+    }
+
+    // only compression method 0 (deflate/inflate) is defined in International Standard
+    if (compression != 0)
+    {
+        PNG_LOG(Error, "Compressoin type " << (int)compression << " not allowed");
+        return false; 
+    }
+
+    // only filter method 0 (adaptive filtering with five basic filter types) is defined in International Standard
+    if (filter != 0)
+    {
+        PNG_LOG(Error, "Filter type " << (int)filter << " not allowed");
+        return false; 
+    }
+
+    // transmission order of the image data : 0 (no interlace) or 1 (Adam7 interlace)
+    if (interlace != 0 && interlace != 1)
+    {
+        PNG_LOG(Error, "Interlace method " << (int)interlace << " not allowed");
+        return false; 
+    }
+
+    PNG_LOG(Info, "\twidth: "       << std::dec << width            << "\n"
+               << "\theight: "      << std::dec << height           << "\n"
+               << "\tbit_depth: "   << std::hex << (int)bit_depth   << "\n"
+               << "\tcolour_type: " << std::hex << (int)colour_type << "\n"
+               << "\tcompression: " << std::hex << (int)compression << "\n"
+               << "\tfilter: "      << std::hex << (int)filter      << "\n"
+               << "\tinterlace: "   << std::hex << (int)interlace);
+
+    return true;
+}
+
+
+// --------------------------------------------------------
+// Scanline reconstruction
+//
+// Every scanline starts with a filter type byte. Kernels reconstruct a row
+// in place given the already reconstructed previous row (zeros for the first
+// row of an image or pass). Sub, Average and Paeth have SIMD variants that
+// handle a whole pixel per step for 3, 4, 6 and 8 bytes per pixel, SSSE3 and
+// AVX2 Sub kernels compute prefix sums over 16 or 32 bytes for 1, 2, 4 and 8
+// bytes per pixel. Other cases go to the scalar kernels.
+
+enum FilterType : byte_t 
+{
+    FILTER_NONE    = 0,
+    FILTER_SUB     = 1,
+    FILTER_UP      = 2,
+    FILTER_AVERAGE = 3,
+    FILTER_PAETH   = 4
+};
+
+typedef void (*filter_kernel_t)(byte_t* row, const byte_t* prev, size_t size, size_t bpp);
+
+struct UnfilterKernels {
+    filter_kernel_t sub;
+    filter_kernel_t up;
+    filter_kernel_t average;
+    filter_kernel_t paeth;
+};
+
+inline byte_t paeth_predictor(int a, int b, int c)
+{
+    int pa = std::abs(b - c);
+    int pb = std::abs(a - c);
+    int pc = std::abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static void unfilter_sub(byte_t* row, const byte_t*, size_t size, size_t bpp)
+{
+    for (size_t i = bpp; i < size; ++i) row[i] += row[i - bpp];
+}
+
+static void unfilter_up(byte_t* row, const byte_t* prev, size_t size, size_t)
+{
+    for (size_t i = 0; i < size; ++i) row[i] += prev[i];
+}
+
+static void unfilter_average(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    size_t i = 0;
+    for (; i < bpp && i < size; ++i) row[i] += prev[i] >> 1;
+    for (; i < size; ++i) row[i] += (row[i - bpp] + prev[i]) >> 1;
+}
+
+static void unfilter_paeth(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    size_t i = 0;
+    for (; i < bpp && i < size; ++i) row[i] += prev[i];
+    for (; i < size; ++i) row[i] += paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+static const UnfilterKernels scalar_unfilter_kernels = {
+    unfilter_sub, unfilter_up, unfilter_average, unfilter_paeth
+};
+
+#ifdef PNG_X86_SIMD
+
+// loads and stores of one pixel of 3, 4, 6 or 8 bytes, kept out of memory round trips
+template <size_t BPP>
+__attribute__((target("sse2"), always_inline))
+inline __m128i load_pixel(const byte_t* p)
+{
+    if (BPP == 8) return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+
+    uint_t lo;
+    ushort_t hi;
+    if (BPP == 4) {
+        std::memcpy(&lo, p, 4);
+        return _mm_cvtsi32_si128(lo);
+    }
+    if (BPP == 3) {
+        std::memcpy(&hi, p, 2);
+        return _mm_cvtsi32_si128(hi | (p[2] << 16));
+    }
+    std::memcpy(&lo, p, 4);
+    std::memcpy(&hi, p + 4, 2);
+    return _mm_unpacklo_epi32(_mm_cvtsi32_si128(lo), _mm_cvtsi32_si128(hi));
+}
+
+template <size_t BPP>
+__attribute__((target("sse2"), always_inline))
+inline void store_pixel(byte_t* p, __m128i x)
+{
+    if (BPP == 8) return _mm_storel_epi64(reinterpret_cast<__m128i*>(p), x);
+
+    uint_t lo = _mm_cvtsi128_si32(x);
+    if (BPP == 4) {
+        std::memcpy(p, &lo, 4);
+    } else if (BPP == 3) {
+        ushort_t hi = static_cast<ushort_t>(lo);
+        std::memcpy(p, &hi, 2);
+        p[2] = static_cast<byte_t>(lo >> 16);
+    } else {
+        ushort_t hi = static_cast<ushort_t>(_mm_cvtsi128_si32(_mm_srli_si128(x, 4)));
+        std::memcpy(p, &lo, 4);
+        std::memcpy(p + 4, &hi, 2);
+    }
+}
+
+template <size_t BPP>
+__attribute__((target("sse2")))
+static void unfilter_sub_sse2(byte_t* row, size_t size)
+{
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i + BPP <= size; i += BPP) {
+        a = _mm_add_epi8(a, load_pixel<BPP>(row + i));
+        store_pixel<BPP>(row + i, a);
+    }
+}
+
+template <size_t BPP>
+__attribute__((target("sse2")))
+static void unfilter_average_sse2(byte_t* row, const byte_t* prev, size_t size)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (size_t i = 0; i + BPP <= size; i += BPP) {
+        __m128i b = load_pixel<BPP>(prev + i);
+        // _mm_avg_epu8 rounds up, average filter rounds down
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), ones));
+        a = _mm_add_epi8(load_pixel<BPP>(row + i), avg);
+        store_pixel<BPP>(row + i, a);
+    }
+}
+
+// Paeth predictor on 16-bit lanes: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+__attribute__((target("sse2"), always_inline))
+inline __m128i paeth_nearest(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+    __m128i use_b = _mm_cmpeq_epi16(smallest, pb);
+    __m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));
+}
+
+template <size_t BPP>
+__attribute__((target("sse2")))
+static void unfilter_paeth_sse2(byte_t* row, const byte_t* prev, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    for (size_t i = 0; i + BPP <= size; i += BPP) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel<BPP>(prev + i), zero);
+        __m128i d = _mm_unpacklo_epi8(load_pixel<BPP>(row + i), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+        a = _mm_and_si128(_mm_add_epi16(d, paeth_nearest(a, b, c, pa, pb, pc)), _mm_set1_epi16(0xFF));
+        store_pixel<BPP>(row + i, _mm_packus_epi16(a, a));
+        c = b;
+    }
+}
+
+template <size_t BPP>
+__attribute__((target("ssse3")))
+static void unfilter_paeth_ssse3(byte_t* row, const byte_t* prev, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    for (size_t i = 0; i + BPP <= size; i += BPP) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel<BPP>(prev + i), zero);
+        __m128i d = _mm_unpacklo_epi8(load_pixel<BPP>(row + i), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+        pa = _mm_abs_epi16(pa);
+        pb = _mm_abs_epi16(pb);
+
+        a = _mm_and_si128(_mm_add_epi16(d, paeth_nearest(a, b, c, pa, pb, pc)), _mm_set1_epi16(0xFF));
+        store_pixel<BPP>(row + i, _mm_packus_epi16(a, a));
+        c = b;
+    }
+}
+
+// broadcasts the last pixel of a 16 byte block over the whole block
+__attribute__((target("ssse3")))
+inline __m128i last_pixel_mask(size_t bpp)
+{
+    switch (bpp) {
+        case 1:  return _mm_set1_epi8(15);
+        case 2:  return _mm_setr_epi8(14,15,14,15,14,15,14,15,14,15,14,15,14,15,14,15);
+        case 4:  return _mm_setr_epi8(12,13,14,15,12,13,14,15,12,13,14,15,12,13,14,15);
+        default: return _mm_setr_epi8(8,9,10,11,12,13,14,15,8,9,10,11,12,13,14,15);
+    }
+}
+
+// prefix sum over pixels in every 16 byte block, bpp is 1, 2, 4 or 8
+__attribute__((target("ssse3")))
+static size_t unfilter_sub_prefix_ssse3(byte_t* row, size_t size, size_t bpp)
+{
+    const __m128i last = last_pixel_mask(bpp);
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        switch (bpp) {
+            case 1: x = _mm_add_epi8(x, _mm_slli_si128(x, 1));  // fall through
+            case 2: x = _mm_add_epi8(x, _mm_slli_si128(x, 2));  // fall through
+            case 4: x = _mm_add_epi8(x, _mm_slli_si128(x, 4));  // fall through
+            default: x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        }
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), x);
+        carry = _mm_shuffle_epi8(x, last);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static void unfilter_sub_x86(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+        case 3: unfilter_sub_sse2<3>(row, size); break;
+        case 4: unfilter_sub_sse2<4>(row, size); break;
+        case 6: unfilter_sub_sse2<6>(row, size); break;
+        case 8: unfilter_sub_sse2<8>(row, size); break;
+        default: unfilter_sub(row, prev, size, bpp);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void unfilter_sub_ssse3(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    if (bpp == 3 || bpp == 6) return unfilter_sub_x86(row, prev, size, bpp);
+
+    size_t done = unfilter_sub_prefix_ssse3(row, size, bpp);
+    if (done == 0) done = bpp;
+    for (size_t i = done; i < size; ++i) row[i] += row[i - bpp];
+}
+
+__attribute__((target("sse2")))
+static void unfilter_up_sse2(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+    }
+    unfilter_up(row + i, prev + i, size - i, bpp);
+}
+
+__attribute__((target("sse2")))
+static void unfilter_average_x86(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+        case 3: unfilter_average_sse2<3>(row, prev, size); break;
+        case 4: unfilter_average_sse2<4>(row, prev, size); break;
+        case 6: unfilter_average_sse2<6>(row, prev, size); break;
+        case 8: unfilter_average_sse2<8>(row, prev, size); break;
+        default: unfilter_average(row, prev, size, bpp);
+    }
+}
+
+__attribute__((target("sse2")))
+static void unfilter_paeth_x86(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+        case 3: unfilter_paeth_sse2<3>(row, prev, size); break;
+        case 4: unfilter_paeth_sse2<4>(row, prev, size); break;
+        case 6: unfilter_paeth_sse2<6>(row, prev, size); break;
+        case 8: unfilter_paeth_sse2<8>(row, prev, size); break;
+        default: unfilter_paeth(row, prev, size, bpp);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void unfilter_paeth_x86_ssse3(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    switch (bpp) {
+        case 3: unfilter_paeth_ssse3<3>(row, prev, size); break;
+        case 4: unfilter_paeth_ssse3<4>(row, prev, size); break;
+        case 6: unfilter_paeth_ssse3<6>(row, prev, size); break;
+        case 8: unfilter_paeth_ssse3<8>(row, prev, size); break;
+        default: unfilter_paeth(row, prev, size, bpp);
+    }
+}
+
+// prefix sum over 32 byte blocks: per 128-bit lane first, then the low lane is carried into the high one
+__attribute__((target("avx2")))
+static void unfilter_sub_avx2(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    if (bpp == 3 || bpp == 6) return unfilter_sub_x86(row, prev, size, bpp);
+
+    const __m128i last128 = last_pixel_mask(bpp);
+    const __m256i last = _mm256_inserti128_si256(_mm256_castsi128_si256(last128), last128, 1);
+    __m256i carry = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        switch (bpp) {
+            case 1: x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));  // fall through
+            case 2: x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));  // fall through
+            case 4: x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));  // fall through
+            default: x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+        }
+        __m256i low_last = _mm256_shuffle_epi8(x, last);
+        x = _mm256_add_epi8(x, _mm256_permute2x128_si256(low_last, low_last, 0x08));
+        x = _mm256_add_epi8(x, carry);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), x);
+        __m256i high_last = _mm256_shuffle_epi8(x, last);
+        carry = _mm256_permute2x128_si256(high_last, high_last, 0x11);
+    }
+    if (i == 0) i = bpp;
+    for (; i < size; ++i) row[i] += row[i - bpp];
+}
+
+__attribute__((target("avx2")))
+static void unfilter_up_avx2(byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_add_epi8(x, b));
+    }
+    unfilter_up_sse2(row + i, prev + i, size - i, bpp);
+}
+
+static const UnfilterKernels sse2_unfilter_kernels = {
+    unfilter_sub_x86, unfilter_up_sse2, unfilter_average_x86, unfilter_paeth_x86
+};
+
+static const UnfilterKernels ssse3_unfilter_kernels = {
+    unfilter_sub_ssse3, unfilter_up_sse2, unfilter_average_x86, unfilter_paeth_x86_ssse3
+};
+
+// Average and Paeth depend on the previous pixel of the same row, so they stay per pixel
+static const UnfilterKernels avx2_unfilter_kernels = {
+    unfilter_sub_avx2, unfilter_up_avx2, unfilter_average_x86, unfilter_paeth_x86_ssse3
+};
+
+#endif
+
+static const UnfilterKernels& select_unfilter_kernels()
+{
+#ifdef PNG_X86_SIMD
+    const CpuFeatures& cpu = CpuFeatures::get();
+    if (cpu.avx2)  return avx2_unfilter_kernels;
+    if (cpu.ssse3) return ssse3_unfilter_kernels;
+    if (cpu.sse2)  return sse2_unfilter_kernels;
+#endif
+    return scalar_unfilter_kernels;
+}
+
+// reconstructs one filtered row in place, prev is the reconstructed previous row or zeros
+inline bool unfilter_row(byte_t filter, byte_t* row, const byte_t* prev, size_t size, size_t bpp)
+{
+    static const UnfilterKernels& kernels = select_unfilter_kernels();
+
+    switch (filter) {
+        case FILTER_NONE:    return true;
+        case FILTER_SUB:     kernels.sub(row, prev, size, bpp); return true;
+        case FILTER_UP:      kernels.up(row, prev, size, bpp); return true;
+        case FILTER_AVERAGE: kernels.average(row, prev, size, bpp); return true;
+        case FILTER_PAETH:   kernels.paeth(row, prev, size, bpp); return true;
+        default:             return false;
+    }
+}
+
+// reconstructs rows of filtered data and drops filter type bytes, out may be equal to data;
+// prev is the reconstructed row above the first one, zeros when null
+bool unfilter_rows(const byte_t* data, size_t row_bytes, size_t rows, size_t bpp, byte_t* out, std::vector<byte_t>& zero_row,
+                   const byte_t* prev = nullptr)
+{
+    if (!prev)
+    {
+        if (!allocate(zero_row, row_bytes)) return false;
+        std::fill(zero_row.begin(), zero_row.end(), 0);
+        prev = zero_row.data();
+    }
+    for (size_t y = 0; y < rows; ++y, data += row_bytes + 1, out += row_bytes) {
+        byte_t filter = data[0];
+        std::memmove(out, data + 1, row_bytes);
+        if (!unfilter_row(filter, out, prev, row_bytes, bpp)) {
+            PNG_LOG(Error, "Wrong filter type " << (int)filter);
+            return false;
+        }
+        prev = out;
+    }
+    return true;
+}
+
+// --------------------------------------------------------
+// Adam7 interlacing
+
+struct Adam7Pass {
+    size_t x0, y0, dx, dy;
+
+    size_t width (size_t image_width)  const { return image_width  > x0 ? (image_width  - x0 + dx - 1) / dx : 0; }
+    size_t height(size_t image_height) const { return image_height > y0 ? (image_height - y0 + dy - 1) / dy : 0; }
+};
+
+static const Adam7Pass ADAM7_PASSES[] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+static const size_t ADAM7_PASS_COUNT = 7;
+
+// size of inflated image data: scanlines of all passes with their filter bytes, 
+// 0 when it does not fit into size_t
+static size_t filtered_data_size(const Header& head)
+{
+    const size_t pass_count = head.interlace ? ADAM7_PASS_COUNT : 1;
+    size_t total = 0;
+
+    for (size_t p = 0; p < pass_count; ++p)
+    {
+        const size_t width  = head.interlace ? ADAM7_PASSES[p].width(head.width)   : head.width;
+        const size_t height = head.interlace ? ADAM7_PASSES[p].height(head.height) : head.height;
+        if (width == 0 || height == 0) continue;
+
+        if (width > (SIZE_MAX - 8) / head.bits_per_pixel()) return 0;
+        const size_t row_size = head.row_bytes(width) + 1;
+        if (height > (SIZE_MAX - total) / row_size) return 0;
+        total += height * row_size;
+    }
+    return total;
+}
+
+// copies count pixels to every dx-th pixel of dst, the pixel size is a constant for the usual sizes
+template <size_t BPP>
+static void scatter_pixels(const byte_t* src, size_t count, size_t dx, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i, src += BPP, dst += dx * BPP) std::memcpy(dst, src, BPP);
+}
+
+static void scatter_pixels(const byte_t* src, size_t count, size_t bpp, size_t dx, byte_t* dst)
+{
+    switch (bpp) {
+        case 1:  return scatter_pixels<1>(src, count, dx, dst);
+        case 2:  return scatter_pixels<2>(src, count, dx, dst);
+        case 3:  return scatter_pixels<3>(src, count, dx, dst);
+        case 4:  return scatter_pixels<4>(src, count, dx, dst);
+        case 6:  return scatter_pixels<6>(src, count, dx, dst);
+        case 8:  return scatter_pixels<8>(src, count, dx, dst);
+        default:
+            for (size_t i = 0; i < count; ++i) std::memcpy(dst + i * dx * bpp, src + i * bpp, bpp);
+    }
+}
+
+// copies count pixels of a row, starting with pixel src_x, to every dx-th pixel of dst, starting with pixel dst_x;
+// sub-byte pixels are merged into zeroed bytes
+static void scatter_row(const byte_t* src, size_t src_x, size_t count, size_t bits_per_pixel, 
+                        byte_t* dst, size_t dst_x, size_t dx)
+{
+    if (bits_per_pixel >= 8) {
+        const size_t bpp = bits_per_pixel / 8;
+        scatter_pixels(src + src_x * bpp, count, bpp, dx, dst + dst_x * bpp);
+        return;
+    }
+    const byte_t mask = static_cast<byte_t>((1 << bits_per_pixel) - 1);
+    for (size_t i = 0; i < count; ++i) {
+        size_t src_bit = (src_x + i) * bits_per_pixel;
+        size_t dst_bit = (dst_x + i * dx) * bits_per_pixel;
+        byte_t v = (src[src_bit / 8] >> (8 - bits_per_pixel - src_bit % 8)) & mask;
+        dst[dst_bit / 8] |= v << (8 - bits_per_pixel - dst_bit % 8);
+    }
+}
+
+// copies count pixels of a row, starting with pixel x, to the start of dst; unused bits of the last byte are zeroed
+static void copy_pixels(const byte_t* src, size_t x, size_t count, size_t bits_per_pixel, byte_t* dst)
+{
+    const size_t bytes = (count * bits_per_pixel + 7) / 8;
+    const size_t shift = x * bits_per_pixel % 8;
+    src += x * bits_per_pixel / 8;
+    if (shift == 0) {
+        std::memcpy(dst, src, bytes);
+    } else {
+        const size_t end_bit = shift + count * bits_per_pixel;   // the source bytes hold bits [0, end_bit)
+        for (size_t k = 0; k < bytes; ++k) {
+            unsigned v = src[k] << shift;
+            if ((k + 1) * 8 < end_bit) v |= src[k + 1] >> (8 - shift);
+            dst[k] = static_cast<byte_t>(v);
+        }
+    }
+    const size_t tail = count * bits_per_pixel % 8;
+    if (tail) dst[bytes - 1] &= static_cast<byte_t>(0xFF << (8 - tail));
+}
+
+// places reconstructed pixels of a pass to their positions in the image
+void deinterlace_pass(const Adam7Pass& pass, const byte_t* data, size_t pass_width, size_t pass_height,
+                      size_t bits_per_pixel, byte_t* image, size_t image_row_bytes)
+{
+    const size_t pass_row_bytes = (pass_width * bits_per_pixel + 7) / 8;
+
+    for (size_t j = 0; j < pass_height; ++j, data += pass_row_bytes)
+        scatter_row(data, 0, pass_width, bits_per_pixel, image + (pass.y0 + j * pass.dy) * image_row_bytes, pass.x0, pass.dx);
+}
+
+// --------------------------------------------------------
+// Regions
+//
+// A region is decoded from the inflated data up to its last scanline, in 
+// interlaced images the last one of the last pass with pixels in the region. 
+// The pixels of pass i lie left of image column c for i < pass.width(c), so 
+// the pass columns and rows inside a region follow from the pass size formulas.
+
+struct Region {
+    size_t x, y, width, height;
+};
+
+static bool check_region(const Header& head, const Region& region)
+{
+    if (region.width == 0 || region.height == 0 || 
+        region.x > head.width  || region.width  > head.width  - region.x ||
+        region.y > head.height || region.height > head.height - region.y)
+    {
+        PNG_LOG(Error, "Region " << region.x << "," << region.y << " " << region.width << "x" << region.height 
+                    << " is not inside the " << head.width << "x" << head.height << " image");
+        return false;
+    }
+    return true;
+}
+
+// size of the inflated data up to the last scanline with pixels of the region, 
+// at most filtered_data_size()
+static size_t region_data_size(const Header& head, const Region& region)
+{
+    if (!head.interlace) return (region.y + region.height) * (head.row_bytes(head.width) + 1);
+
+    size_t offset = 0;
+    size_t end = 0;
+    for (size_t p = 0; p < ADAM7_PASS_COUNT; ++p)
+    {
+        const Adam7Pass& pass = ADAM7_PASSES[p];
+        const size_t width  = pass.width(head.width);
+        const size_t height = pass.height(head.height);
+        if (width == 0 || height == 0) continue;
+
+        const size_t row_size = head.row_bytes(width) + 1;
+        if (pass.width(region.x) < pass.width(region.x + region.width) && 
+            pass.height(region.y) < pass.height(region.y + region.height))
+            end = offset + pass.height(region.y + region.height) * row_size;
+        offset += height * row_size;
+    }
+    return end;
+}
+
+
+// --------------------------------------------------------
+// Palette and transparency
+
+// PLTE entries with the alpha values of tRNS, or the tRNS colour key of a greyscale 
+// or truecolour image; indices past the palette are opaque black
+struct Palette { 
+    byte_t entries[256][4];   // red, green, blue, alpha
+    size_t size;              // PLTE entries
+    size_t alpha_size;        // tRNS entries of an indexed image
+    bool has_key;
+    ushort_t key[3];          // grey, or red, green and blue sample values of transparent pixels
+
+    Palette() : size(0), alpha_size(0), has_key(false)
+    {
+        for (size_t i = 0; i < 256; ++i)
+        {
+            entries[i][0] = entries[i][1] = entries[i][2] = 0;
+            entries[i][3] = 255;
+        }
+        key[0] = key[1] = key[2] = 0;
+    }
+};
+
+inline ushort_t load_be16(const byte_t* p)
+{
+    return static_cast<ushort_t>((p[0] << 8) | p[1]);
+}
+
+inline uint_t load_be32(const byte_t* p)
+{
+    return (uint_t(p[0]) << 24) | (uint_t(p[1]) << 16) | (uint_t(p[2]) << 8) | p[3];
+}
+
+// a palette is required by indexed images and only a suggestion for truecolour ones, which is not kept
+static bool read_palette(const DataView& payload, const Header& head, Palette& palette)
+{
+    if (head.colour_type != ColourType::Indexed) return true;
+
+    const size_t size = payload.size / 3;
+    if (payload.size % 3 != 0 || size == 0 || size > (size_t(1) << head.bit_depth))
+    {
+        PNG_LOG(Error, "Wrong palette size " << payload.size);
+        return false;
+    }
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        std::memcpy(palette.entries[i], payload.data + 3 * i, 3);
+    }
+    palette.size = size;
+    return true;
+}
+
+// like libpng, a tRNS chunk that does not fit the image is ignored
+static bool read_transparency(const DataView& payload, const Header& head, Palette& palette)
+{
+    switch (head.colour_type)
+    {
+        case ColourType::Indexed :
+            if (palette.size == 0)
+            {
+                PNG_LOG(Error, "Transparency before palette");
+                return false;
+            }
+            if (payload.size > palette.size) PNG_LOG(Warning, "Extra transparency entries ignored");
+
+            palette.alpha_size = std::min(payload.size, palette.size);
+            for (size_t i = 0; i < palette.alpha_size; ++i) palette.entries[i][3] = payload.data[i];
+            return true;
+
+        case ColourType::Greyscale :
+        case ColourType::TrueColour :
+        {
+            const size_t channels = head.channels();
+            if (payload.size != 2 * channels)
+            {
+                PNG_LOG(Warning, "Wrong transparency size " << payload.size);
+                return true;
+            }
+            for (size_t c = 0; c < channels; ++c) palette.key[c] = load_be16(payload.data + 2 * c);
+            palette.has_key = true;
+            return true;
+        }
+
+        default:
+            PNG_LOG(Warning, "Transparency of image with alpha channel ignored");
+            return true;
+    }
+}
+
+// --------------------------------------------------------
+// Pixel conversion
+//
+// Rows are converted right after they are unfiltered, while they are still in
+// cache. Greyscale images up to 8 bits and indexed images look their pixels
+// up in a table of 256 RGBA entries, after sub-byte samples are unpacked to
+// one byte each. 16-bit samples are narrowed to their high byte, pixels that
+// match the tRNS colour key get alpha 0, and colour becomes grey as
+// (77 R + 150 G + 29 B + 128) >> 8. RGBA16 output of other images and the
+// colour key of 16-bit images go through 16-bit RGBA pixel by pixel.
+
+static const uint_t NO_KEY = 0xFFFFFFFF;
+
+struct ConvertKernels {
+    // 1, 2 or 4 bit samples to one byte each, not scaled
+    void (*unpack_bits)(const byte_t* src, size_t depth, size_t count, byte_t* dst);
+    // high bytes of 16-bit samples
+    void (*narrow)(const byte_t* src, size_t count, byte_t* dst);
+    // RGBA of 8-bit indices, the small variant needs indices below 16
+    void (*lookup_rgba)(const byte_t* src, size_t count, const byte_t (*table)[4], byte_t* dst);
+    void (*lookup_rgba_small)(const byte_t* src, size_t count, const byte_t (*table)[4], byte_t* dst);
+    // 8-bit pixels to RGBA8, key is the grey value or the red, green and blue bytes of 
+    // transparent pixels packed from the low byte up, or NO_KEY
+    void (*grey_to_rgba)(const byte_t* src, size_t count, uint_t key, byte_t* dst);
+    void (*rgb_to_rgba)(const byte_t* src, size_t count, uint_t key, byte_t* dst);
+    void (*grey_alpha_to_rgba)(const byte_t* src, size_t count, byte_t* dst);
+    void (*rgba_to_rgb)(const byte_t* src, size_t count, byte_t* dst);
+};
+
+inline byte_t luminance(int r, int g, int b)
+{
+    return static_cast<byte_t>((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+static void unpack_bits_scalar(const byte_t* src, size_t depth, size_t count, byte_t* dst)
+{
+    const uint_t mask = (1u << depth) - 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t bit = i * depth;
+        dst[i] = (src[bit / 8] >> (8 - depth - bit % 8)) & mask;
+    }
+}
+
+static void narrow_scalar(const byte_t* src, size_t count, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i) dst[i] = src[2 * i];
+}
+
+static void lookup_rgba_scalar(const byte_t* src, size_t count, const byte_t (*table)[4], byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i) std::memcpy(dst + 4 * i, table[src[i]], 4);
+}
+
+static void grey_to_rgba_scalar(const byte_t* src, size_t count, uint_t key, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i, dst += 4)
+    {
+        dst[0] = dst[1] = dst[2] = src[i];
+        dst[3] = src[i] == key ? 0 : 255;
+    }
+}
+
+static void rgb_to_rgba_scalar(const byte_t* src, size_t count, uint_t key, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i, src += 3, dst += 4)
+    {
+        const uint_t rgb = src[0] | (src[1] << 8) | (src[2] << 16);
+        std::memcpy(dst, src, 3);
+        dst[3] = rgb == key ? 0 : 255;
+    }
+}
+
+static void grey_alpha_to_rgba_scalar(const byte_t* src, size_t count, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i, src += 2, dst += 4)
+    {
+        dst[0] = dst[1] = dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+static void rgba_to_rgb_scalar(const byte_t* src, size_t count, byte_t* dst)
+{
+    for (size_t i = 0; i < count; ++i) std::memcpy(dst + 3 * i, src + 4 * i, 3);
+}
+
+static const ConvertKernels scalar_convert_kernels = {
+    unpack_bits_scalar, narrow_scalar, lookup_rgba_scalar, lookup_rgba_scalar,
+    grey_to_rgba_scalar, rgb_to_rgba_scalar, grey_alpha_to_rgba_scalar, rgba_to_rgb_scalar
+};
+
+#ifdef PNG_X86_SIMD
+
+// splits every byte into its high and low bits field of the given width, interleaved high first
+__attribute__((target("sse2"), always_inline))
+inline void split_samples(__m128i x, int shift, __m128i mask, __m128i& lo, __m128i& hi)
+{
+    const __m128i high = _mm_and_si128(_mm_srli_epi16(x, shift), mask);
+    const __m128i low = _mm_and_si128(x, mask);
+    lo = _mm_unpacklo_epi8(high, low);
+    hi = _mm_unpackhi_epi8(high, low);
+}
+
+// 32 samples per step from 16, 8 or 4 bytes, every split halves the sample width
+__attribute__((target("sse2")))
+static void unpack_bits_sse2(const byte_t* src, size_t depth, size_t count, byte_t* dst)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F), pair = _mm_set1_epi8(0x03), bit = _mm_set1_epi8(0x01);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32, src += 4 * depth, dst += 32)
+    {
+        __m128i lo, hi, unused;
+        if (depth == 4)
+        {
+            split_samples(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), 4, nibble, lo, hi);
+        }
+        else if (depth == 2)
+        {
+            split_samples(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), 4, nibble, lo, unused);
+            split_samples(lo, 2, pair, lo, hi);
+        }
+        else
+        {
+            uint_t word;
+            std::memcpy(&word, src, 4);
+            split_samples(_mm_cvtsi32_si128(static_cast<int>(word)), 4, nibble, lo, unused);
+            split_samples(lo, 2, pair, lo, unused);
+            split_samples(lo, 1, bit, lo, hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), hi);
+    }
+    unpack_bits_scalar(src, depth, count - i, dst);
+}
+
+__attribute__((target("sse2")))
+static void narrow_sse2(const byte_t* src, size_t count, byte_t* dst)
+{
+    // the first byte of a big-endian sample is the low byte of a 16-bit lane
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i + 16));
+        const __m128i packed = _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    narrow_scalar(src + 2 * i, count - i, dst + i);
+}
+
+// each channel of the first 16 entries is a byte shuffle table
+__attribute__((target("ssse3")))
+static void lookup_rgba_small_ssse3(const byte_t* src, size_t count, const byte_t (*table)[4], byte_t* dst)
+{
+    alignas(16) byte_t channels[4][16];
+    for (size_t e = 0; e < 16; ++e)
+        for (size_t c = 0; c < 4; ++c) channels[c][e] = table[e][c];
+
+    const __m128i red   = _mm_load_si128(reinterpret_cast<const __m128i*>(channels[0]));
+    const __m128i green = _mm_load_si128(reinterpret_cast<const __m128i*>(channels[1]));
+    const __m128i blue  = _mm_load_si128(reinterpret_cast<const __m128i*>(channels[2]));
+    const __m128i alpha = _mm_load_si128(reinterpret_cast<const __m128i*>(channels[3]));
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i index = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i r = _mm_shuffle_epi8(red, index), g = _mm_shuffle_epi8(green, index);
+        const __m128i b = _mm_shuffle_epi8(blue, index), a = _mm_shuffle_epi8(alpha, index);
+
+        const __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+        const __m128i ba_lo = _mm_unpacklo_epi8(b, a), ba_hi = _mm_unpackhi_epi8(b, a);
+        __m128i* out = reinterpret_cast<__m128i*>(dst + 4 * i);
+        _mm_storeu_si128(out,     _mm_unpacklo_epi16(rg_lo, ba_lo));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+    }
+    lookup_rgba_scalar(src + i, count - i, table, dst + 4 * i);
+}
+
+// pixels which equal the key in their colour bytes get alpha 0, the others 255
+__attribute__((target("sse2"), always_inline))
+inline __m128i add_key_alpha(__m128i rgb, __m128i key)
+{
+    const __m128i opaque = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    return _mm_or_si128(rgb, _mm_andnot_si128(_mm_cmpeq_epi32(rgb, key), opaque));
+}
+
+// a key that never matches has a non-zero alpha byte
+__attribute__((target("sse2"), always_inline))
+inline __m128i key_vector(uint_t key)
+{
+    return _mm_set1_epi32(static_cast<int>(key));
+}
+
+__attribute__((target("ssse3")))
+static void grey_to_rgba_ssse3(const byte_t* src, size_t count, uint_t key, byte_t* dst)
+{
+    const __m128i keys = key_vector(key == NO_KEY ? NO_KEY : key * 0x010101);
+    const __m128i spread[4] = {
+        _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1),
+        _mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1),
+        _mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1),
+        _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1)
+    };
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i grey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i* out = reinterpret_cast<__m128i*>(dst + 4 * i);
+        for (size_t k = 0; k < 4; ++k)
+            _mm_storeu_si128(out + k, add_key_alpha(_mm_shuffle_epi8(grey, spread[k]), keys));
+    }
+    grey_to_rgba_scalar(src + i, count - i, key, dst + 4 * i);
+}
+
+__attribute__((target("ssse3")))
+static void rgb_to_rgba_ssse3(const byte_t* src, size_t count, uint_t key, byte_t* dst)
+{
+    const __m128i keys = key_vector(key);
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+    // 4 pixels per step from a 16 byte load, which has to stay inside the row
+    size_t i = 0;
+    for (; i + 6 <= count; i += 4)
+    {
+        const __m128i rgb = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i)), spread);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), add_key_alpha(rgb, keys));
+    }
+    rgb_to_rgba_scalar(src + 3 * i, count - i, key, dst + 4 * i);
+}
+
+__attribute__((target("ssse3")))
+static void grey_alpha_to_rgba_ssse3(const byte_t* src, size_t count, byte_t* dst)
+{
+    const __m128i spread_lo = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    const __m128i spread_hi = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), _mm_shuffle_epi8(pixels, spread_lo));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i + 16), _mm_shuffle_epi8(pixels, spread_hi));
+    }
+    grey_alpha_to_rgba_scalar(src + 2 * i, count - i, dst + 4 * i);
+}
+
+__attribute__((target("ssse3")))
+static void rgba_to_rgb_ssse3(const byte_t* src, size_t count, byte_t* dst)
+{
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i rgb = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i)), pack);
+        const uint_t tail = static_cast<uint_t>(_mm_cvtsi128_si32(_mm_srli_si128(rgb, 8)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 3 * i), rgb);
+        std::memcpy(dst + 3 * i + 8, &tail, 4);
+    }
+    rgba_to_rgb_scalar(src + 4 * i, count - i, dst + 3 * i);
+}
+
+__attribute__((target("avx2")))
+static void lookup_rgba_avx2(const byte_t* src, size_t count, const byte_t (*table)[4], byte_t* dst)
+{
+    const int* entries = reinterpret_cast<const int*>(table);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * i), _mm256_i32gather_epi32(entries, index, 4));
+    }
+    lookup_rgba_scalar(src + i, count - i, table, dst + 4 * i);
+}
+
+static const ConvertKernels sse2_convert_kernels = {
+    unpack_bits_sse2, narrow_sse2, lookup_rgba_scalar, lookup_rgba_scalar,
+    grey_to_rgba_scalar, rgb_to_rgba_scalar, grey_alpha_to_rgba_scalar, rgba_to_rgb_scalar
+};
+
+static const ConvertKernels ssse3_convert_kernels = {
+    unpack_bits_sse2, narrow_sse2, lookup_rgba_scalar, lookup_rgba_small_ssse3,
+    grey_to_rgba_ssse3, rgb_to_rgba_ssse3, grey_alpha_to_rgba_ssse3, rgba_to_rgb_ssse3
+};
+
+static const ConvertKernels avx2_convert_kernels = {
+    unpack_bits_sse2, narrow_sse2, lookup_rgba_avx2, lookup_rgba_small_ssse3,
+    grey_to_rgba_ssse3, rgb_to_rgba_ssse3, grey_alpha_to_rgba_ssse3, rgba_to_rgb_ssse3
+};
+
+#endif
+
+static const ConvertKernels& select_convert_kernels()
+{
+#ifdef PNG_X86_SIMD
+    const CpuFeatures& cpu = CpuFeatures::get();
+    if (cpu.avx2)  return avx2_convert_kernels;
+    if (cpu.ssse3) return ssse3_convert_kernels;
+    if (cpu.sse2)  return sse2_convert_kernels;
+#endif
+    return scalar_convert_kernels;
+}
+
+// rows of images that are converted are unfiltered in strips of about this size, 
+// so they are converted while still in cache
+static const size_t CONVERT_STRIP_SIZE = 1 << 16;
+
+// converts the rows of one image once its header and palette are known
+class PixelConverter {
+public:
+    PixelConverter() : kernels(select_convert_kernels()), in(), format(PixelFormat::Native), path(LOOKUP), 
+                       key(NO_KEY), scratch()
+    {}
+
+    // true when the stored pixels already have the format
+    static bool is_native(const Header& head, PixelFormat format);
+    // header of converted pixels
+    static Header converted_header(const Header& head, PixelFormat format);
+
+    bool setup(const Header& head, const Palette& palette, PixelFormat format);
+    // converts a row of width pixels
+    void convert(const byte_t* src, size_t width, byte_t* dst);
+
+private:
+    PixelConverter(const PixelConverter&);
+    PixelConverter& operator= (const PixelConverter&);
+
+    enum Path { LOOKUP, EXPAND, PER_PIXEL };
+
+    void lookup(const byte_t* indices, size_t width, byte_t* dst) const;
+    void expand(const byte_t* samples, size_t channels, size_t width, byte_t* dst) const;
+    void convert_per_pixel(const byte_t* src, size_t width, byte_t* dst) const;
+    void read_rgba16(const byte_t* src, size_t i, uint_t* rgba) const;
+
+    const ConvertKernels& kernels;
+    Header in;
+    PixelFormat format;
+    Path path;
+    uint_t key;                   // colour key of 8-bit samples as the kernels take it
+    Palette palette;
+    byte_t table[256][4];         // RGBA of every index or greyscale value
+    byte_t grey_table[256];
+    std::vector<byte_t> scratch;  // unpacked or narrowed samples of a row
+};
+
+bool PixelConverter::is_native(const Header& head, PixelFormat format)
+{
+    switch (format)
+    {
+        case PixelFormat::RGBA8 :  return head.colour_type == ColourType::ATrueColour && head.bit_depth == 8;
+        case PixelFormat::RGB8 :   return head.colour_type == ColourType::TrueColour && head.bit_depth == 8;
+        case PixelFormat::Grey8 :  return head.colour_type == ColourType::Greyscale && head.bit_depth == 8;
+        case PixelFormat::RGBA16 : return head.colour_type == ColourType::ATrueColour && head.bit_depth == 16;
+        default:                   return true;
+    }
+}
+
+Header PixelConverter::converted_header(const Header& head, PixelFormat format)
+{
+    Header out = head;
+    switch (format)
+    {
+        case PixelFormat::RGBA8 :  out.colour_type = ColourType::ATrueColour; out.bit_depth = 8;  break;
+        case PixelFormat::RGB8 :   out.colour_type = ColourType::TrueColour;  out.bit_depth = 8;  break;
+        case PixelFormat::Grey8 :  out.colour_type = ColourType::Greyscale;   out.bit_depth = 8;  break;
+        case PixelFormat::RGBA16 : out.colour_type = ColourType::ATrueColour; out.bit_depth = 16; break;
+        default:                   break;
+    }
+    return out;
+}
+
+bool PixelConverter::setup(const Header& head, const Palette& pal, PixelFormat fmt)
+{
+    in = head;
+    format = fmt;
+    palette = pal;
+
+    const bool grey = head.colour_type == ColourType::Greyscale;
+    if (head.colour_type == ColourType::Indexed || (grey && head.bit_depth <= 8)) path = LOOKUP;
+    else if (format == PixelFormat::RGBA16) path = PER_PIXEL;
+    else if (head.bit_depth == 16 && palette.has_key && format == PixelFormat::RGBA8) path = PER_PIXEL;
+    else path = EXPAND;
+
+    // grey 8 to RGBA8 expands faster than it looks up, the other formats have no kernel
+    if (path == LOOKUP && grey && head.bit_depth == 8 && format == PixelFormat::RGBA8) path = EXPAND;
+
+    // keys out of the sample range never match
+    key = NO_KEY;
+    if (palette.has_key && head.bit_depth == 8 && std::max(palette.key[0], std::max(palette.key[1], palette.key[2])) <= 255)
+        key = grey ? palette.key[0] : palette.key[0] | (palette.key[1] << 8) | (palette.key[2] << 16);
+
+    if (path == LOOKUP || path == PER_PIXEL)
+    {
+        const uint_t max = (1u << std::min<uint_t>(head.bit_depth, 8)) - 1;
+        for (uint_t v = 0; v < 256; ++v)
+        {
+            if (head.colour_type == ColourType::Indexed)
+            {
+                std::memcpy(table[v], palette.entries[v], 4);
+            }
+            else
+            {
+                table[v][0] = table[v][1] = table[v][2] = v <= max ? static_cast<byte_t>(v * 255 / max) : 0;
+                table[v][3] = palette.has_key && v == palette.key[0] ? 0 : 255;
+            }
+            grey_table[v] = luminance(table[v][0], table[v][1], table[v][2]);
+        }
+    }
+
+    return allocate(scratch, static_cast<size_t>(head.width) * head.channels());
+}
+
+void PixelConverter::convert(const byte_t* src, size_t width, byte_t* dst)
+{
+    if (path == PER_PIXEL) return convert_per_pixel(src, width, dst);
+
+    if (path == LOOKUP)
+    {
+        if (in.bit_depth < 8)
+        {
+            kernels.unpack_bits(src, in.bit_depth, width, scratch.data());
+            src = scratch.data();
+        }
+        return lookup(src, width, dst);
+    }
+
+    const size_t channels = in.channels();
+    if (in.bit_depth == 16)
+    {
+        // without a change of channels narrowing is all there is to do
+        if (channels == converted_header(in, format).channels()) return kernels.narrow(src, width * channels, dst);
+
+        kernels.narrow(src, width * channels, scratch.data());
+        src = scratch.data();
+    }
+    expand(src, channels, width, dst);
+}
+
+void PixelConverter::lookup(const byte_t* indices, size_t width, byte_t* dst) const
+{
+    switch (format)
+    {
+        case PixelFormat::RGBA8 :
+            if (in.bit_depth <= 4) kernels.lookup_rgba_small(indices, width, table, dst);
+            else kernels.lookup_rgba(indices, width, table, dst);
+            break;
+        case PixelFormat::RGB8 :
+            for (size_t i = 0; i < width; ++i) std::memcpy(dst + 3 * i, table[indices[i]], 3);
+            break;
+        case PixelFormat::RGBA16 :
+            // v * 257 has v in both bytes
+            for (size_t i = 0; i < width; ++i)
+                for (size_t c = 0; c < 4; ++c, dst += 2) dst[0] = dst[1] = table[indices[i]][c];
+            break;
+        default:
+            for (size_t i = 0; i < width; ++i) dst[i] = grey_table[indices[i]];
+            break;
+    }
+}
+
+// 8-bit samples of 1 to 4 channels to RGBA8, RGB8 or Grey8
+void PixelConverter::expand(const byte_t* samples, size_t channels, size_t width, byte_t* dst) const
+{
+    if (format == PixelFormat::RGBA8)
+    {
+        switch (channels)
+        {
+            case 1 : return kernels.grey_to_rgba(samples, width, key, dst);
+            case 2 : return kernels.grey_alpha_to_rgba(samples, width, dst);
+            case 3 : return kernels.rgb_to_rgba(samples, width, key, dst);
+            default: std::memcpy(dst, samples, width * 4); return;
+        }
+    }
+    if (format == PixelFormat::RGB8 && channels == 4) return kernels.rgba_to_rgb(samples, width, dst);
+
+    for (size_t i = 0; i < width; ++i, samples += channels)
+    {
+        const byte_t r = samples[0];
+        const byte_t g = channels >= 3 ? samples[1] : r;
+        const byte_t b = channels >= 3 ? samples[2] : r;
+        if (format == PixelFormat::RGB8)
+        {
+            *dst++ = r;
+            *dst++ = g;
+            *dst++ = b;
+        }
+        else
+        {
+            *dst++ = channels >= 3 ? luminance(r, g, b) : r;
+        }
+    }
+}
+
+// pixel i of a row as 16-bit RGBA
+void PixelConverter::read_rgba16(const byte_t* src, size_t i, uint_t* rgba) const
+{
+    const size_t depth = in.bit_depth;
+    if (depth < 8 || in.colour_type == ColourType::Indexed)
+    {
+        const size_t bit = i * depth;
+        const size_t value = depth == 8 ? src[i] : (src[bit / 8] >> (8 - depth - bit % 8)) & ((1u << depth) - 1);
+        for (size_t c = 0; c < 4; ++c) rgba[c] = table[value][c] * 257;
+        return;
+    }
+
+    const size_t channels = in.channels();
+    uint_t samples[4] = { 0, 0, 0, 0 };
+    for (size_t c = 0; c < channels; ++c)
+    {
+        samples[c] = depth == 16 ? load_be16(src + 2 * (i * channels + c)) : src[i * channels + c] * 257;
+    }
+
+    const bool colour = channels >= 3;
+    rgba[0] = samples[0];
+    rgba[1] = colour ? samples[1] : samples[0];
+    rgba[2] = colour ? samples[2] : samples[0];
+    rgba[3] = channels == 2 || channels == 4 ? samples[channels - 1] : 0xFFFF;
+
+    if (palette.has_key)
+    {
+        // the key has the bit depth of the samples
+        const uint_t scale = depth == 16 ? 1 : 257;
+        bool match = rgba[0] == palette.key[0] * scale;
+        if (colour) match = match && rgba[1] == palette.key[1] * scale && rgba[2] == palette.key[2] * scale;
+        if (match) rgba[3] = 0;
+    }
+}
+
+// RGBA16 of images with 8 or 16 bit samples, and RGBA8 of 16-bit images with a colour key
+void PixelConverter::convert_per_pixel(const byte_t* src, size_t width, byte_t* dst) const
+{
+    for (size_t i = 0; i < width; ++i)
+    {
+        uint_t rgba[4];
+        read_rgba16(src, i, rgba);
+        for (size_t c = 0; c < 4; ++c)
+        {
+            if (format == PixelFormat::RGBA16)
+            {
+                *dst++ = static_cast<byte_t>(rgba[c] >> 8);
+                *dst++ = static_cast<byte_t>(rgba[c]);
+            }
+            else
+            {
+                *dst++ = static_cast<byte_t>(rgba[c] >> 8);
+            }
+        }
+    }
+}
+
+// --------------------------------------------------------
+// PNG implementation
+
+struct PNGImage::Impl {
+    Header head;
+    Palette palette;
+    std::vector<byte_t> data;   // packed pixel rows
+    DecodeStats stats;
+
+    Impl() : head(), palette(), data(), stats()
+    {}
+};
+
+// --------------------------------------------------------
+// Downscaling
+//
+// Scaled decodes inflate into a sliding window, like RowReader, and every 
+// scanline is reconstructed, converted and added to a row of sums right away, 
+// so neither the inflated data nor the full-size pixels are held. An output 
+// pixel is the rounded mean of its block, blocks at the right and bottom edge 
+// may be smaller. Adam7 images are sampled instead: the passes up to the one 
+// with a pixel spacing of the scale hold the top-left pixel of every block.
+
+// space for inflated data beyond the deflate window, at least one scanline
+static const size_t SCALED_READ_AHEAD = 32768;
+
+// inflate window of scaled decodes, the image size has been checked
+static size_t scaled_window_size(const Header& head)
+{
+    return InflateState::MAX_WINDOW_SIZE + std::max(head.row_bytes(head.width) + 1, SCALED_READ_AHEAD);
+}
+
+size_t thumbnail_scale(const Header& head, size_t width, size_t height)
+{
+    size_t scale = 8;
+    while (scale > 1 && ((head.width + scale - 1) / scale < width || (head.height + scale - 1) / scale < height)) scale /= 2;
+    return scale;
+}
+
+// add the samples of a row to the sums of their columns
+typedef void (*add_samples_t)(const byte_t* samples, size_t count, uint_t* sums);
+
+struct ScaleKernels {
+    add_samples_t add8;
+    add_samples_t add16;   // big-endian samples
+};
+
+static void add_samples8_scalar(const byte_t* samples, size_t count, uint_t* sums)
+{
+    for (size_t i = 0; i < count; ++i) sums[i] += samples[i];
+}
+
+static void add_samples16_scalar(const byte_t* samples, size_t count, uint_t* sums)
+{
+    for (size_t i = 0; i < count; ++i) sums[i] += samples[2 * i] << 8 | samples[2 * i + 1];
+}
+
+#ifdef PNG_X86_SIMD
+
+// widens eight 16-bit lanes and adds them to eight sums
+__attribute__((target("sse2"), always_inline))
+inline void add_lanes16_sse2(__m128i lanes, uint_t* sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i* low  = reinterpret_cast<__m128i*>(sums);
+    __m128i* high = reinterpret_cast<__m128i*>(sums + 4);
+    _mm_storeu_si128(low,  _mm_add_epi32(_mm_loadu_si128(low),  _mm_unpacklo_epi16(lanes, zero)));
+    _mm_storeu_si128(high, _mm_add_epi32(_mm_loadu_si128(high), _mm_unpackhi_epi16(lanes, zero)));
+}
+
+__attribute__((target("sse2")))
+static void add_samples8_sse2(const byte_t* samples, size_t count, uint_t* sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+        add_lanes16_sse2(_mm_unpacklo_epi8(v, zero), sums + i);
+        add_lanes16_sse2(_mm_unpackhi_epi8(v, zero), sums + i + 8);
+    }
+    add_samples8_scalar(samples + i, count - i, sums + i);
+}
+
+__attribute__((target("sse2")))
+static void add_samples16_sse2(const byte_t* samples, size_t count, uint_t* sums)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + 2 * i));
+        add_lanes16_sse2(_mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)), sums + i);
+    }
+    add_samples16_scalar(samples + 2 * i, count - i, sums + i);
+}
+
+static const ScaleKernels sse2_scale_kernels = { add_samples8_sse2, add_samples16_sse2 };
+
+#endif
+
+static const ScaleKernels scalar_scale_kernels = { add_samples8_scalar, add_samples16_scalar };
+
+static const ScaleKernels& select_scale_kernels()
+{
+#ifdef PNG_X86_SIMD
+    if (CpuFeatures::get().sse2) return sse2_scale_kernels;
+#endif
+    return scalar_scale_kernels;
+}
+
+class Downscaler {
+public:
+    Downscaler() : kernels(select_scale_kernels()), head(), out(), scale(1), converter(nullptr), image(nullptr), out_row_bytes(0), last_pass(0), 
+                   pass(0), pass_y(0), width(0), rows(0), prev_row(), row(), converted(), sums()
+    {}
+
+    static bool is_valid_scale(size_t scale) { return scale == 1 || scale == 2 || scale == 4 || scale == 8; }
+    // header of the image scaled from pixels described by out
+    static Header scaled_header(const Header& out, size_t scale);
+
+    // head is the header of the file and out the one of the pixels that are scaled, converted 
+    // from the rows by converter unless it is null; the scaled rows are stored into image
+    bool start(const Header& head, const Header& out, size_t scale, PixelConverter* converter, byte_t* image);
+    // reconstructs and adds the complete scanlines at the start of data, used is the size they took
+    bool add(const byte_t* data, size_t size, size_t& used, DecodeTimings& timings);
+    // every scanline the scaled image needs was added
+    bool complete() const { return pass > last_pass; }
+    // passes after the needed ones have scanlines
+    bool skips_passes() const;
+
+private:
+    Downscaler(const Downscaler&);
+    Downscaler& operator= (const Downscaler&);
+
+    bool next_pass();
+    void add_row(const byte_t* pixels);
+    void store_row(size_t y);
+
+    const ScaleKernels& kernels;
+    Header head;
+    Header out;
+    size_t scale;
+    PixelConverter* converter;
+    byte_t* image;
+    size_t out_row_bytes;
+    size_t last_pass;               // last Adam7 pass that is needed, 0 for non-interlaced images
+    size_t pass;
+    size_t pass_y;                  // row within the current pass
+    size_t width;                   // row width in pixels
+    size_t rows;                    // rows added to the sums
+    std::vector<byte_t> prev_row;   // reconstructed previous row of the current pass
+    std::vector<byte_t> row;
+    std::vector<byte_t> converted;
+    std::vector<uint_t> sums;       // of every sample column over the rows of the current block
+};
+
+Header Downscaler::scaled_header(const Header& out, size_t scale)
+{
+    Header scaled = out;
+    scaled.width  = static_cast<uint_t>((out.width  + scale - 1) / scale);
+    scaled.height = static_cast<uint_t>((out.height + scale - 1) / scale);
+    return scaled;
+}
+
+bool Downscaler::start(const Header& file_head, const Header& pixels_head, size_t factor, PixelConverter* pixel_converter, 
+                       byte_t* scaled_image)
+{
+    head = file_head;
+    out = pixels_head;
+    scale = factor;
+    converter = pixel_converter;
+    image = scaled_image;
+
+    const Header scaled = scaled_header(out, scale);
+    out_row_bytes = scaled.row_bytes(scaled.width);
+    if (!head.interlace)
+    {
+        if (!allocate(sums, out.width * out.channels())) return false;
+        std::fill(sums.begin(), sums.end(), 0);
+    }
+    if (converter && !allocate(converted, out.row_bytes(head.width))) return false;
+
+    // the pixel spacing of passes 1, 3, 5 and 7 is 8, 4, 2 and 1
+    last_pass = !head.interlace ? 0 : scale == 8 ? 0 : scale == 4 ? 2 : scale == 2 ? 4 : 6;
+    pass = 0;
+    rows = 0;
+    return next_pass();
+}
+
+bool Downscaler::skips_passes() const
+{
+    if (!head.interlace) return false;
+
+    for (size_t p = last_pass + 1; p < ADAM7_PASS_COUNT; ++p)
+    {
+        if (ADAM7_PASSES[p].width(head.width) != 0 && ADAM7_PASSES[p].height(head.height) != 0) return true;
+    }
+    return false;
+}
+
+// moves to the first non-empty pass starting from the current one
+bool Downscaler::next_pass()
+{
+    if (!head.interlace)
+    {
+        width = head.width;
+    }
+    else
+    {
+        for (; pass <= last_pass; ++pass)
+        {
+            width = ADAM7_PASSES[pass].width(head.width);
+            if (width != 0 && ADAM7_PASSES[pass].height(head.height) != 0) break;
+        }
+    }
+    if (complete()) return true;
+
+    pass_y = 0;
+    if (!allocate(prev_row, head.row_bytes(width)) || !allocate(row, prev_row.size())) return false;
+    std::fill(prev_row.begin(), prev_row.end(), 0);
+    return true;
+}
+
+bool Downscaler::add(const byte_t* data, size_t size, size_t& used, DecodeTimings& timings)
+{
+    used = 0;
+    while (!complete() && size - used > row.size())
+    {
+        const size_t row_bytes = row.size();
+        const byte_t* filtered = data + used;
+        {
+            ScopedTimer timer(timings.unfilter);
+            if (pass_y > 0) prev_row.swap(row);
+            std::memcpy(row.data(), filtered + 1, row_bytes);
+            if (!unfilter_row(filtered[0], row.data(), prev_row.data(), row_bytes, head.filter_bpp()))
+            {
+                PNG_LOG(Error, "Wrong filter type " << (int)filtered[0]);
+                return false;
+            }
+        }
+        used += row_bytes + 1;
+
+        {
+            ScopedTimer timer(timings.convert);
+            const byte_t* pixels = row.data();
+            if (converter)
+            {
+                converter->convert(pixels, width, converted.data());
+                pixels = converted.data();
+            }
+            add_row(pixels);
+        }
+
+        const size_t pass_height = head.interlace ? ADAM7_PASSES[pass].height(head.height) : head.height;
+        if (++pass_y == pass_height)
+        {
+            ++pass;
+            if (!next_pass()) return false;
+        }
+    }
+    return true;
+}
+
+void Downscaler::add_row(const byte_t* pixels)
+{
+    if (head.interlace)
+    {
+        // every pixel of the needed passes is the top-left one of a block
+        const Adam7Pass& p = ADAM7_PASSES[pass];
+        byte_t* dst = image + (p.y0 + pass_y * p.dy) / scale * out_row_bytes;
+        scatter_row(pixels, 0, width, out.bits_per_pixel(), dst, p.x0 / scale, p.dx / scale);
+        return;
+    }
+
+    if (out.bit_depth == 8) kernels.add8(pixels, sums.size(), sums.data());
+    else                    kernels.add16(pixels, sums.size(), sums.data());
+
+    if (++rows == scale || pass_y + 1 == head.height)
+    {
+        store_row(pass_y / scale);
+        rows = 0;
+    }
+}
+
+// stores the rounded mean of the column sums of one block
+template <size_t CHANNELS, size_t SAMPLE_BYTES>
+inline byte_t* store_mean(const uint_t* sums, size_t block_width, uint_t count, size_t shift, byte_t* dst)
+{
+    uint_t totals[CHANNELS];
+    for (size_t c = 0; c < CHANNELS; ++c) totals[c] = count / 2;
+    for (size_t i = 0; i < block_width; ++i, sums += CHANNELS)
+        for (size_t c = 0; c < CHANNELS; ++c) totals[c] += sums[c];
+
+    for (size_t c = 0; c < CHANNELS; ++c)
+    {
+        const uint_t mean = shift != SIZE_MAX ? totals[c] >> shift : totals[c] / count;
+        if (SAMPLE_BYTES == 2) *dst++ = static_cast<byte_t>(mean >> 8);
+        *dst++ = static_cast<byte_t>(mean);
+    }
+    return dst;
+}
+
+// stores the block means of the column sums of a row, width pixels wide
+template <size_t CHANNELS, size_t SAMPLE_BYTES>
+static void store_means(const uint_t* sums, size_t width, size_t scale, size_t rows, byte_t* dst)
+{
+    // blocks have power of two counts, except at the right and bottom edge where they are divided
+    const uint_t count = static_cast<uint_t>(scale * rows);
+    size_t shift = 0;
+    while ((uint_t(1) << shift) < count) ++shift;
+    if ((uint_t(1) << shift) != count) shift = SIZE_MAX;
+
+    size_t x = 0;
+    for (; x + scale <= width; x += scale, sums += scale * CHANNELS)
+        dst = store_mean<CHANNELS, SAMPLE_BYTES>(sums, scale, count, shift, dst);
+    if (x < width) store_mean<CHANNELS, SAMPLE_BYTES>(sums, width - x, static_cast<uint_t>((width - x) * rows), SIZE_MAX, dst);
+}
+
+template <size_t CHANNELS>
+static void store_means(const uint_t* sums, size_t width, size_t scale, size_t rows, size_t bit_depth, byte_t* dst)
+{
+    if (bit_depth == 8) store_means<CHANNELS, 1>(sums, width, scale, rows, dst);
+    else                store_means<CHANNELS, 2>(sums, width, scale, rows, dst);
+}
+
+// stores the block means as row y of the scaled image and clears the sums
+void Downscaler::store_row(size_t y)
+{
+    byte_t* dst = image + y * out_row_bytes;
+    switch (out.channels()) {
+        case 1:  store_means<1>(sums.data(), out.width, scale, rows, out.bit_depth, dst); break;
+        case 2:  store_means<2>(sums.data(), out.width, scale, rows, out.bit_depth, dst); break;
+        case 3:  store_means<3>(sums.data(), out.width, scale, rows, out.bit_depth, dst); break;
+        default: store_means<4>(sums.data(), out.width, scale, rows, out.bit_depth, dst); break;
+    }
+    std::fill(sums.begin(), sums.end(), 0);
+}
+
+// --------------------------------------------------------
+// Decoder
+//
+// Holds everything a decode needs besides the image: the file, inflate state 
+// with its Huffman tables and the scratch buffers. Non-interlaced images are 
+// inflated and unfiltered in the image buffer itself, interlaced ones are 
+// inflated into a scratch buffer and deinterlaced into the image. Images 
+// converted to another pixel format are unfiltered in the scratch buffer and
+// converted into the image in strips of rows, or pass by pass. Regions are 
+// always inflated into the scratch buffer, only as far as their last row. 
+// Scaled images use the scratch buffer as a sliding inflate window.
+
+struct Decoder::Impl {
+    DecodeOptions options;
+    ImageFile file;
+    InflateState inflater;
+    std::vector<byte_t> filtered;   // inflated data of interlaced images
+    std::vector<byte_t> zero_row;   // previous row of the first scanline of a pass
+    std::vector<byte_t> converted;  // converted pixels of an Adam7 pass
+    std::vector<byte_t> columns;    // region columns of a sub-byte row, starting at a byte
+    PixelConverter converter;
+    Downscaler scaler;
+    size_t read_pos;                // start of inflated data of scaled images the scaler did not take
+    size_t filled;                  // end of inflated data of scaled images
+    size_t allocations;
+    uint64_t start;                 // start time of the current decode, including opening the file
+    uint64_t io_time;               // time spent opening the file
+
+    explicit Impl(const DecodeOptions& opts) : 
+        options(opts), file(), inflater(), filtered(), zero_row(), converted(), columns(), converter(), scaler(), 
+        read_pos(0), filled(0), allocations(0), start(0), io_time(0)
+    {}
+
+    bool open(const Source& source);
+    // decodes the whole image when region is null
+    bool decode(PNGImage::Impl& image, const Region* region = nullptr);
+    void close(size_t allocations_before);
+
+    // decoding is split after the header, so its size is known before the image data is read
+    bool read_header(PNGImage::Impl& image);
+    bool read_data(PNGImage::Impl& image, const Region* region = nullptr);
+    bool unfilter(PNGImage::Impl& image, const Region* region);
+    bool unfilter_interlaced(PNGImage::Impl& image, const Header& head, bool native);
+    bool unfilter_region(PNGImage::Impl& image, const Header& head, bool native, const Region& region);
+    bool start_scaled(PNGImage::Impl& image);
+    InflateState::Status inflate_scaled(const DataView& payload, DecodeTimings& timings);
+};
+
+bool Decoder::Impl::open(const Source& source)
+{
+    start = now_ns();
+    io_time = 0;
+    if (source.data) return file.open(source.data, source.size);
+
+    const bool opened = file.open(source.file_name);
+    PNG_STAT(io_time = now_ns() - start);
+    if (!opened)
+    {
+        PNG_LOG(Error, "Can't open " << source.file_name);
+        return false;
+    }
+    return true;
+}
+
+bool Decoder::Impl::decode(PNGImage::Impl& image, const Region* region)
+{
+    const size_t allocations_before = buffer_allocations;
+    bool result = read_header(image) && (!region || check_region(image.head, *region)) && read_data(image, region);
+    close(allocations_before);
+    return result;
+}
+
+void Decoder::Impl::close(size_t allocations_before)
+{
+    file.close();
+    allocations += buffer_allocations - allocations_before;
+}
+
+// the file has to be opened by open(), which starts the clock of the decode
+bool Decoder::Impl::read_header(PNGImage::Impl& image)
+{
+    image.stats = DecodeStats();
+    image.stats.timings.io = io_time;
+    image.palette = Palette();
+
+    if (!file.is_open())
+    {
+        PNG_LOG(Error, "File not open");
+        return false;
+    }
+
+    file.set_verify_crc(options.verify_checksums);
+    if (!is_png_file(file))                        // check signature 
+    {
+        PNG_LOG(Error, "Is not PNG file");
+        return false;      
+    }
+    PNG_STAT(++image.stats.chunks[chunk_index(ChunkType::IHDR)]);
+    return image.head.from_file(file);             // read header
+}
+
+bool Decoder::Impl::read_data(PNGImage::Impl& image, const Region* region)
+{
+    DecodeStats& stats = image.stats;
+    DecodeTimings& timings = stats.timings;
+    const Header head = image.head;
+
+    bool has_IEND = false;
+    bool has_IDAT = false;
+    bool has_PLTE = false;
+    bool has_extra_data = false;
+    bool has_needed_rows = false;
+
+    // a region smaller than the image needs the data up to its last row only
+    if (region && region->width == head.width && region->height == head.height) region = nullptr;
+
+    const bool native = PixelConverter::is_native(head, options.format);
+    const bool scaled = options.scale != 1;
+    if (scaled)
+    {
+        if (!Downscaler::is_valid_scale(options.scale))
+        {
+            PNG_LOG(Error, "Scale " << options.scale << " is not 1, 2, 4 or 8");
+            return false;
+        }
+        if (region)
+        {
+            PNG_LOG(Error, "Regions are not decoded scaled");
+            return false;
+        }
+        if (native && (head.colour_type == ColourType::Indexed || head.bit_depth < 8))
+        {
+            PNG_LOG(Error, "Scaling needs a pixel format with whole-byte samples");
+            return false;
+        }
+    }
+
+    // the inflated size is known from the header, the data is decoded straight into place
+    std::vector<byte_t>& target = region || scaled || head.interlace || !native ? filtered : image.data;
+    const size_t data_size = filtered_data_size(head);
+    if (data_size == 0) 
+    {
+        PNG_LOG(Error, "Image is too large");
+        return false;
+    }
+    const size_t target_size = scaled ? scaled_window_size(head) : region ? region_data_size(head, *region) : data_size;
+    if (!allocate(target, target_size)) return false;
+
+    inflater.reset();                          // single zlib stream over all IDAT chunks
+    inflater.set_output(target.data(), 0, target.size());
+    inflater.set_verify_checksum(options.verify_checksums);
+    read_pos = 0;
+    filled = 0;
+    while (!file.eof() && file.is_open() && !has_needed_rows)     // read image data
+    {           
+        uint_t length; file.read(length);
+        file.reset_crc();
+        ChunkType type; file.read(type);
+
+        PNG_LOG(Trace, "Chunk: " << std::hex << static_cast<uint_t>(type) 
+                    << " Size: "  << std::dec << length);
+        PNG_STAT(++stats.chunks[chunk_index(type)]);
+
+        switch (type)
+        {
+            case ChunkType::IDAT :
+            {
+                PNG_LOG(Trace, "Process IDAT chunk");
+                DataView payload;
+                bool crc_ok;
+                {
+                    ScopedTimer timer(timings.crc);
+                    payload = file.view(length);
+                    crc_ok = check_crc(file);
+                }
+                if (!crc_ok)
+                {
+                    PNG_LOG(Error, "Checksum does not match");
+                    return false;
+                }
+                // the palette comes before the image data, the scaler converts from the first row on
+                if (scaled && !has_IDAT && !start_scaled(image)) return false;
+                has_IDAT = true;
+                if (has_extra_data) break;
+                if (inflater.done())
+                {
+                    PNG_LOG(Warning, "Extra image data ignored");
+                    has_extra_data = true;
+                    break;
+                }
+                PNG_STAT(stats.idat_bytes += length);
+
+                InflateState::Status status;
+                if (scaled) status = inflate_scaled(payload, timings);
+                else
+                {
+                    ScopedTimer timer(timings.inflate);
+                    status = inflater.inflate(payload);
+                }
+                if (status == InflateState::ERROR) return false;
+                if (status == InflateState::OUTPUT_FULL && (region || scaled))
+                {
+                    // the rest of the file, including the checksums of the stream, is not read
+                    has_needed_rows = true;
+                }
+                else if (status == InflateState::OUTPUT_FULL)
+                {
+                    // like libpng, data past the last scanline is not an error
+                    PNG_LOG(Warning, "Extra image data ignored");
+                    has_extra_data = true;
+                }
+                break;
+            }
+
+            case ChunkType::PLTE :
+            case ChunkType::tRNS :
+            {
+                DataView payload = file.view(length);
+                if (!check_crc(file))
+                {
+                    PNG_LOG(Error, "Checksum does not match");
+                    return false;
+                }
+                if (type == ChunkType::PLTE)
+                {
+                    if (has_PLTE)
+                    {
+                        PNG_LOG(Error, "Duplicate palette");
+                        return false;
+                    }
+                    has_PLTE = true;
+                    if (!read_palette(payload, head, image.palette)) return false;
+                }
+                else if (!read_transparency(payload, head, image.palette)) return false;
+                break;
+            }
+
+            case ChunkType::IEND : 
+                PNG_LOG(Trace, "Find IEND");
+                has_IEND = check_crc(file);
+                break;
+
+            default:
+                PNG_LOG(Trace, "\tNo implemented action");
+                file.skip(length + CHUNK_CRC_SIZE);
+                
+        break;
+        }
+    }   
+    
+    if (!has_IDAT) 
+    {
+        PNG_LOG(Error, "Image data was not found");
+        return false;
+    }
+
+    if (!inflater.done() && !has_extra_data && !has_needed_rows)
+    {
+        PNG_LOG(Error, "Image data is incomplete");
+        return false;
+    }
+
+    if (scaled ? !scaler.complete() : inflater.output_pos() < target.size())
+    {
+        PNG_LOG(Error, "Image data is too short");
+        return false;
+    }
+
+    if (!has_IEND && !has_needed_rows)
+    {
+        PNG_LOG(Error, "Wrong file ending");
+        return false;
+    }
+
+    if (head.colour_type == ColourType::Indexed && !has_PLTE)
+    {
+        PNG_LOG(Error, "Palette is missing");
+        return false;
+    }
+
+    if (!scaled && !unfilter(image, region)) return false;
+
+#ifndef PNG_DISABLE_STATS
+    stats.bytes_read = file.position();
+    inflater.add_stats(stats);
+    timings.total = now_ns() - start;
+    timings.parse = timings.total - timings.io - timings.crc - timings.inflate - timings.unfilter - timings.convert;
+#endif
+
+    PNG_LOG(Trace, "END");
+    return true;
+}
+
+bool Decoder::Impl::unfilter(PNGImage::Impl& image, const Region* region)
+{
+    DecodeTimings& timings = image.stats.timings;
+    const Header head = image.head;
+    const bool native = PixelConverter::is_native(head, options.format);
+    const Header out = native ? head : PixelConverter::converted_header(head, options.format);
+    const size_t bpp = head.filter_bpp();
+    const size_t row_bytes = head.row_bytes(head.width);
+    const size_t out_row_bytes = out.row_bytes(head.width);
+
+    if (!native)
+    {
+        if (head.height > SIZE_MAX / out_row_bytes)
+        {
+            PNG_LOG(Error, "Image is too large");
+            return false;
+        }
+        if (!converter.setup(head, image.palette, options.format)) return false;
+        // converted pixels no longer refer to the palette or the colour key
+        image.head = out;
+        image.palette = Palette();
+    }
+
+    if (region) return unfilter_region(image, head, native, *region);
+    if (head.interlace) return unfilter_interlaced(image, head, native);
+
+    if (native)
+    {
+        ScopedTimer timer(timings.unfilter);
+        if (!unfilter_rows(image.data.data(), row_bytes, head.height, bpp, image.data.data(), zero_row)) return false;
+        image.data.resize(head.height * row_bytes);
+        return true;
+    }
+
+    if (!allocate(image.data, head.height * out_row_bytes)) return false;
+
+    // rows are unfiltered in place, which packs them to the start of the buffer
+    const size_t strip = std::max<size_t>(1, CONVERT_STRIP_SIZE / row_bytes);
+    for (size_t y = 0; y < head.height; y += strip)
+    {
+        const size_t rows = std::min<size_t>(strip, head.height - y);
+        byte_t* pixels = filtered.data() + y * row_bytes;
+        {
+            ScopedTimer timer(timings.unfilter);
+            if (!unfilter_rows(filtered.data() + y * (row_bytes + 1), row_bytes, rows, bpp, pixels, zero_row, 
+                               y > 0 ? pixels - row_bytes : nullptr)) return false;
+        }
+
+        ScopedTimer timer(timings.convert);
+        for (size_t i = 0; i < rows; ++i)
+            converter.convert(pixels + i * row_bytes, head.width, image.data.data() + (y + i) * out_row_bytes);
+    }
+    return true;
+}
+
+// head is the header of the file, the image header describes the converted pixels unless native
+bool Decoder::Impl::unfilter_interlaced(PNGImage::Impl& image, const Header& head, bool native)
+{
+    DecodeTimings& timings = image.stats.timings;
+    const Header& out = image.head;
+    const size_t bpp = head.filter_bpp();
+    const size_t image_row_bytes = out.row_bytes(head.width);
+
+    if (!allocate(image.data, head.height * image_row_bytes)) return false;
+    // sub-byte pixels of the passes are merged into shared bytes
+    if (out.bits_per_pixel() < 8) std::fill(image.data.begin(), image.data.end(), 0);
+
+    byte_t* pass_data = filtered.data();
+    for (size_t p = 0; p < ADAM7_PASS_COUNT; ++p)
+    {
+        const Adam7Pass& pass = ADAM7_PASSES[p];
+        const size_t pass_width  = pass.width(head.width);
+        const size_t pass_height = pass.height(head.height);
+        if (pass_width == 0 || pass_height == 0) continue;   // empty passes have no scanlines
+
+        const size_t row_bytes = head.row_bytes(pass_width);
+        {
+            ScopedTimer timer(timings.unfilter);
+            if (!unfilter_rows(pass_data, row_bytes, pass_height, bpp, pass_data, zero_row)) return false;
+        }
+
+        const byte_t* pixels = pass_data;
+        if (!native)
+        {
+            ScopedTimer timer(timings.convert);
+            const size_t converted_row_bytes = out.row_bytes(pass_width);
+            if (!allocate(converted, pass_height * converted_row_bytes)) return false;
+            for (size_t j = 0; j < pass_height; ++j)
+                converter.convert(pass_data + j * row_bytes, pass_width, converted.data() + j * converted_row_bytes);
+            pixels = converted.data();
+        }
+
+        ScopedTimer timer(timings.unfilter);
+        deinterlace_pass(pass, pixels, pass_width, pass_height, out.bits_per_pixel(), image.data.data(), image_row_bytes);
+        pass_data += pass_height * (row_bytes + 1);
+    }
+    return true;
+}
+
+// sets the image up for the scaled pixels once the palette is known
+bool Decoder::Impl::start_scaled(PNGImage::Impl& image)
+{
+    const Header head = image.head;
+    const bool native = PixelConverter::is_native(head, options.format);
+    const Header out = native ? head : PixelConverter::converted_header(head, options.format);
+    const Header scaled = Downscaler::scaled_header(out, options.scale);
+    const size_t row_bytes = scaled.row_bytes(scaled.width);
+
+    if (scaled.height > SIZE_MAX / row_bytes)
+    {
+        PNG_LOG(Error, "Image is too large");
+        return false;
+    }
+    if (!native && !converter.setup(head, image.palette, options.format)) return false;
+    if (!allocate(image.data, scaled.height * row_bytes)) return false;
+
+    image.head = scaled;
+    // converted pixels no longer refer to the palette or the colour key
+    if (!native) image.palette = Palette();
+    return scaler.start(head, out, options.scale, native ? nullptr : &converter, image.data.data());
+}
+
+// inflates a chunk into the window and scales the complete scanlines; 
+// OUTPUT_FULL means the scaler has all rows it needs and the rest of the stream is not read
+InflateState::Status Decoder::Impl::inflate_scaled(const DataView& payload, DecodeTimings& timings)
+{
+    // as inflate(), input past the end of the stream is not fed
+    if (inflater.done()) return InflateState::DONE;
+
+    inflater.feed(payload);
+    for (;;)
+    {
+        if (filled == filtered.size())
+        {
+            // drops data that is neither unread nor needed for back-references
+            const size_t drop = read_pos - std::min(read_pos, InflateState::MAX_WINDOW_SIZE);
+            std::memmove(filtered.data(), filtered.data() + drop, filled - drop);
+            read_pos -= drop;
+            filled -= drop;
+        }
+
+        InflateState::Status status;
+        {
+            ScopedTimer timer(timings.inflate);
+            inflater.set_output(filtered.data(), filled, filtered.size());
+            status = inflater.run();
+            filled = inflater.output_pos();
+        }
+        if (status == InflateState::ERROR) return status;
+
+        size_t used;
+        if (!scaler.add(filtered.data() + read_pos, filled - read_pos, used, timings)) return InflateState::ERROR;
+        read_pos += used;
+        if (scaler.complete())
+        {
+            if (scaler.skips_passes()) return InflateState::OUTPUT_FULL;
+            // like RowReader, data past the last scanline is inflated and dropped
+            read_pos = filled;
+        }
+        if (status != InflateState::OUTPUT_FULL) return status;
+    }
+}
+
+// head is the header of the file; rows above the region are unfiltered as the base of the rows below, 
+// columns outside of it are neither converted nor copied
+bool Decoder::Impl::unfilter_region(PNGImage::Impl& image, const Header& head, bool native, const Region& region)
+{
+    static const Adam7Pass WHOLE_IMAGE = {0, 0, 1, 1};
+
+    DecodeTimings& timings = image.stats.timings;
+    Header& out = image.head;
+    const size_t bpp = head.filter_bpp();
+    const size_t in_bits = head.bits_per_pixel();
+    const size_t out_bits = out.bits_per_pixel();
+
+    out.width  = static_cast<uint_t>(region.width);
+    out.height = static_cast<uint_t>(region.height);
+    const size_t out_row_bytes = out.row_bytes(region.width);
+    if (!allocate(image.data, region.height * out_row_bytes)) return false;
+    // sub-byte pixels of the passes are merged into shared bytes
+    if (head.interlace && out_bits < 8) std::fill(image.data.begin(), image.data.end(), 0);
+
+    size_t offset = 0;
+    const size_t pass_count = head.interlace ? ADAM7_PASS_COUNT : 1;
+    for (size_t p = 0; p < pass_count; ++p)
+    {
+        const Adam7Pass& pass = head.interlace ? ADAM7_PASSES[p] : WHOLE_IMAGE;
+        const size_t pass_width  = pass.width(head.width);
+        const size_t pass_height = pass.height(head.height);
+        if (pass_width == 0 || pass_height == 0) continue;
+
+        const size_t row_bytes = head.row_bytes(pass_width);
+        byte_t* pass_data = filtered.data() + offset;
+        offset += pass_height * (row_bytes + 1);
+
+        // pass pixels [first_x, end_x) of rows [first_y, end_y) are inside the region
+        const size_t first_x = pass.width(region.x);
+        const size_t end_x   = pass.width(region.x + region.width);
+        const size_t first_y = pass.height(region.y);
+        const size_t end_y   = pass.height(region.y + region.height);
+        if (first_x >= end_x || first_y >= end_y) continue;
+
+        {
+            ScopedTimer timer(timings.unfilter);
+            if (!unfilter_rows(pass_data, row_bytes, end_y, bpp, pass_data, zero_row)) return false;
+        }
+
+        const size_t count = end_x - first_x;
+        const size_t dst_x = pass.x0 + first_x * pass.dx - region.x;
+        if (!native && in_bits < 8 && !allocate(columns, head.row_bytes(count))) return false;
+        if (!native && pass.dx > 1 && !allocate(converted, out.row_bytes(count))) return false;
+
+        for (size_t j = first_y; j < end_y; ++j)
+        {
+            const byte_t* pixels = pass_data + j * row_bytes;
+            byte_t* dst = image.data.data() + (pass.y0 + j * pass.dy - region.y) * out_row_bytes;
+            if (native)
+            {
+                ScopedTimer timer(timings.unfilter);
+                if (pass.dx == 1) copy_pixels(pixels, first_x, count, in_bits, dst);
+                else scatter_row(pixels, first_x, count, in_bits, dst, dst_x, pass.dx);
+                continue;
+            }
+
+            ScopedTimer timer(timings.convert);
+            // the converter takes rows starting at a byte
+            const byte_t* src = pixels + first_x * in_bits / 8;
+            if (in_bits < 8)
+            {
+                copy_pixels(pixels, first_x, count, in_bits, columns.data());
+                src = columns.data();
+            }
+            // converted formats have whole-byte pixels
+            if (pass.dx == 1) converter.convert(src, count, dst);
+            else
+            {
+                converter.convert(src, count, converted.data());
+                scatter_row(converted.data(), 0, count, out_bits, dst, dst_x, pass.dx);
+            }
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------
+// Decoder interface
+
+Decoder::Decoder(const DecodeOptions& options) : pImpl(new Impl(options))
+{}
+
+Decoder::~Decoder()
+{}
+
+bool Decoder::decode(const std::string& file_name, PNGImage& image)
+{
+    return pImpl->open(Source(file_name)) && pImpl->decode(*image.pImpl);
+}
+
+bool Decoder::decode(const unsigned char* data, size_t size, PNGImage& image)
+{
+    return pImpl->open(Source(data, size)) && pImpl->decode(*image.pImpl);
+}
+
+bool Decoder::decode_region(const std::string& file_name, size_t x, size_t y, size_t width, size_t height, PNGImage& image)
+{
+    const Region region = {x, y, width, height};
+    return pImpl->open(Source(file_name)) && pImpl->decode(*image.pImpl, &region);
+}
+
+bool Decoder::decode_region(const unsigned char* data, size_t size, size_t x, size_t y, size_t width, size_t height, 
+                            PNGImage& image)
+{
+    const Region region = {x, y, width, height};
+    return pImpl->open(Source(data, size)) && pImpl->decode(*image.pImpl, &region);
+}
+
+size_t Decoder::allocations() const
+{
+    return pImpl->allocations;
+}
+
+// --------------------------------------------------------
+// Thread pool
+//
+// Every worker has its own task deque. It takes work from the front of its 
+// own deque and, once that is empty, steals from the back of the others. 
+// Tasks submitted from outside the pool are spread round-robin, tasks 
+// submitted by a worker stay in its deque.
+
+class ThreadPool {
+public:
+    typedef std::function<void ()> task_t;
+
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();   // runs the queued tasks first
+
+    void submit(task_t task);
+
+    // blocks until all submitted tasks finished, must not be called from a task
+    void wait();
+
+    size_t size() const { return workers.size(); }
+
+    // index of the worker running the calling thread, SIZE_MAX outside this pool
+    size_t current_worker() const { return current_pool == this ? worker_index : SIZE_MAX; }
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator= (const ThreadPool&);
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    bool pop(size_t index, task_t& task);
+    void run(size_t index);
+
+    static thread_local const ThreadPool* current_pool;
+    static thread_local size_t worker_index;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;                       // guards the counters below
+    std::condition_variable work_ready;
+    std::condition_variable all_done;
+    size_t queued;                          // tasks in deques not claimed by a worker yet
+    size_t pending;                         // queued and running tasks
+    size_t next_worker;
+    bool stopping;
+};
+
+thread_local const ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local size_t ThreadPool::worker_index = SIZE_MAX;
+
+ThreadPool::ThreadPool(size_t count) : 
+    workers(), threads(), mutex(), work_ready(), all_done(), queued(0), pending(0), next_worker(0), stopping(false)
+{
+    for (size_t i = 0; i < count; ++i) workers.emplace_back(new Worker());
+    for (size_t i = 0; i < count; ++i) threads.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& thread : threads) thread.join();
+}
+
+void ThreadPool::submit(task_t task)
+{
+    size_t target = current_worker();
+    if (target == SIZE_MAX)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target = next_worker++ % workers.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    {
+        // counted after the push, so there are never more claims than tasks in the deques
+        std::lock_guard<std::mutex> lock(mutex);
+        ++queued;
+        ++pending;
+    }
+    work_ready.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    all_done.wait(lock, [this] { return pending == 0; });
+}
+
+bool ThreadPool::pop(size_t index, task_t& task)
+{
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        Worker& worker = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) continue;
+
+        if (i == 0)
+        {
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+        }
+        else
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::run(size_t index)
+{
+    current_pool = this;
+    worker_index = index;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_ready.wait(lock, [this] { return queued > 0 || stopping; });
+            if (queued == 0) return;   // stopping and nothing left
+            --queued;
+        }
+
+        // the claim stands for a task in some deque, but a worker that claimed later may take
+        // the one this scan would find first, so the deques are scanned until one is taken
+        task_t task;
+        while (!pop(index, task)) std::this_thread::yield();
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) all_done.notify_all();
+    }
+}
+
+// --------------------------------------------------------
+// Batch decoding
+
+// limits the total size of images in flight
+class ByteBudget {
+public:
+    explicit ByteBudget(size_t limit) : limit(limit), used(0), mutex(), available()
+    {}
+
+    // waits until bytes fit into the limit, anything fits when nothing is in flight
+    void acquire(size_t bytes)
+    {
+        if (limit == 0) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [&] { return used == 0 || used + bytes <= limit; });
+        used += bytes;
+    }
+
+    void release(size_t bytes)
+    {
+        if (limit == 0 || bytes == 0) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= bytes;
+        }
+        available.notify_all();
+    }
+
+private:
+    size_t limit;
+    size_t used;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+struct BatchDecoder::Impl {
+    // decoding state owned by one worker thread
+    struct Context {
+        Decoder decoder;
+        PNGImage image;
+
+        explicit Context(const DecodeOptions& options) : decoder(options), image()
+        {}
+    };
+
+    BatchOptions options;
+    std::vector<std::unique_ptr<Context>> contexts;
+    ByteBudget budget;
+    ThreadPool pool;   // declared last, so the workers stop before the contexts go away
+
+    explicit Impl(const BatchOptions& opts, size_t threads) : 
+        options(opts), contexts(), budget(opts.max_inflight_bytes), pool(threads)
+    {
+        for (size_t i = 0; i < threads; ++i) contexts.emplace_back(new Context(opts.decode));
+    }
+
+    bool decode(const Source& source, PNGImage& image, size_t& reserved);
+};
+
+// decodes with the decoder of the calling worker, the inflated image size is taken from the 
+// budget once the header is known and has to be released by the caller
+bool BatchDecoder::Impl::decode(const Source& source, PNGImage& image, size_t& reserved)
+{
+    Decoder::Impl& decoder = *contexts[pool.current_worker()]->decoder.pImpl;
+    PNGImage::Impl& target = *image.pImpl;
+    const size_t allocations_before = buffer_allocations;
+
+    reserved = 0;
+    bool result = decoder.open(source) && decoder.read_header(target);
+    if (result)
+    {
+        const Header& head = target.head;
+        const PixelFormat format = options.decode.format;
+        const size_t scale = options.decode.scale;
+        reserved = filtered_data_size(head);
+        if (scale != 1 && Downscaler::is_valid_scale(scale))
+        {
+            // the inflate window and the scaled pixels
+            const bool native = PixelConverter::is_native(head, format);
+            const Header scaled = Downscaler::scaled_header(native ? head : PixelConverter::converted_header(head, format), scale);
+            const size_t row_bytes = scaled.row_bytes(scaled.width);
+            const size_t window = scaled_window_size(head);
+            reserved = scaled.height <= (SIZE_MAX - window) / row_bytes ? scaled.height * row_bytes + window : SIZE_MAX;
+        }
+        else if (!PixelConverter::is_native(head, format))
+        {
+            // converted pixels are held next to the inflated data
+            const size_t row_bytes = PixelConverter::converted_header(head, format).row_bytes(head.width);
+            reserved = head.height <= (SIZE_MAX - reserved) / row_bytes ? reserved + head.height * row_bytes : SIZE_MAX;
+        }
+
+        // waiting for the budget is not decoding time
+        const uint64_t wait_start = now_ns();
+        budget.acquire(reserved);
+        decoder.start += now_ns() - wait_start;
+
+        result = decoder.read_data(target);
+    }
+    decoder.close(allocations_before);
+    return result;
+}
+
+// --------------------------------------------------------
+// Batch decoding interface
+
+// threads requested by options, 0 for one per hardware thread
+static size_t worker_count(size_t threads)
+{
+    if (threads > 0) return threads;
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+BatchDecoder::BatchDecoder(const BatchOptions& options) : pImpl(new Impl(options, worker_count(options.threads)))
+{}
+
+BatchDecoder::~BatchDecoder()
+{}
+
+void BatchDecoder::decode(const Source& source, size_t index, const batch_callback_t& callback)
+{
+    Impl* impl = pImpl.get();
+    impl->pool.submit([impl, source, index, callback]() {
+        PNGImage& image = impl->contexts[impl->pool.current_worker()]->image;
+        size_t reserved = 0;
+        bool result = impl->decode(source, image, reserved);
+        callback(index, result, image);
+        impl->budget.release(reserved);
+    });
+}
+
+std::future<BatchResult> BatchDecoder::decode(const Source& source)
+{
+    std::shared_ptr<std::promise<BatchResult>> promise = std::make_shared<std::promise<BatchResult>>();
+    std::future<BatchResult> future = promise->get_future();
+
+    Impl* impl = pImpl.get();
+    impl->pool.submit([impl, source, promise]() {
+        BatchResult result;
+        size_t reserved = 0;
+        result.ok = impl->decode(source, result.image, reserved);
+        impl->budget.release(reserved);   // the image belongs to the caller from here on
+        promise->set_value(std::move(result));
+    });
+    return future;
+}
+
+void BatchDecoder::wait()
+{
+    pImpl->pool.wait();
+}
+
+size_t BatchDecoder::threads() const
+{
+    return pImpl->pool.size();
+}
+
+void decode_batch(const std::vector<Source>& sources, const BatchOptions& options, const batch_callback_t& callback)
+{
+    BatchDecoder decoder(options);
+    for (size_t i = 0; i < sources.size(); ++i) decoder.decode(sources[i], i, callback);
+    decoder.wait();
+}
+
+std::vector<BatchResult> decode_batch(const std::vector<Source>& sources, const BatchOptions& options)
+{
+    std::vector<BatchResult> results(sources.size());
+    decode_batch(sources, options, [&results](size_t index, bool ok, PNGImage& image) {
+        results[index].ok = ok;
+        if (ok) std::swap(results[index].image, image);
+    });
+    return results;
+}
+
+// --------------------------------------------------------
+// File loading
+//
+// The loader has queue_depth slots. It opens a file, sizes the slot buffer 
+// with fstat and queues one read for the whole file, short reads are queued 
+// again for the rest. A completed file goes to the callback on the loading 
+// thread and its slot takes the next file. io_uring gets the reads through a 
+// submission ring that is handed to the kernel while waiting for completions; 
+// the pread fallback runs every read as a task on its own thread pool.
+
+#ifdef PNG_HAVE_MMAP
+
+struct LoadSlot {
+    size_t index;
+    int fd;
+    std::vector<byte_t> data;
+    size_t done;       // bytes read
+    iovec iov;         // rest of the buffer, for io_uring
+};
+
+#ifdef PNG_HAVE_IO_URING
+
+class UringQueue {
+public:
+    UringQueue() : ring_fd(-1), sq_ring(nullptr), sq_ring_size(0), cq_ring(nullptr), cq_ring_size(0), sqes(nullptr), 
+                   sqes_size(0), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr), cq_head(nullptr), cq_tail(nullptr),
+                   cq_mask(nullptr), cqes(nullptr), unsubmitted(0)
+    {}
+
+    ~UringQueue() { close(); }
+
+    // fails where the kernel or a seccomp filter does not allow io_uring
+    bool open(size_t entries);
+    void close();
+
+    // queues a read of the rest of the slot buffer, the ring has room for every slot
+    void submit(LoadSlot* slot);
+    // submits the queued reads and waits for one to complete, result is the byte count or a negative errno
+    bool complete(LoadSlot*& slot, long& result);
+
+private:
+    UringQueue(const UringQueue&);
+    UringQueue& operator= (const UringQueue&);
+
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;              // equal to sq_ring when the kernel maps both rings at once
+    size_t cq_ring_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned unsubmitted;
+};
+
+template <typename T>
+static T* ring_field(void* ring, size_t offset)
+{
+    return reinterpret_cast<T*>(static_cast<byte_t*>(ring) + offset);
+}
+
+bool UringQueue::open(size_t entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(entries), &params));
+    if (ring_fd < 0) return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) sq_ring = nullptr;
+    cq_ring = single_mmap ? sq_ring 
+            : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) cq_ring = nullptr;
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* entries_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    sqes = entries_map == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(entries_map);
+    if (!sq_ring || !cq_ring || !sqes)
+    {
+        close();
+        return false;
+    }
+
+    sq_tail  = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask  = ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+    cq_head  = ring_field<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail  = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask  = ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes     = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+    unsubmitted = 0;
+    return true;
+}
+
+void UringQueue::close()
+{
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) ::close(ring_fd);
+    ring_fd = -1;
+    sq_ring = cq_ring = nullptr;
+    sqes = nullptr;
+}
+
+void UringQueue::submit(LoadSlot* slot)
+{
+    // the tail is only written here, the kernel reads it
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & *sq_mask;
+
+    slot->iov.iov_base = slot->data.data() + slot->done;
+    slot->iov.iov_len = slot->data.size() - slot->done;
+
+    io_uring_sqe& sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = slot->fd;
+    sqe.off = slot->done;
+    sqe.addr = reinterpret_cast<uint64_t>(&slot->iov);
+    sqe.len = 1;
+    sqe.user_data = reinterpret_cast<uint64_t>(slot);
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted;
+}
+
+bool UringQueue::complete(LoadSlot*& slot, long& result)
+{
+    for (;;)
+    {
+        // the head is only written here, the kernel writes the tail
+        const unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            slot = reinterpret_cast<LoadSlot*>(cqe.user_data);
+            result = cqe.res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        const long submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR) continue;
+            PNG_LOG(Error, "io_uring_enter failed: " << std::strerror(errno));
+            return false;
+        }
+        unsubmitted -= static_cast<unsigned>(submitted);
+    }
+}
+
+#endif
+
+class PreadQueue {
+public:
+    explicit PreadQueue(size_t threads) : mutex(), ready(), completed(), pool(threads)
+    {}
+
+    void submit(LoadSlot* slot);
+    // waits for a read to complete, result is the byte count or a negative errno
+    bool complete(LoadSlot*& slot, long& result);
+
+private:
+    PreadQueue(const PreadQueue&);
+    PreadQueue& operator= (const PreadQueue&);
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::pair<LoadSlot*, long>> completed;
+    ThreadPool pool;   // declared last, so the threads stop before the queue goes away
+};
+
+void PreadQueue::submit(LoadSlot* slot)
+{
+    pool.submit([this, slot] {
+        const ssize_t count = ::pread(slot->fd, slot->data.data() + slot->done, slot->data.size() - slot->done, 
+                                      static_cast<off_t>(slot->done));
+        const long result = count < 0 ? -errno : static_cast<long>(count);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(std::make_pair(slot, result));
+        }
+        ready.notify_one();
+    });
+}
+
+bool PreadQueue::complete(LoadSlot*& slot, long& result)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return !completed.empty(); });
+    slot = completed.front().first;
+    result = completed.front().second;
+    completed.pop_front();
+    return true;
+}
+
+#endif
+
+struct FileLoader::Impl {
+    LoadOptions options;
+    IoBackend backend;
+#ifdef PNG_HAVE_IO_URING
+    std::unique_ptr<UringQueue> uring;
+#endif
+#ifdef PNG_HAVE_MMAP
+    std::unique_ptr<PreadQueue> pread;
+    std::vector<LoadSlot> slots;
+#endif
+
+    explicit Impl(const LoadOptions& opts);
+
+    bool load(const std::vector<std::string>& files, const load_callback_t& callback);
+#ifdef PNG_HAVE_MMAP
+    bool open_slot(LoadSlot& slot, size_t index, const std::string& file);
+    void submit(LoadSlot* slot);
+    bool complete(LoadSlot*& slot, long& result);
+#endif
+};
+
+FileLoader::Impl::Impl(const LoadOptions& opts) : options(opts), backend(IoBackend::Auto)
+{
+    options.queue_depth = std::max<size_t>(1, options.queue_depth);
+#ifdef PNG_HAVE_IO_URING
+    if (options.backend != IoBackend::Pread)
+    {
+        uring.reset(new UringQueue());
+        if (uring->open(options.queue_depth)) backend = IoBackend::IoUring;
+        else 
+        {
+            PNG_LOG(Info, "io_uring is not available");
+            uring.reset();
+        }
+    }
+#endif
+#ifdef PNG_HAVE_MMAP
+    if (backend == IoBackend::Auto && options.backend != IoBackend::IoUring)
+    {
+        pread.reset(new PreadQueue(std::max<size_t>(1, options.io_threads)));
+        backend = IoBackend::Pread;
+    }
+    slots.resize(options.queue_depth);
+#endif
+}
+
+#ifdef PNG_HAVE_MMAP
+
+bool FileLoader::Impl::open_slot(LoadSlot& slot, size_t index, const std::string& file)
+{
+    slot.index = index;
+    slot.done = 0;
+    slot.fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (slot.fd < 0)
+    {
+        PNG_LOG(Error, "Can't open " << file);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(slot.fd, &st) != 0 || !allocate(slot.data, static_cast<size_t>(st.st_size)))
+    {
+        PNG_LOG(Error, "Can't read " << file);
+        ::close(slot.fd);
+        return false;
+    }
+    return true;
+}
+
+void FileLoader::Impl::submit(LoadSlot* slot)
+{
+#ifdef PNG_HAVE_IO_URING
+    if (uring) return uring->submit(slot);
+#endif
+    pread->submit(slot);
+}
+
+bool FileLoader::Impl::complete(LoadSlot*& slot, long& result)
+{
+#ifdef PNG_HAVE_IO_URING
+    if (uring) return uring->complete(slot, result);
+#endif
+    return pread->complete(slot, result);
+}
+
+bool FileLoader::Impl::load(const std::vector<std::string>& files, const load_callback_t& callback)
+{
+    if (backend == IoBackend::Auto)
+    {
+        PNG_LOG(Error, "The I/O backend is not available");
+        return false;
+    }
+
+    std::vector<LoadSlot*> free_slots;
+    for (LoadSlot& slot : slots) free_slots.push_back(&slot);
+
+    size_t next = 0;
+    size_t in_flight = 0;
+    while (next < files.size() || in_flight > 0)
+    {
+        while (next < files.size() && !free_slots.empty())
+        {
+            const size_t index = next++;
+            LoadSlot* slot = free_slots.back();
+            if (!open_slot(*slot, index, files[index]))
+            {
+                std::vector<byte_t> none;
+                callback(index, false, none);
+                continue;
+            }
+            if (slot->data.empty())
+            {
+                ::close(slot->fd);
+                callback(index, true, slot->data);
+                continue;
+            }
+            free_slots.pop_back();
+            submit(slot);
+            ++in_flight;
+        }
+        if (in_flight == 0) break;
+
+        LoadSlot* slot;
+        long result;
+        if (!complete(slot, result))
+        {
+            // the reads still queued can't be waited for, their files are given up
+            for (LoadSlot& s : slots)
+            {
+                if (std::find(free_slots.begin(), free_slots.end(), &s) != free_slots.end()) continue;
+                ::close(s.fd);
+                callback(s.index, false, s.data);
+            }
+            return false;
+        }
+
+        if (result > 0)
+        {
+            slot->done += static_cast<size_t>(result);
+            // short reads are continued, a file that shrank ends at the first empty read
+            if (slot->done < slot->data.size())
+            {
+                submit(slot);
+                continue;
+            }
+        }
+        if (result < 0) PNG_LOG(Error, "Can't read " << files[slot->index] << ": " << std::strerror(static_cast<int>(-result)));
+        slot->data.resize(slot->done);
+
+        ::close(slot->fd);
+        --in_flight;
+        free_slots.push_back(slot);
+        callback(slot->index, result >= 0, slot->data);
+    }
+    return true;
+}
+
+#else
+
+// without POSIX files are read one after the other
+bool FileLoader::Impl::load(const std::vector<std::string>& files, const load_callback_t& callback)
+{
+    std::vector<byte_t> data;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::ifstream ifs(files[i], std::ios::in | std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        if (!ifs.eof()) PNG_LOG(Error, "Can't read " << files[i]);
+        callback(i, ifs.eof(), data);
+    }
+    return true;
+}
+
+#endif
+
+FileLoader::FileLoader(const LoadOptions& options) : pImpl(new Impl(options))
+{}
+
+FileLoader::~FileLoader()
+{}
+
+bool FileLoader::load(const std::vector<std::string>& files, const load_callback_t& callback)
+{
+    return pImpl->load(files, callback);
+}
+
+IoBackend FileLoader::backend() const
+{
+    return pImpl->backend;
+}
+
+bool decode_files(const std::vector<std::string>& files, const BatchOptions& options, const LoadOptions& load, 
+                  const batch_callback_t& callback)
+{
+    BatchDecoder decoder(options);
+    FileLoader loader(load);
+    ByteBudget buffered(load.max_buffered_bytes);
+
+    const bool result = loader.load(files, [&](size_t index, bool ok, std::vector<byte_t>& data) {
+        if (!ok)
+        {
+            PNGImage empty;
+            callback(index, false, empty);
+            return;
+        }
+
+        // the buffer lives until its decode reported
+        std::shared_ptr<std::vector<byte_t>> buffer = std::make_shared<std::vector<byte_t>>();
+        buffer->swap(data);
+        const size_t size = buffer->size();
+        buffered.acquire(size);
+        decoder.decode(Source(buffer->data(), size), index, [&buffered, &callback, buffer, size](size_t i, bool decoded, PNGImage& image) {
+            callback(i, decoded, image);
+            buffered.release(size);
+        });
+    });
+    decoder.wait();
+    return result;
+}
+
+// --------------------------------------------------------
+// Header probing
+
+// signature, IHDR length and type, IHDR data and its CRC
+static const size_t PROBE_SIZE = SIGNATURE_SIZE + CHUNK_LENGTH_SIZE + CHUNK_TYPE_SIZE + 13 + CHUNK_CRC_SIZE;
+
+bool probe(const unsigned char* data, size_t size, Header& head)
+{
+    ImageFile file;
+    if (!file.open(data, size)) return false;
+
+    if (!is_png_file(file))
+    {
+        PNG_LOG(Error, "Is not PNG file");
+        return false;
+    }
+
+    Header probed;
+    if (!probed.from_file(file)) return false;
+
+    head = probed;
+    return true;
+}
+
+bool probe(const std::string& file_name, Header& head)
+{
+    byte_t buffer[PROBE_SIZE];
+    size_t size = 0;
+
+#ifdef PNG_HAVE_MMAP
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        PNG_LOG(Error, "Can't open " << file_name);
+        return false;
+    }
+    ssize_t count = ::pread(fd, buffer, PROBE_SIZE, 0);
+    ::close(fd);
+    if (count > 0) size = static_cast<size_t>(count);
+#else
+    std::ifstream ifs(file_name, std::ios::in | std::ios::binary);
+    if (!ifs)
+    {
+        PNG_LOG(Error, "Can't open " << file_name);
+        return false;
+    }
+    ifs.read(reinterpret_cast<char*>(buffer), PROBE_SIZE);
+    size = static_cast<size_t>(ifs.gcount());
+#endif
+
+    return probe(buffer, size, head);
+}
+
+// --------------------------------------------------------
+// Image index
+//
+// The walk runs on a thread pool. Every directory is a task that lists its
+// entries, queues its subdirectories as tasks of their own and its files in
+// groups of FILES_PER_TASK, so a huge directory is still spread over all
+// workers. File tasks stat every file and probe it unless the previous index
+// has an entry with the same size and modification time. Workers collect
+// entries separately, they are merged and sorted once the walk is done.
+//
+// Index file, integers little-endian:
+//   "PNGINDEX", uint32 version, uint64 entry count
+//   per entry, in path order:
+//     varint length of the prefix shared with the previous path, varint suffix length, suffix
+//     varint file size, zigzag varint modification time minus the one of the previous entry
+//     flags byte, bit 0 set for a valid header, which follows as
+//     varint width, varint height, bit depth, colour type and interlace bytes
+//   uint32 CRC-32 of everything before it
+//
+// Files of one directory share the path prefix and mostly have close times,
+// so an entry takes about 15 bytes besides the distinct part of its name.
+
+static const char INDEX_MAGIC[] = { 'P', 'N', 'G', 'I', 'N', 'D', 'E', 'X' };
+static const uint_t INDEX_VERSION = 1;
+static const size_t INDEX_HEADER_SIZE = sizeof(INDEX_MAGIC) + 4 + 8;
+
+static const byte_t INDEX_VALID_HEADER = 1;
+
+static const size_t FILES_PER_TASK = 256;
+
+static uint64_t zigzag_encode(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// entry of path in entries sorted by path, nullptr when there is none
+static const IndexEntry* find_entry(const std::vector<IndexEntry>& entries, const std::string& path)
+{
+    auto it = std::lower_bound(entries.begin(), entries.end(), path, 
+                               [](const IndexEntry& entry, const std::string& p) { return entry.path < p; });
+    return it != entries.end() && it->path == path ? &*it : nullptr;
+}
+
+// buffers the index and writes it out in blocks, keeping the CRC of everything written
+class IndexWriter {
+public:
+    explicit IndexWriter(std::ostream& stream) : out(stream), buffer(), crc(0)
+    {}
+
+    void put_bytes(const void* data, size_t size)
+    {
+        const byte_t* bytes = static_cast<const byte_t*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+        if (buffer.size() >= BLOCK_SIZE) flush();
+    }
+
+    void put_byte(byte_t value) { buffer.push_back(value); }
+
+    void put_le(uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i) buffer.push_back(static_cast<byte_t>(value >> (8 * i)));
+    }
+
+    void put_varint(uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7) buffer.push_back(static_cast<byte_t>(value | 0x80));
+        buffer.push_back(static_cast<byte_t>(value));
+    }
+
+    // appends the CRC and writes what is left
+    bool finish()
+    {
+        flush();
+        put_le(crc, 4);
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+        return static_cast<bool>(out.flush());
+    }
+
+private:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    void flush()
+    {
+        crc = crc32(buffer.data(), buffer.size(), crc);
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+    }
+
+    std::ostream& out;
+    std::vector<byte_t> buffer;
+    uint_t crc;
+};
+
+// reads from a borrowed buffer, reads past its end fail and return zeros
+class IndexReader {
+public:
+    IndexReader(const byte_t* data, size_t size) : pos(data), end(data + size), failed(false)
+    {}
+
+    const byte_t* get_bytes(size_t size)
+    {
+        if (static_cast<size_t>(end - pos) < size)
+        {
+            failed = true;
+            pos = end;
+            return nullptr;
+        }
+        const byte_t* bytes = pos;
+        pos += size;
+        return bytes;
+    }
+
+    byte_t get_byte()
+    {
+        const byte_t* byte = get_bytes(1);
+        return byte ? *byte : 0;
+    }
+
+    uint64_t get_le(size_t bytes)
+    {
+        const byte_t* data = get_bytes(bytes);
+        uint64_t value = 0;
+        for (size_t i = 0; data && i < bytes; ++i) value |= static_cast<uint64_t>(data[i]) << (8 * i);
+        return value;
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t value = 0;
+        for (size_t shift = 0; shift < 64; shift += 7)
+        {
+            byte_t byte = get_byte();
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) return value;
+        }
+        failed = true;
+        return 0;
+    }
+
+    bool ok() const { return !failed; }
+
+private:
+    const byte_t* pos;
+    const byte_t* end;
+    bool failed;
+};
+
+#ifdef PNG_HAVE_MMAP
+
+static int64_t modification_time(const struct stat& st)
+{
+#ifdef __APPLE__
+    const struct timespec& time = st.st_mtimespec;
+#else
+    const struct timespec& time = st.st_mtim;
+#endif
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+class IndexWalk {
+public:
+    IndexWalk(const std::vector<IndexEntry>& previous, const std::string& root, const IndexOptions& options) :
+        previous(previous), root(root), options(options), pool(worker_count(options.threads)), workers(pool.size())
+    {}
+
+    // false when the root directory can't be listed
+    bool run(std::vector<IndexEntry>& entries, size_t& probed);
+
+private:
+    IndexWalk(const IndexWalk&);
+    IndexWalk& operator= (const IndexWalk&);
+
+    typedef std::shared_ptr<std::vector<std::string>> file_list_t;
+
+    struct WorkerEntries {
+        std::vector<IndexEntry> entries;
+        size_t probed;
+
+        WorkerEntries() : entries(), probed(0)
+        {}
+    };
+
+    bool list_directory(const std::string& relative);
+    void index_files(const file_list_t& files);
+    bool has_extension(const char* name) const;
+
+    std::string full_path(const std::string& relative) const { return relative.empty() ? root : root + "/" + relative; }
+
+    const std::vector<IndexEntry>& previous;
+    const std::string root;
+    const IndexOptions options;
+    ThreadPool pool;
+    std::vector<WorkerEntries> workers;
+};
+
+bool IndexWalk::run(std::vector<IndexEntry>& entries, size_t& probed)
+{
+    bool listed = list_directory(std::string());
+    pool.wait();
+    if (!listed) return false;
+
+    size_t count = 0;
+    for (const WorkerEntries& worker : workers) count += worker.entries.size();
+
+    entries.clear();
+    entries.reserve(count);
+    probed = 0;
+    for (WorkerEntries& worker : workers)
+    {
+        std::move(worker.entries.begin(), worker.entries.end(), std::back_inserter(entries));
+        probed += worker.probed;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+    return true;
+}
+
+bool IndexWalk::list_directory(const std::string& relative)
+{
+    DIR* dir = opendir(full_path(relative).c_str());
+    if (!dir) return false;
+
+    file_list_t files(new std::vector<std::string>());
+    while (const dirent* entry = readdir(dir))
+    {
+        const char* name = entry->d_name;
+        if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) continue;
+
+        const std::string path = relative.empty() ? std::string(name) : relative + "/" + name;
+
+        // links are resolved by the file tasks, links to directories are skipped there
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG || entry->d_type == DT_LNK;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            // some file systems don't report entry types
+            struct stat st;
+            if (lstat(full_path(path).c_str(), &st) != 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+        }
+
+        if (is_dir)
+        {
+            pool.submit([this, path] {
+                if (!list_directory(path)) PNG_LOG(Warning, "Can't list " << full_path(path));
+            });
+        }
+        else if (is_file && has_extension(name))
+        {
+            files->push_back(path);
+            if (files->size() == FILES_PER_TASK)
+            {
+                pool.submit([this, files] { index_files(files); });
+                files.reset(new std::vector<std::string>());
+            }
+        }
+    }
+    closedir(dir);
+
+    if (!files->empty()) pool.submit([this, files] { index_files(files); });
+    return true;
+}
+
+void IndexWalk::index_files(const file_list_t& files)
+{
+    WorkerEntries& worker = workers[pool.current_worker()];
+
+    for (const std::string& path : *files)
+    {
+        const std::string file_name = full_path(path);
+
+        struct stat st;
+        if (stat(file_name.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        IndexEntry entry;
+        entry.path = path;
+        entry.file_size = static_cast<uint64_t>(st.st_size);
+        entry.mtime = modification_time(st);
+
+        const IndexEntry* cached = find_entry(previous, path);
+        if (cached && cached->file_size == entry.file_size && cached->mtime == entry.mtime)
+        {
+            entry.ok = cached->ok;
+            entry.header = cached->header;
+        }
+        else
+        {
+            entry.ok = probe(file_name, entry.header);
+            ++worker.probed;
+        }
+        worker.entries.push_back(std::move(entry));
+    }
+}
+
+bool IndexWalk::has_extension(const char* name) const
+{
+    const size_t length = std::strlen(name);
+    const std::string& extension = options.extension;
+    if (length < extension.size()) return false;
+
+    const char* tail = name + length - extension.size();
+    for (size_t i = 0; i < extension.size(); ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(tail[i])) != std::tolower(static_cast<unsigned char>(extension[i]))) return false;
+    }
+    return true;
+}
+
+#endif // PNG_HAVE_MMAP
+
+struct ImageIndex::Impl {
+    std::vector<IndexEntry> entries;   // sorted by path
+    size_t probed;
+
+    Impl() : entries(), probed(0)
+    {}
+};
+
+ImageIndex::ImageIndex() : pImpl(new Impl())
+{}
+
+ImageIndex::~ImageIndex()
+{}
+
+bool ImageIndex::load(const std::string& index_file)
+{
+    pImpl->entries.clear();
+    pImpl->probed = 0;
+
+    std::ifstream ifs(index_file, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs) return true;   // nothing indexed yet
+
+    std::vector<byte_t> data;
+    std::streamoff size = ifs.tellg();
+    if (size < 0 || !allocate(data, static_cast<size_t>(size))) return false;
+    ifs.seekg(0);
+    if (size > 0 && !ifs.read(reinterpret_cast<char*>(data.data()), size))
+    {
+        PNG_LOG(Error, "Can't read " << index_file);
+        return false;
+    }
+
+    if (data.size() < INDEX_HEADER_SIZE + 4)
+    {
+        PNG_LOG(Error, "Index file is truncated");
+        return false;
+    }
+
+    const size_t content_size = data.size() - 4;
+    IndexReader crc_reader(data.data() + content_size, 4);
+    if (crc32(data.data(), content_size) != crc_reader.get_le(4))
+    {
+        PNG_LOG(Error, "Index checksum does not match");
+        return false;
+    }
+
+    IndexReader reader(data.data(), content_size);
+    const byte_t* magic = reader.get_bytes(sizeof(INDEX_MAGIC));
+    if (!std::equal(INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC), reinterpret_cast<const char*>(magic)))
+    {
+        PNG_LOG(Error, "Is not an index file");
+        return false;
+    }
+
+    uint64_t version = reader.get_le(4);
+    if (version != INDEX_VERSION)
+    {
+        PNG_LOG(Error, "Index version " << version << " not supported");
+        return false;
+    }
+
+    // every entry takes at least 4 bytes, a damaged count can't reserve more than the file holds
+    uint64_t count = reader.get_le(8);
+    std::vector<IndexEntry> entries;
+    entries.reserve(static_cast<size_t>(std::min<uint64_t>(count, content_size / 4)));
+
+    std::string path;
+    int64_t mtime = 0;
+    for (uint64_t i = 0; i < count && reader.ok(); ++i)
+    {
+        IndexEntry entry;
+
+        uint64_t shared = reader.get_varint();
+        uint64_t suffix_size = reader.get_varint();
+        const byte_t* suffix = reader.get_bytes(static_cast<size_t>(std::min<uint64_t>(suffix_size, SIZE_MAX)));
+        if (!suffix || shared > path.size()) break;
+
+        entry.path.reserve(static_cast<size_t>(shared + suffix_size));
+        entry.path.assign(path, 0, static_cast<size_t>(shared));
+        entry.path.append(reinterpret_cast<const char*>(suffix), static_cast<size_t>(suffix_size));
+        if (i > 0 && !(path < entry.path)) break;   // lookups depend on the order
+
+        entry.file_size = reader.get_varint();
+        mtime = static_cast<int64_t>(static_cast<uint64_t>(mtime) + static_cast<uint64_t>(zigzag_decode(reader.get_varint())));
+        entry.mtime = mtime;
+
+        byte_t flags = reader.get_byte();
+        entry.ok = (flags & INDEX_VALID_HEADER) != 0;
+        if (entry.ok)
+        {
+            uint64_t width = reader.get_varint();
+            uint64_t height = reader.get_varint();
+            if (width > UINT32_MAX || height > UINT32_MAX) break;
+
+            entry.header.width = static_cast<uint_t>(width);
+            entry.header.height = static_cast<uint_t>(height);
+            entry.header.bit_depth = reader.get_byte();
+            entry.header.colour_type = static_cast<ColourType>(reader.get_byte());
+            entry.header.interlace = reader.get_byte();
+        }
+
+        path = entry.path;
+        entries.push_back(std::move(entry));
+    }
+
+    if (!reader.ok() || entries.size() != count)
+    {
+        PNG_LOG(Error, "Index file is damaged");
+        return false;
+    }
+
+    pImpl->entries.swap(entries);
+    return true;
+}
+
+bool ImageIndex::save(const std::string& index_file) const
+{
+    const std::string temp_file = index_file + ".tmp";
+    {
+        std::ofstream ofs(temp_file, std::ios::out | std::ios::binary | std::ios::trunc);
+        IndexWriter writer(ofs);
+
+        writer.put_bytes(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        writer.put_le(INDEX_VERSION, 4);
+        writer.put_le(pImpl->entries.size(), 8);
+
+        const std::string* path = nullptr;
+        int64_t mtime = 0;
+        for (const IndexEntry& entry : pImpl->entries)
+        {
+            size_t shared = 0;
+            if (path)
+            {
+                const size_t limit = std::min(path->size(), entry.path.size());
+                while (shared < limit && (*path)[shared] == entry.path[shared]) ++shared;
+            }
+            writer.put_varint(shared);
+            writer.put_varint(entry.path.size() - shared);
+            writer.put_bytes(entry.path.data() + shared, entry.path.size() - shared);
+
+            writer.put_varint(entry.file_size);
+            writer.put_varint(zigzag_encode(static_cast<int64_t>(static_cast<uint64_t>(entry.mtime) - static_cast<uint64_t>(mtime))));
+            mtime = entry.mtime;
+
+            writer.put_byte(entry.ok ? INDEX_VALID_HEADER : 0);
+            if (entry.ok)
+            {
+                writer.put_varint(entry.header.width);
+                writer.put_varint(entry.header.height);
+                writer.put_byte(entry.header.bit_depth);
+                writer.put_byte(static_cast<byte_t>(entry.header.colour_type));
+                writer.put_byte(entry.header.interlace);
+            }
+            path = &entry.path;
+        }
+
+        if (!writer.finish())
+        {
+            PNG_LOG(Error, "Can't write " << temp_file);
+            std::remove(temp_file.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(temp_file.c_str(), index_file.c_str()) != 0)
+    {
+        PNG_LOG(Error, "Can't replace " << index_file);
+        std::remove(temp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ImageIndex::update(const std::string& directory, const IndexOptions& options)
+{
+#ifdef PNG_HAVE_MMAP
+    std::vector<IndexEntry> entries;
+    size_t probed = 0;
+    {
+        IndexWalk walk(pImpl->entries, directory, options);
+        if (!walk.run(entries, probed))
+        {
+            PNG_LOG(Error, "Can't list " << directory);
+            return false;
+        }
+    }
+
+    pImpl->entries.swap(entries);
+    pImpl->probed = probed;
+    return true;
+#else
+    PNG_LOG(Error, "Directory walking is not supported on this platform");
+    return false;
+#endif
+}
+
+const std::vector<IndexEntry>& ImageIndex::entries() const
+{
+    return pImpl->entries;
+}
+
+const IndexEntry* ImageIndex::find(const std::string& path) const
+{
+    return find_entry(pImpl->entries, path);
+}
+
+size_t ImageIndex::probed() const
+{
+    return pImpl->probed;
+}
+
+// --------------------------------------------------------
+// Encoder
+//
+// Images are written as IHDR, PLTE and tRNS when they have them, IDAT chunks 
+// and IEND. By default rows of 8 and 16 bit samples get the filter with the 
+// smallest sum of absolute differences, like libpng chooses it; indexed images,
+// smaller samples and level 0 stay unfiltered.
+
+static const size_t IDAT_CHUNK_SIZE = 1 << 18;
+
+// magnitude of a filtered byte taken as signed value
+inline size_t residual(int value)
+{
+    return std::abs(static_cast<int>(static_cast<signed char>(value)));
+}
+
+// paeth_predictor written for conditional moves, the filter search runs it on 
+// every byte of photographic rows where its branches are unpredictable
+inline int paeth_select(int a, int b, int c)
+{
+    const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+    const int bc = pb <= pc ? b : c;
+    return (pa <= pb) & (pa <= pc) ? a : bc;
+}
+
+// A search kernel writes all five filtered versions of a row next to each
+// other and sums their residual magnitudes in the same pass. Unlike
+// unfiltering, filtering depends only on the unfiltered row and the row
+// above, so the vector kernels take 16 or 32 bytes at once regardless of
+// the pixel size; the first pixel, which has no left neighbour, and the
+// tail of the row go through the scalar loop.
+
+static const size_t FILTER_COUNT = 5;
+
+// candidates holds FILTER_COUNT rows of size bytes, costs FILTER_COUNT sums
+typedef void (*filter_search_kernel_t)(const byte_t* row, const byte_t* prev, size_t size, size_t bpp,
+                                       byte_t* candidates, size_t* costs);
+
+// filters bytes [begin, end) of the row into the candidates and adds to costs
+static void filter_search_bytes(const byte_t* row, const byte_t* prev, size_t begin, size_t end, size_t size, size_t bpp,
+                                byte_t* candidates, size_t* costs)
+{
+    byte_t* none = candidates;
+    byte_t* sub = none + size;
+    byte_t* up = sub + size;
+    byte_t* average = up + size;
+    byte_t* paeth = average + size;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        const int x = row[i], b = prev[i];
+        const int a = i >= bpp ? row[i - bpp] : 0, c = i >= bpp ? prev[i - bpp] : 0;
+        none[i]    = x;
+        sub[i]     = x - a;
+        up[i]      = x - b;
+        average[i] = x - ((a + b) >> 1);
+        paeth[i]   = x - paeth_select(a, b, c);
+
+        costs[FILTER_NONE]    += residual(none[i]);
+        costs[FILTER_SUB]     += residual(sub[i]);
+        costs[FILTER_UP]      += residual(up[i]);
+        costs[FILTER_AVERAGE] += residual(average[i]);
+        costs[FILTER_PAETH]   += residual(paeth[i]);
+    }
+}
+
+static void filter_search_scalar(const byte_t* row, const byte_t* prev, size_t size, size_t bpp,
+                                 byte_t* candidates, size_t* costs)
+{
+    std::fill(costs, costs + FILTER_COUNT, 0);
+    filter_search_bytes(row, prev, 0, size, size, bpp, candidates, costs);
+}
+
+#ifdef PNG_X86_SIMD
+
+// Paeth prediction of 16-bit lanes holding bytes
+__attribute__((target("sse2"), always_inline))
+inline __m128i paeth_predict_epi16(__m128i a, __m128i b, __m128i c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    return paeth_nearest(a, b, c, pa, pb, pc);
+}
+
+// sum of the residual magnitudes of 16 bytes in two 64-bit lanes
+__attribute__((target("sse2"), always_inline))
+inline __m128i residual_sum(__m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero);
+}
+
+__attribute__((target("sse2")))
+static void filter_search_sse2(const byte_t* row, const byte_t* prev, size_t size, size_t bpp,
+                               byte_t* candidates, size_t* costs)
+{
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(1);
+    __m128i sums[FILTER_COUNT];
+    for (size_t f = 0; f < FILTER_COUNT; ++f) sums[f] = zero;
+
+    std::fill(costs, costs + FILTER_COUNT, 0);
+    size_t i = std::min(bpp, size);
+    filter_search_bytes(row, prev, 0, i, size, bpp, candidates, costs);
+
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i - bpp));
+
+        const __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+        const __m128i paeth = _mm_packus_epi16(
+            paeth_predict_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+            paeth_predict_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+
+        const __m128i filtered[FILTER_COUNT] = {
+            x, _mm_sub_epi8(x, a), _mm_sub_epi8(x, b), _mm_sub_epi8(x, average), _mm_sub_epi8(x, paeth)
+        };
+        for (size_t f = 0; f < FILTER_COUNT; ++f)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(candidates + f * size + i), filtered[f]);
+            sums[f] = _mm_add_epi64(sums[f], residual_sum(filtered[f]));
+        }
+    }
+
+    for (size_t f = 0; f < FILTER_COUNT; ++f)
+    {
+        alignas(16) uint64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sums[f]);
+        costs[f] += static_cast<size_t>(lanes[0] + lanes[1]);
+    }
+    filter_search_bytes(row, prev, i, size, size, bpp, candidates, costs);
+}
+
+__attribute__((target("avx2"), always_inline))
+inline __m256i paeth_predict_epi16_avx2(__m256i a, __m256i b, __m256i c)
+{
+    const __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+    const __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+    const __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+    const __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    const __m256i nearest = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+    return _mm256_blendv_epi8(nearest, a, _mm256_cmpeq_epi16(smallest, pa));
+}
+
+// unpacking and packing both work within 128-bit lanes, so the bytes come back in order
+__attribute__((target("avx2")))
+static void filter_search_avx2(const byte_t* row, const byte_t* prev, size_t size, size_t bpp,
+                               byte_t* candidates, size_t* costs)
+{
+    const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(1);
+    __m256i sums[FILTER_COUNT];
+    for (size_t f = 0; f < FILTER_COUNT; ++f) sums[f] = zero;
+
+    std::fill(costs, costs + FILTER_COUNT, 0);
+    size_t i = std::min(bpp, size);
+    filter_search_bytes(row, prev, 0, i, size, bpp, candidates, costs);
+
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i - bpp));
+
+        const __m256i average = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), ones));
+        const __m256i paeth = _mm256_packus_epi16(
+            paeth_predict_epi16_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero)),
+            paeth_predict_epi16_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero)));
+
+        const __m256i filtered[FILTER_COUNT] = {
+            x, _mm256_sub_epi8(x, a), _mm256_sub_epi8(x, b), _mm256_sub_epi8(x, average), _mm256_sub_epi8(x, paeth)
+        };
+        for (size_t f = 0; f < FILTER_COUNT; ++f)
+        {
+            const __m256i magnitude = _mm256_min_epu8(filtered[f], _mm256_sub_epi8(zero, filtered[f]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(candidates + f * size + i), filtered[f]);
+            sums[f] = _mm256_add_epi64(sums[f], _mm256_sad_epu8(magnitude, zero));
+        }
+    }
+
+    for (size_t f = 0; f < FILTER_COUNT; ++f)
+    {
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums[f]);
+        costs[f] += static_cast<size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    }
+    filter_search_bytes(row, prev, i, size, size, bpp, candidates, costs);
+}
+
+#endif
+
+static filter_search_kernel_t select_filter_search_kernel()
+{
+#ifdef PNG_X86_SIMD
+    const CpuFeatures& cpu = CpuFeatures::get();
+    if (cpu.avx2) return filter_search_avx2;
+    if (cpu.sse2) return filter_search_sse2;
+#endif
+    return filter_search_scalar;
+}
+
+// writes rows of packed pixels to out as scanlines with a filter byte each, 
+// prev is the row above the first one or null at the top of an image or pass
+static bool filter_rows(const byte_t* pixels, const byte_t* prev, size_t row_bytes, size_t rows, size_t bpp, 
+                        FilterStrategy strategy, int level, byte_t* out)
+{
+    static const filter_search_kernel_t search = select_filter_search_kernel();
+
+    if (strategy == FilterStrategy::None)
+    {
+        for (size_t y = 0; y < rows; ++y, pixels += row_bytes, out += row_bytes + 1)
+        {
+            out[0] = FILTER_NONE;
+            std::memcpy(out + 1, pixels, row_bytes);
+        }
+        return true;
+    }
+
+    std::vector<byte_t> zero_row, candidates, trial;
+    if (!prev)
+    {
+        if (!allocate(zero_row, row_bytes)) return false;
+        std::fill(zero_row.begin(), zero_row.end(), 0);
+        prev = zero_row.data();
+    }
+    if (!allocate(candidates, FILTER_COUNT * row_bytes)) return false;
+
+    std::unique_ptr<DeflateEncoder> encoder;
+    if (strategy == FilterStrategy::BruteForce) encoder.reset(new DeflateEncoder());
+    const int trial_level = std::max(1, std::min(level, MAX_DEFLATE_LEVEL));
+
+    for (size_t y = 0; y < rows; ++y, prev = pixels, pixels += row_bytes, out += row_bytes + 1)
+    {
+        size_t costs[FILTER_COUNT];
+        search(pixels, prev, row_bytes, bpp, candidates.data(), costs);
+
+        byte_t best = static_cast<byte_t>(strategy);
+        if (strategy == FilterStrategy::MinSum || strategy == FilterStrategy::BruteForce)
+        {
+            best = FILTER_NONE;
+            for (byte_t filter = FILTER_SUB; filter <= FILTER_PAETH; ++filter)
+                if (costs[filter] < costs[best]) best = filter;
+        }
+        if (strategy == FilterStrategy::BruteForce)
+        {
+            // each candidate is deflated on its own; short rows often compress to the
+            // same size, the heuristic choice wins such ties
+            size_t sizes[FILTER_COUNT];
+            for (byte_t filter = FILTER_NONE; filter <= FILTER_PAETH; ++filter)
+            {
+                out[0] = filter;
+                std::memcpy(out + 1, candidates.data() + filter * row_bytes, row_bytes);
+                trial.clear();
+                if (!encoder->deflate(out, 0, row_bytes + 1, trial_level, true, trial)) return false;
+                sizes[filter] = trial.size();
+            }
+            for (byte_t filter = FILTER_NONE; filter <= FILTER_PAETH; ++filter)
+                if (sizes[filter] < sizes[best]) best = filter;
+        }
+
+        out[0] = best;
+        std::memcpy(out + 1, candidates.data() + best * row_bytes, row_bytes);
+    }
+    return true;
+}
+
+// gathers the pixels of a pass from the image, the inverse of deinterlace_pass; data has to be zeroed
+void interlace_pass(const Adam7Pass& pass, const byte_t* image, size_t image_row_bytes,
+                    size_t bits_per_pixel, size_t pass_width, size_t pass_height, byte_t* data)
+{
+    const size_t pass_row_bytes = (pass_width * bits_per_pixel + 7) / 8;
+
+    for (size_t j = 0; j < pass_height; ++j, data += pass_row_bytes) {
+        const byte_t* src = image + (pass.y0 + j * pass.dy) * image_row_bytes;
+        if (bits_per_pixel >= 8) {
+            const size_t bpp = bits_per_pixel / 8;
+            for (size_t i = 0; i < pass_width; ++i)
+                std::memcpy(data + i * bpp, src + (pass.x0 + i * pass.dx) * bpp, bpp);
+        } else {
+            const byte_t mask = static_cast<byte_t>((1 << bits_per_pixel) - 1);
+            for (size_t i = 0; i < pass_width; ++i) {
+                size_t src_bit = (pass.x0 + i * pass.dx) * bits_per_pixel;
+                size_t dst_bit = i * bits_per_pixel;
+                byte_t v = (src[src_bit / 8] >> (8 - bits_per_pixel - src_bit % 8)) & mask;
+                data[dst_bit / 8] |= v << (8 - bits_per_pixel - dst_bit % 8);
+            }
+        }
+    }
+}
+
+inline void store_be32(byte_t* p, uint_t v)
+{
+    p[0] = static_cast<byte_t>(v >> 24);
+    p[1] = static_cast<byte_t>(v >> 16);
+    p[2] = static_cast<byte_t>(v >> 8);
+    p[3] = static_cast<byte_t>(v);
+}
+
+static void write_chunk(std::vector<byte_t>& png, ChunkType type, const byte_t* data, size_t size)
+{
+    byte_t field[CHUNK_LENGTH_SIZE + CHUNK_TYPE_SIZE];
+    store_be32(field, static_cast<uint_t>(size));
+    store_be32(field + CHUNK_LENGTH_SIZE, static_cast<uint_t>(type));
+    png.insert(png.end(), field, field + sizeof(field));
+    if (size > 0) png.insert(png.end(), data, data + size);
+
+    uint_t crc = crc32(field + CHUNK_LENGTH_SIZE, CHUNK_TYPE_SIZE);
+    if (size > 0) crc = crc32(data, size, crc);
+    store_be32(field, crc);
+    png.insert(png.end(), field, field + CHUNK_CRC_SIZE);
+}
+
+// Large images are filtered in bands of rows and compressed in segments on a
+// thread pool, like pigz does. Every segment is deflated on its own, primed
+// with the 32K bytes before it as dictionary, and ends byte-aligned with an
+// empty stored block, so the segments concatenate to one zlib stream. The
+// Adler-32 of the stream is combined from those of the segments.
+
+static const size_t PARALLEL_SEGMENT_SIZE = 1 << 20;
+
+// filters rows on the pool in bands of about a segment, on the calling thread without a pool
+static bool filter_bands(ThreadPool* pool, const byte_t* pixels, size_t row_bytes, size_t rows, size_t bpp,
+                         FilterStrategy strategy, int level, byte_t* out)
+{
+    const size_t band_rows = std::max<size_t>(1, PARALLEL_SEGMENT_SIZE / (row_bytes + 1));
+    if (!pool || rows <= band_rows) return filter_rows(pixels, nullptr, row_bytes, rows, bpp, strategy, level, out);
+
+    std::vector<char> done((rows + band_rows - 1) / band_rows, 0);
+    for (size_t band = 0; band < done.size(); ++band)
+    {
+        pool->submit([=, &done]() {
+            const size_t y = band * band_rows;
+            const byte_t* prev = y > 0 ? pixels + (y - 1) * row_bytes : nullptr;
+            done[band] = filter_rows(pixels + y * row_bytes, prev, row_bytes, std::min(band_rows, rows - y), bpp, 
+                                     strategy, level, out + y * (row_bytes + 1));
+        });
+    }
+    pool->wait();
+    return std::find(done.begin(), done.end(), 0) == done.end();
+}
+
+static bool compress_parallel(ThreadPool& pool, const byte_t* data, size_t size, int level, std::vector<byte_t>& out)
+{
+    level = std::max(0, std::min(level, MAX_DEFLATE_LEVEL));
+
+    const size_t count = (size + PARALLEL_SEGMENT_SIZE - 1) / PARALLEL_SEGMENT_SIZE;
+    std::vector<std::vector<byte_t>> segments(count);
+    std::vector<uint_t> adlers(count, 1);
+    std::vector<char> done(count, 0);
+
+    // one encoder per worker keeps the hash tables warm across segments
+    std::vector<std::unique_ptr<DeflateEncoder>> encoders;
+    for (size_t i = 0; i < pool.size(); ++i) encoders.emplace_back(new DeflateEncoder());
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        pool.submit([&, i]() {
+            const size_t begin = i * PARALLEL_SEGMENT_SIZE, end = std::min(size, begin + PARALLEL_SEGMENT_SIZE);
+            DeflateEncoder& encoder = *encoders[pool.current_worker()];
+            done[i] = encoder.deflate(data, begin, end, level, i + 1 == count, segments[i]);
+            adlers[i] = adler32(data + begin, end - begin);
+        });
+    }
+    pool.wait();
+    if (std::find(done.begin(), done.end(), 0) != done.end()) return false;
+
+    size_t total = 6;
+    for (const std::vector<byte_t>& segment : segments) total += segment.size();
+    out.reserve(out.size() + total);
+
+    append_zlib_header(out, level);
+    uint_t adler = 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        out.insert(out.end(), segments[i].begin(), segments[i].end());
+        adler = adler32_combine(adler, adlers[i], std::min(PARALLEL_SEGMENT_SIZE, size - i * PARALLEL_SEGMENT_SIZE));
+    }
+    append_be32(out, adler);
+    return true;
+}
+
+// scanlines of all passes with filter bytes, as they are compressed into IDAT
+static bool filter_image(ThreadPool* pool, const Header& head, const std::vector<byte_t>& pixels, FilterStrategy strategy, 
+                         int level, std::vector<byte_t>& filtered)
+{
+    const size_t bpp = head.filter_bpp();
+
+    if (!allocate(filtered, filtered_data_size(head))) return false;
+    if (!head.interlace) return filter_bands(pool, pixels.data(), head.row_bytes(head.width), head.height, bpp, strategy, level, filtered.data());
+
+    std::vector<byte_t> pass_data;
+    byte_t* out = filtered.data();
+    for (const Adam7Pass& pass : ADAM7_PASSES)
+    {
+        const size_t width = pass.width(head.width), height = pass.height(head.height);
+        if (width == 0 || height == 0) continue;
+
+        const size_t row_bytes = head.row_bytes(width);
+        if (!allocate(pass_data, row_bytes * height)) return false;
+        std::fill(pass_data.begin(), pass_data.end(), 0);
+        interlace_pass(pass, pixels.data(), head.row_bytes(head.width), head.bits_per_pixel(), width, height, pass_data.data());
+
+        if (!filter_bands(pool, pass_data.data(), row_bytes, height, bpp, strategy, level, out)) return false;
+        out += (row_bytes + 1) * height;
+    }
+    return true;
+}
+
+static bool encode_png(const Header& head, const std::vector<byte_t>& pixels, const Palette& palette, const EncodeOptions& options, 
+                       std::vector<byte_t>& png)
+{
+    if (head.width == 0 || head.height == 0 || pixels.size() != head.height * head.row_bytes(head.width))
+    {
+        PNG_LOG(Error, "No image to save");
+        return false;
+    }
+
+    if (head.colour_type == ColourType::Indexed && palette.size == 0)
+    {
+        PNG_LOG(Error, "Indexed image has no palette");
+        return false;
+    }
+
+    FilterStrategy strategy = options.level > 0 ? options.filter : FilterStrategy::None;
+    if (strategy == FilterStrategy::MinSum && (head.bit_depth < 8 || head.colour_type == ColourType::Indexed)) strategy = FilterStrategy::None;
+
+    const size_t segments = (filtered_data_size(head) + PARALLEL_SEGMENT_SIZE - 1) / PARALLEL_SEGMENT_SIZE;
+    const size_t threads = std::min(segments, options.threads > 0 ? options.threads : std::max<size_t>(1, std::thread::hardware_concurrency()));
+
+    std::vector<byte_t> filtered, stream;
+    if (threads > 1)
+    {
+        ThreadPool pool(threads);
+        if (!filter_image(&pool, head, pixels, strategy, options.level, filtered)) return false;
+        if (!compress_parallel(pool, filtered.data(), filtered.size(), options.level, stream)) return false;
+    }
+    else
+    {
+        DeflateEncoder deflater;
+        if (!filter_image(nullptr, head, pixels, strategy, options.level, filtered)) return false;
+        if (!deflater.compress(filtered.data(), filtered.size(), options.level, stream)) return false;
+    }
+
+    byte_t ihdr[13];
+    store_be32(ihdr, head.width);
+    store_be32(ihdr + 4, head.height);
+    ihdr[8]  = head.bit_depth;
+    ihdr[9]  = static_cast<byte_t>(head.colour_type);
+    ihdr[10] = 0;   // deflate
+    ihdr[11] = 0;   // adaptive filtering
+    ihdr[12] = head.interlace;
+
+    png.clear();
+    png.reserve(SIGNATURE_SIZE + stream.size() + (stream.size() / IDAT_CHUNK_SIZE + 5) * 12 + sizeof(ihdr) + 4 * 256);
+    png.insert(png.end(), PNG_SIGNATURE, PNG_SIGNATURE + SIGNATURE_SIZE);
+    write_chunk(png, ChunkType::IHDR, ihdr, sizeof(ihdr));
+
+    byte_t entries[256 * 3];
+    if (head.colour_type == ColourType::Indexed)
+    {
+        for (size_t i = 0; i < palette.size; ++i) std::memcpy(entries + 3 * i, palette.entries[i], 3);
+        write_chunk(png, ChunkType::PLTE, entries, 3 * palette.size);
+
+        for (size_t i = 0; i < palette.alpha_size; ++i) entries[i] = palette.entries[i][3];
+        if (palette.alpha_size > 0) write_chunk(png, ChunkType::tRNS, entries, palette.alpha_size);
+    }
+    else if (palette.has_key)
+    {
+        const size_t channels = head.channels();
+        for (size_t c = 0; c < channels; ++c)
+        {
+            entries[2 * c] = static_cast<byte_t>(palette.key[c] >> 8);
+            entries[2 * c + 1] = static_cast<byte_t>(palette.key[c]);
+        }
+        write_chunk(png, ChunkType::tRNS, entries, 2 * channels);
+    }
+
+    for (size_t offset = 0; offset < stream.size(); offset += IDAT_CHUNK_SIZE)
+        write_chunk(png, ChunkType::IDAT, stream.data() + offset, std::min(IDAT_CHUNK_SIZE, stream.size() - offset));
+    write_chunk(png, ChunkType::IEND, nullptr, 0);
+    return true;
+}
+
+// --------------------------------------------------------
+// PNGImage interface
+
+PNGImage::PNGImage() : pImpl(new Impl()) 
+{
+
+}
+
+PNGImage::PNGImage(const PNGImage& other) : pImpl(new Impl(*other.pImpl.get()))
+{
+
+}
+
+PNGImage::PNGImage(PNGImage&& other) : pImpl(new Impl())
+{
+    pImpl.swap(other.pImpl);
+}
+
+PNGImage& PNGImage::operator= (const PNGImage& other)
+{
+    if (&other == this) return *this;
+    
+    PNGImage tmp(other);
+    pImpl.swap(tmp.pImpl);
+    
+    return *this;
+}
+
+PNGImage& PNGImage::operator= (PNGImage&& other)
+{
+    if (&other == this) return *this;
+    
+    pImpl.swap(other.pImpl);
+    other.pImpl.reset(new Impl());
+
+    return *this;
+}
+
+PNGImage::~PNGImage()
+{
+    // nothing
+}
+
+bool PNGImage::create(size_t width, size_t height, ColourType colour_type, size_t bit_depth)
+{
+    if (width == 0 || height == 0 || width > 0x7FFFFFFF || height > 0x7FFFFFFF)
+    {
+        PNG_LOG(Error, "Wrong image size");
+        return false;
+    }
+
+    if (!bit_depth_allowed(colour_type, bit_depth))
+    {
+        PNG_LOG(Error, "Not allowed bit depth");
+        return false;
+    }
+
+    std::unique_ptr<Impl> image(new Impl());
+    image->head.width = static_cast<uint_t>(width);
+    image->head.height = static_cast<uint_t>(height);
+    image->head.colour_type = colour_type;
+    image->head.bit_depth = static_cast<byte_t>(bit_depth);
+
+    const size_t row_bytes = image->head.row_bytes(width);
+    if (height > SIZE_MAX / row_bytes || !allocate(image->data, height * row_bytes)) return false;
+
+    pImpl.swap(image);
+    return true;
+}
+
+bool PNGImage::open(const std::string& file_name, const DecodeOptions& options)
+{
+    Decoder decoder(options);
+    PNGImage tmp;
+    if (!decoder.decode(file_name, tmp)) return false;
+
+    pImpl.swap(tmp.pImpl);  
+    return true; 
+}
+
+bool PNGImage::open(const unsigned char* data, size_t size, const DecodeOptions& options)
+{
+    Decoder decoder(options);
+    PNGImage tmp;
+    if (!decoder.decode(data, size, tmp)) return false;
+
+    pImpl.swap(tmp.pImpl);  
+    return true; 
+}
+
+bool PNGImage::open_region(const std::string& file_name, size_t x, size_t y, size_t width, size_t height, 
+                           const DecodeOptions& options)
+{
+    Decoder decoder(options);
+    PNGImage tmp;
+    if (!decoder.decode_region(file_name, x, y, width, height, tmp)) return false;
+
+    pImpl.swap(tmp.pImpl);  
+    return true; 
+}
+
+bool PNGImage::save_as(const std::string& file_name, const EncodeOptions& options) const
+{
+    std::vector<byte_t> png;
+    if (!save_as(png, options)) return false;
+
+    std::ofstream ofs(file_name, std::ios::out | std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(png.data()), png.size());
+    if (!ofs)
+    {
+        PNG_LOG(Error, "Can't write " << file_name);
+        return false;
+    }
+    return true;
+}
+
+bool PNGImage::save_as(std::vector<unsigned char>& png, const EncodeOptions& options) const
+{
+    return encode_png(pImpl->head, pImpl->data, pImpl->palette, options, png);
+}
+
+const Header& PNGImage::header() const
+{
+    return pImpl->head;
+}
+
+const unsigned char* PNGImage::data() const
+{
+    return pImpl->data.data();
+}
+
+unsigned char* PNGImage::data()
+{
+    return pImpl->data.data();
+}
+
+size_t PNGImage::data_size() const
+{
+    return pImpl->data.size();
+}
+
+const DecodeTimings& PNGImage::timings() const
+{
+    return pImpl->stats.timings;
+}
+
+const DecodeStats& PNGImage::stats() const
+{
+    return pImpl->stats;
+}
+
+// --------------------------------------------------------
+// RowReader
+
+struct RowReader::Impl {
+    // space for inflated data beyond the window, at least one scanline
+    static const size_t READ_AHEAD = 32768;
+
+    ImageFile file;
+    Header head;
+    std::vector<byte_t> window;     // inflated data, MAX_WINDOW_SIZE bytes before read_pos serve back-references
+    size_t read_pos;                // start of not yet consumed inflated data
+    size_t filled;                  // end of inflated data
+    InflateState inflater;
+    bool input_done;                // IEND was reached
+
+    std::vector<byte_t> prev_row;   // reconstructed previous row of the current pass
+    std::vector<byte_t> row;
+
+    size_t pass;
+    size_t pass_y;                  // row within the current pass
+    size_t width;                   // row width in pixels
+    bool failed;
+    bool finished;                  // the last row was returned, pass and pass_y stay at it
+
+    Impl() : file(), head(), window(), read_pos(0), filled(0), inflater(), input_done(false), 
+             prev_row(), row(), pass(0), pass_y(0), width(0), failed(false), finished(false)
+    {}
+
+    bool start(const DecodeOptions& options);
+    bool next_pass();
+    bool last_pass() const;
+    bool feed_next_chunk();
+    void slide();
+    bool fill(size_t size);
+    bool finish();
+    const byte_t* next_row();
+};
+
+const size_t RowReader::Impl::READ_AHEAD;
+
+bool RowReader::Impl::start(const DecodeOptions& options)
+{
+    file.set_verify_crc(options.verify_checksums);
+    inflater.set_verify_checksum(options.verify_checksums);
+
+    if (!is_png_file(file))
+    {
+        PNG_LOG(Error, "Is not PNG file");
+        return false;      
+    }
+    if (!head.from_file(file)) return false;
+
+    // the widest scanline belongs to the full image or to the last Adam7 pass, both are image wide
+    if (head.width > (SIZE_MAX - 8) / head.bits_per_pixel()) 
+    {
+        PNG_LOG(Error, "Image is too large");
+        return false;
+    }
+    const size_t max_row_size = head.row_bytes(head.width) + 1;
+    if (!allocate(window, InflateState::MAX_WINDOW_SIZE + std::max(max_row_size, READ_AHEAD))) return false;
+
+    pass = 0;
+    pass_y = 0;
+    width = 0;
+    return next_pass();
+}
+
+// moves to the first non-empty pass starting from the current one
+bool RowReader::Impl::next_pass()
+{
+    if (head.interlace == 0) 
+    {
+        if (pass > 0) return false;
+        width = head.width;
+    } 
+    else 
+    {
+        for (; pass < ADAM7_PASS_COUNT; ++pass)
+        {
+            width = ADAM7_PASSES[pass].width(head.width);
+            if (width != 0 && ADAM7_PASSES[pass].height(head.height) != 0) break;
+        }
+        if (pass == ADAM7_PASS_COUNT) return false;
+    }
+
+    pass_y = 0;
+    prev_row.assign(head.row_bytes(width), 0);
+    row.resize(prev_row.size());
+    return true;
+}
+
+// true when no pass after the current one has scanlines
+bool RowReader::Impl::last_pass() const
+{
+    if (head.interlace == 0) return true;
+
+    for (size_t p = pass + 1; p < ADAM7_PASS_COUNT; ++p)
+    {
+        if (ADAM7_PASSES[p].width(head.width) != 0 && ADAM7_PASSES[p].height(head.height) != 0) return false;
+    }
+    return true;
+}
+
+// drops data that is neither unread nor needed for back-references
+void RowReader::Impl::slide()
+{
+    const size_t drop = read_pos - std::min(read_pos, InflateState::MAX_WINDOW_SIZE);
+    std::memmove(window.data(), window.data() + drop, filled - drop);
+    read_pos -= drop;
+    filled -= drop;
+}
+
+// inflates until size bytes are available at read_pos
+bool RowReader::Impl::fill(size_t size)
+{
+    while (filled - read_pos < size)
+    {
+        if (filled == window.size()) slide();
+
+        inflater.set_output(window.data(), filled, window.size());
+        InflateState::Status status = inflater.run();
+        filled = inflater.output_pos();
+
+        if (status == InflateState::ERROR) return false;
+        if (status == InflateState::DONE && filled - read_pos < size)
+        {
+            PNG_LOG(Error, "Image data is too short");
+            return false;
+        }
+        if (status == InflateState::NEED_INPUT && !feed_next_chunk()) return false;
+    }
+    return true;
+}
+
+// feeds the next IDAT chunk to the inflater
+bool RowReader::Impl::feed_next_chunk()
+{
+    for (;;)
+    {
+        if (input_done || file.eof() || !file.is_open()) 
+        {
+            PNG_LOG(Error, "Image data is incomplete");
+            return false;
+        }
+
+        uint_t length; file.read(length);
+        file.reset_crc();
+        ChunkType type; file.read(type);
+
+        if (type == ChunkType::IDAT) 
+        {
+            DataView payload = file.view(length);
+            if (!check_crc(file))
+            {
+                PNG_LOG(Error, "Checksum does not match");
+                return false;
+            }
+            inflater.feed(payload);
+            return true;
+        } 
+
+        input_done = type == ChunkType::IEND;
+        file.skip(length + CHUNK_CRC_SIZE);
+    }
+}
+
+// inflates the rest of the stream, up to and including the Adler-32 trailer
+bool RowReader::Impl::finish()
+{
+    bool has_extra_data = false;
+    for (;;)
+    {
+        // like libpng, data past the last scanline is not an error, it is inflated and dropped
+        has_extra_data = has_extra_data || filled > read_pos;
+        read_pos = filled;
+        if (filled == window.size()) slide();
+
+        inflater.set_output(window.data(), filled, window.size());
+        InflateState::Status status = inflater.run();
+        filled = inflater.output_pos();
+
+        if (status == InflateState::ERROR) return false;
+        if (status == InflateState::DONE) 
+        {
+            if (has_extra_data || filled > read_pos) PNG_LOG(Warning, "Extra image data ignored");
+            return true;
+        }
+        if (status == InflateState::NEED_INPUT && !feed_next_chunk()) return false;
+    }
+}
+
+const byte_t* RowReader::Impl::next_row()
+{
+    if (failed || finished) return nullptr;
+
+    const size_t pass_height = head.interlace ? ADAM7_PASSES[pass].height(head.height) : head.height;
+    if (pass_y == pass_height)
+    {
+        ++pass;
+        if (!next_pass()) return nullptr;
+    }
+
+    const size_t row_bytes = row.size();
+    if (!fill(row_bytes + 1)) 
+    {
+        failed = true;
+        return nullptr;
+    }
+
+    if (pass_y > 0) prev_row.swap(row);
+
+    const byte_t* filtered = window.data() + read_pos;
+    std::memcpy(row.data(), filtered + 1, row_bytes);
+    read_pos += row_bytes + 1;
+    if (!unfilter_row(filtered[0], row.data(), prev_row.data(), row_bytes, head.filter_bpp()))
+    {
+        PNG_LOG(Error, "Wrong filter type " << (int)filtered[0]);
+        failed = true;
+        return nullptr;
+    }
+
+    ++pass_y;
+
+    // the stream is checked to the end before the last row is handed out
+    if (pass_y == pass_height && last_pass())
+    {
+        if (!finish())
+        {
+            failed = true;
+            return nullptr;
+        }
+        finished = true;
+    }
+    return row.data();
+}
+
+RowReader::RowReader() : pImpl(new Impl())
+{}
+
+RowReader::~RowReader()
+{}
+
+bool RowReader::open(const std::string& file_name, const DecodeOptions& options)
+{
+    close();
+    return pImpl->file.open(file_name) && pImpl->start(options);
+}
+
+bool RowReader::open(const unsigned char* data, size_t size, const DecodeOptions& options)
+{
+    close();
+    return pImpl->file.open(data, size) && pImpl->start(options);
+}
+
+void RowReader::close()
+{
+    pImpl.reset(new Impl());
+}
+
+const Header& RowReader::header() const
+{
+    return pImpl->head;
+}
+
+const unsigned char* RowReader::next_row()
+{
+    return pImpl->next_row();
+}
+
+size_t RowReader::row_bytes() const
+{
+    return pImpl->row.size();
+}
+
+size_t RowReader::row_width() const
+{
+    return pImpl->width;
+}
+
+size_t RowReader::pass() const
+{
+    // numbered from 1 as in the specification, 0 is left for images without passes
+    return pImpl->head.interlace ? pImpl->pass + 1 : 0;
+}
+
+size_t RowReader::y() const
+{
+    if (pImpl->pass_y == 0) return 0;
+    if (!pImpl->head.interlace) return pImpl->pass_y - 1;
+    const Adam7Pass& pass = ADAM7_PASSES[pImpl->pass];
+    return pass.y0 + (pImpl->pass_y - 1) * pass.dy;
+}
+
+// --------------------------------------------------------
+// Metadata reader
+//
+// The chunk walk reads only the length and type of every chunk and jumps
+// over its data, with checksums turned off. A chunk's CRC is verified the
+// first time an accessor reads it and the result is kept in the table.
+
+// chunk lengths are limited to 2^31 - 1 by the standard
+static const uint_t MAX_CHUNK_LENGTH = 0x7FFFFFFF;
+
+// zTXt, iTXt and iCCP data is not inflated beyond this size
+static const size_t MAX_METADATA_SIZE = size_t(1) << 24;
+
+// keywords of text chunks and ICC profile names
+static const size_t MAX_KEYWORD_SIZE = 79;
+
+static std::string latin1_to_utf8(const byte_t* data, size_t size)
+{
+    std::string utf8;
+    utf8.reserve(size);
+    for (const byte_t* end = data + size; data < end; ++data)
+    {
+        if (*data < 0x80)
+        {
+            utf8 += static_cast<char>(*data);
+        }
+        else
+        {
+            utf8 += static_cast<char>(0xC0 | (*data >> 6));
+            utf8 += static_cast<char>(0x80 | (*data & 0x3F));
+        }
+    }
+    return utf8;
+}
+
+// reads a zero-terminated string starting at pos and moves pos past the terminator
+static bool read_string(const DataView& data, size_t& pos, std::string& value)
+{
+    const byte_t* begin = data.data + pos;
+    const byte_t* end = std::find(begin, data.data + data.size, 0);
+    if (end == data.data + data.size) return false;
+
+    value.assign(reinterpret_cast<const char*>(begin), end - begin);
+    pos += end - begin + 1;
+    return true;
+}
+
+// reads the Latin-1 keyword that starts text and iCCP chunks
+static bool read_keyword(const DataView& data, size_t& pos, std::string& keyword)
+{
+    std::string latin1;
+    if (!read_string(data, pos, latin1) || latin1.empty() || latin1.size() > MAX_KEYWORD_SIZE)
+    {
+        PNG_LOG(Error, "Wrong keyword");
+        return false;
+    }
+    keyword = latin1_to_utf8(reinterpret_cast<const byte_t*>(latin1.data()), latin1.size());
+    return true;
+}
+
+static bool is_text_chunk(const ChunkInfo& chunk)
+{
+    const ChunkType type = static_cast<ChunkType>(chunk.type);
+    return type == ChunkType::tEXt || type == ChunkType::zTXt || type == ChunkType::iTXt;
+}
+
+struct MetadataReader::Impl {
+    ImageFile file;
+    Header head;
+    std::vector<ChunkInfo> chunks;
+    bool verify_checksums;
+    InflateState inflater;
+    std::vector<byte_t> inflated;   // decompressed text
+
+    Impl() : file(), head(), chunks(), verify_checksums(true), inflater(), inflated()
+    {}
+
+    bool start(const DecodeOptions& options);
+
+    // first chunk of type, nullptr when there is none
+    ChunkInfo* find_chunk(ChunkType type);
+    // view of the chunk data, false when its checksum does not match
+    bool chunk_data(ChunkInfo& chunk, DataView& data);
+    bool inflate(const DataView& input, std::vector<byte_t>& out);
+    bool read_text(ChunkInfo& chunk, TextEntry& entry);
+};
+
+bool MetadataReader::Impl::start(const DecodeOptions& options)
+{
+    verify_checksums = options.verify_checksums;
+    file.set_verify_crc(options.verify_checksums);
+    inflater.set_verify_checksum(options.verify_checksums);
+
+    if (!is_png_file(file))
+    {
+        PNG_LOG(Error, "Is not PNG file");
+        return false;      
+    }
+    if (!head.from_file(file)) return false;
+
+    const ChunkCrc header_crc = verify_checksums ? ChunkCrc::Valid : ChunkCrc::Unchecked;
+    chunks.push_back(ChunkInfo{ static_cast<uint_t>(ChunkType::IHDR), SIGNATURE_SIZE + CHUNK_LENGTH_SIZE + CHUNK_TYPE_SIZE, 13, header_crc });
+
+    file.set_verify_crc(false);
+    const size_t file_size = file.contents().size;
+    while (!file.eof())
+    {
+        uint_t length; 
+        ChunkType type;
+        file >> length >> type;
+
+        const size_t offset = file.position();
+        if (!file.is_open() || length > MAX_CHUNK_LENGTH || file_size - offset < size_t(length) + CHUNK_CRC_SIZE)
+        {
+            // like the decoder, everything up to the damage is still usable
+            PNG_LOG(Warning, "File is truncated");
+            break;
+        }
+
+        chunks.push_back(ChunkInfo{ static_cast<uint_t>(type), offset, length, ChunkCrc::Unchecked });
+        if (type == ChunkType::IEND) break;
+        file.skip(length + CHUNK_CRC_SIZE);
+    }
+    return true;
+}
+
+ChunkInfo* MetadataReader::Impl::find_chunk(ChunkType type)
+{
+    for (ChunkInfo& chunk : chunks)
+    {
+        if (chunk.type == static_cast<uint_t>(type)) return &chunk;
+    }
+    return nullptr;
+}
+
+bool MetadataReader::Impl::chunk_data(ChunkInfo& chunk, DataView& data)
+{
+    const byte_t* begin = file.contents().data + chunk.offset;
+    data = DataView(begin, chunk.length);
+    if (!verify_checksums) return true;
+
+    if (chunk.crc == ChunkCrc::Unchecked)
+    {
+        uint_t crc = crc32(begin - CHUNK_TYPE_SIZE, CHUNK_TYPE_SIZE + chunk.length);
+        chunk.crc = crc == load_be32(begin + chunk.length) ? ChunkCrc::Valid : ChunkCrc::Invalid;
+    }
+    if (chunk.crc == ChunkCrc::Invalid)
+    {
+        PNG_LOG(Error, "Checksum does not match");
+        return false;
+    }
+    return true;
+}
+
+bool MetadataReader::Impl::inflate(const DataView& input, std::vector<byte_t>& out)
+{
+    // the output buffer starts at a guess and doubles until the stream ends
+    if (!allocate(out, std::min(MAX_METADATA_SIZE, std::max<size_t>(1024, input.size * 4)))) return false;
+
+    inflater.reset();
+    inflater.set_output(out.data(), 0, out.size());
+    InflateState::Status status = inflater.inflate(input);
+    while (status == InflateState::OUTPUT_FULL)
+    {
+        if (out.size() == MAX_METADATA_SIZE)
+        {
+            PNG_LOG(Error, "Compressed metadata is too large");
+            return false;
+        }
+
+        const size_t pos = inflater.output_pos();
+        if (!allocate(out, std::min(MAX_METADATA_SIZE, out.size() * 2))) return false;
+        inflater.set_output(out.data(), pos, out.size());
+        status = inflater.run();
+    }
+
+    if (status == InflateState::NEED_INPUT) PNG_LOG(Error, "Compressed metadata is incomplete");
+    if (status != InflateState::DONE) return false;
+
+    out.resize(inflater.output_pos());
+    return true;
+}
+
+bool MetadataReader::Impl::read_text(ChunkInfo& chunk, TextEntry& entry)
+{
+    DataView data;
+    size_t pos = 0;
+    if (!chunk_data(chunk, data) || !read_keyword(data, pos, entry.keyword)) return false;
+
+    const DataView rest(data.data + pos, data.size - pos);
+    switch (static_cast<ChunkType>(chunk.type))
+    {
+        case ChunkType::tEXt :
+            entry.text = latin1_to_utf8(rest.data, rest.size);
+            return true;
+
+        case ChunkType::zTXt :
+        {
+            if (rest.size == 0 || rest.data[0] != 0)
+            {
+                PNG_LOG(Error, "Unknown compression method");
+                return false;
+            }
+            if (!inflate(DataView(rest.data + 1, rest.size - 1), inflated)) return false;
+            entry.text = latin1_to_utf8(inflated.data(), inflated.size());
+            return true;
+        }
+
+        default :   // iTXt, UTF-8 throughout
+        {
+            if (rest.size < 2)
+            {
+                PNG_LOG(Error, "Wrong international text");
+                return false;
+            }
+            const byte_t compressed = rest.data[0];
+            const byte_t method = rest.data[1];
+            if (compressed > 1 || method != 0)
+            {
+                PNG_LOG(Error, "Unknown compression method");
+                return false;
+            }
+
+            pos += 2;
+            if (!read_string(data, pos, entry.language) || !read_string(data, pos, entry.translated_keyword))
+            {
+                PNG_LOG(Error, "Wrong international text");
+                return false;
+            }
+
+            const DataView text(data.data + pos, data.size - pos);
+            if (!compressed)
+            {
+                entry.text.assign(reinterpret_cast<const char*>(text.data), text.size);
+                return true;
+            }
+            if (!inflate(text, inflated)) return false;
+            entry.text.assign(reinterpret_cast<const char*>(inflated.data()), inflated.size());
+            return true;
+        }
+    }
+}
+
+// --------------------------------------------------------
+// Metadata reader interface
+
+MetadataReader::MetadataReader() : pImpl(new Impl())
+{}
+
+MetadataReader::~MetadataReader()
+{}
+
+bool MetadataReader::open(const std::string& file_name, const DecodeOptions& options)
+{
+    close();
+    return pImpl->file.open(file_name) && pImpl->start(options);
+}
+
+bool MetadataReader::open(const unsigned char* data, size_t size, const DecodeOptions& options)
+{
+    close();
+    return pImpl->file.open(data, size) && pImpl->start(options);
+}
+
+void MetadataReader::close()
+{
+    pImpl.reset(new Impl());
+}
+
+const Header& MetadataReader::header() const
+{
+    return pImpl->head;
+}
+
+const std::vector<ChunkInfo>& MetadataReader::chunks() const
+{
+    return pImpl->chunks;
+}
+
+bool MetadataReader::text(std::vector<TextEntry>& entries)
+{
+    entries.clear();
+    for (ChunkInfo& chunk : pImpl->chunks)
+    {
+        if (!is_text_chunk(chunk)) continue;
+
+        // a damaged chunk does not hide the ones after it
+        TextEntry entry;
+        if (!pImpl->read_text(chunk, entry))
+        {
+            PNG_LOG(Warning, "Damaged " << chunk.name() << " chunk at " << chunk.offset << " skipped");
+            continue;
+        }
+        entries.push_back(std::move(entry));
+    }
+    return !entries.empty();
+}
+
+bool MetadataReader::find_text(const std::string& keyword, TextEntry& entry)
+{
+    for (ChunkInfo& chunk : pImpl->chunks)
+    {
+        if (!is_text_chunk(chunk)) continue;
+
+        // the keyword is never compressed, the text is read only for the match
+        DataView data;
+        size_t pos = 0;
+        std::string chunk_keyword;
+        if (!pImpl->chunk_data(chunk, data) || !read_keyword(data, pos, chunk_keyword))
+        {
+            PNG_LOG(Warning, "Damaged " << chunk.name() << " chunk at " << chunk.offset << " skipped");
+            continue;
+        }
+        if (chunk_keyword != keyword) continue;
+
+        if (pImpl->read_text(chunk, entry)) return true;
+        PNG_LOG(Warning, "Damaged " << chunk.name() << " chunk at " << chunk.offset << " skipped");
+    }
+    return false;
+}
+
+bool MetadataReader::icc_profile(std::string& name, std::vector<unsigned char>& profile)
+{
+    ChunkInfo* chunk = pImpl->find_chunk(ChunkType::iCCP);
+    if (!chunk) return false;
+
+    DataView data;
+    size_t pos = 0;
+    if (!pImpl->chunk_data(*chunk, data) || !read_keyword(data, pos, name)) return false;
+    if (pos == data.size || data.data[pos] != 0)
+    {
+        PNG_LOG(Error, "Unknown compression method");
+        return false;
+    }
+    return pImpl->inflate(DataView(data.data + pos + 1, data.size - pos - 1), profile);
+}
+
+bool MetadataReader::physical_size(PhysicalSize& size)
+{
+    ChunkInfo* chunk = pImpl->find_chunk(ChunkType::pHYs);
+    DataView data;
+    if (!chunk || !pImpl->chunk_data(*chunk, data)) return false;
+    if (data.size != 9 || data.data[8] > 1)
+    {
+        PNG_LOG(Error, "Wrong physical pixel dimensions");
+        return false;
+    }
+
+    size.x = load_be32(data.data);
+    size.y = load_be32(data.data + 4);
+    size.metre = data.data[8] == 1;
+    return true;
+}
+
+bool MetadataReader::time(Timestamp& time)
+{
+    ChunkInfo* chunk = pImpl->find_chunk(ChunkType::tIME);
+    DataView data;
+    if (!chunk || !pImpl->chunk_data(*chunk, data)) return false;
+
+    const byte_t* p = data.data;
+    if (data.size != 7 || p[2] < 1 || p[2] > 12 || p[3] < 1 || p[3] > 31 || p[4] > 23 || p[5] > 59 || p[6] > 60)
+    {
+        PNG_LOG(Error, "Wrong time stamp");
+        return false;
+    }
+
+    time.year = load_be16(p);
+    time.month = p[2];
+    time.day = p[3];
+    time.hour = p[4];
+    time.minute = p[5];
+    time.second = p[6];
+    return true;
+}
+
+bool MetadataReader::gamma(uint_t& gamma)
+{
+    ChunkInfo* chunk = pImpl->find_chunk(ChunkType::gAMA);
+    DataView data;
+    if (!chunk || !pImpl->chunk_data(*chunk, data)) return false;
+    if (data.size != 4 || load_be32(data.data) == 0)
+    {
+        PNG_LOG(Error, "Wrong gamma");
+        return false;
+    }
+
+    gamma = load_be32(data.data);
+    return true;
+}
+
+}; // namespace png
 
-}; // namespace png
@@ -4,9 +4,217 @@
 #include <string>
 #include <memory>
 #include <exception>
+#include <functional>
+#include <future>
+#include <vector>
+#include <cstdint>
 
 namespace png {
 
+typedef unsigned int   uint_t;
+typedef unsigned short ushort_t;
+typedef unsigned char  byte_t;
+
+class ImageFile;
+
+enum class ColourType : byte_t
+{
+    Greyscale   = 0,
+    TrueColour  = 2,
+    Indexed     = 3,
+    AGreyscale  = 4,
+    ATrueColour = 6
+};
+
+enum class ChunkType : uint_t
+{
+    IHDR = 0x49484452,  // Image header
+    PLTE = 0x504c5445,  // Palette table
+    IDAT = 0x49444154,  // Image data
+    IEND = 0x49454e44,  // Image trailer
+
+    tRNS = 0x74524e53,  // Transparency information
+
+                        // Colour space information
+    cHRM = 0x6348524d,
+    gAMA = 0x67414d41,
+    iCCP = 0x69434350,
+    sBIT = 0x73424954,
+    sRGB = 0x73524742,
+                        // Textual information
+    iTXt = 0x69545874,
+    tEXt = 0x74455874,
+    zTXt = 0x7a545874,
+                        // Miscellaneous information
+    bKGD = 0x624b4744,
+    hIST = 0x68495354,
+    pHYs = 0x70485973,
+    sPLT = 0x73504c54,
+    
+    tIME = 0x74494d45  // Time stamp
+};
+
+// --------------------------------------------------------
+// Diagnostics
+//
+// Decoder messages are compiled in for debug builds or with PNG_ENABLE_LOGGING 
+// defined, release builds don't format or write anything. Messages go to 
+// std::clog unless a callback is installed.
+
+enum class LogLevel
+{
+    Error   = 0,
+    Warning = 1,
+    Info    = 2,
+    Trace   = 3
+};
+
+typedef void (*log_callback_t)(LogLevel level, const char* message, void* user_data);
+
+// routes messages to callback, nullptr restores the default sink;
+// should not be changed while images are being decoded
+void set_log_callback(log_callback_t callback, void* user_data = nullptr);
+
+// messages less severe than level are dropped before they are formatted, Warning by default
+void set_log_level(LogLevel level);
+
+// --------------------------------------------------------
+// Image header
+
+struct Header {
+    uint_t width;       
+    uint_t height;      
+    byte_t bit_depth;
+    ColourType colour_type;
+    byte_t compression;  
+    byte_t filter;       
+    byte_t interlace;    
+
+    Header() : width(0), height (0), bit_depth(0), colour_type(ColourType::ATrueColour), compression(0), filter(0), interlace(0)
+    {}
+
+    bool from_file(ImageFile& file);
+
+    size_t channels() const;
+    size_t bits_per_pixel() const { return channels() * bit_depth; }
+    // distance in bytes to the corresponding byte of the previous pixel used by filters
+    size_t filter_bpp() const { return bits_per_pixel() >= 8 ? bits_per_pixel() / 8 : 1; }
+    size_t row_bytes(size_t pixels) const { return (pixels * bits_per_pixel() + 7) / 8; }
+};
+
+// --------------------------------------------------------
+// Decoding options
+
+// layout of decoded pixels; 16-bit samples are big-endian as in PNG files
+enum class PixelFormat
+{
+    Native,   // as stored in the file, palette indices and sub-byte samples packed
+    RGBA8,    // transparency from tRNS becomes alpha
+    RGB8,     // alpha is dropped, not composited
+    Grey8,    // luminance of colour images, alpha is dropped
+    RGBA16
+};
+
+struct DecodeOptions {
+    // check chunk CRCs and the Adler-32 of the image data, 
+    // may be turned off for trusted input to save the checksum passes
+    bool verify_checksums;
+    // pixels are converted while the image is decoded, the header of the
+    // image describes the converted pixels; RowReader always returns Native rows
+    PixelFormat format;
+    // 1, 2, 4 or 8: the image is decoded that many times smaller in both directions, 
+    // every pixel the mean of its block, without holding the full-size pixels; 
+    // needs whole-byte samples, so Native is only possible for 8 and 16-bit non-indexed images.
+    // Interlaced images take the top-left pixel of every block from their first passes and 
+    // are not read further. Ignored by RowReader, not combined with regions
+    size_t scale;
+
+    DecodeOptions() : verify_checksums(true), format(PixelFormat::Native), scale(1)
+    {}
+};
+
+// largest scale that keeps the decoded image at least width x height pixels
+size_t thumbnail_scale(const Header& head, size_t width, size_t height);
+
+// --------------------------------------------------------
+// Encoding options
+
+// how the encoder picks the filter of each row
+enum class FilterStrategy : unsigned char
+{
+    None = 0,      // one filter for every row
+    Sub = 1,
+    Up = 2,
+    Average = 3,
+    Paeth = 4,
+    MinSum = 5,    // smallest sum of absolute differences, as libpng; indexed rows and rows under 8 bits stay unfiltered
+    BruteForce = 6 // deflates each candidate row on its own and keeps the smallest, many times slower
+};
+
+struct EncodeOptions {
+    // deflate level as in zlib: 0 stores, 1 is fastest, 9 compresses best
+    int level;
+    // threads filtering and compressing images over 1 MiB in parallel segments, 
+    // 0 for one per hardware thread; costs a little compression at segment borders
+    size_t threads;
+    // ignored at level 0, which leaves every row unfiltered
+    FilterStrategy filter;
+
+    EncodeOptions() : level(6), threads(1), filter(FilterStrategy::MinSum)
+    {}
+};
+
+// wall time of each decoding stage in nanoseconds
+struct DecodeTimings {
+    uint64_t io;         // opening the file, mapped files are paged in by the stages that touch them
+    uint64_t parse;      // signature, chunk walking and everything not listed below
+    uint64_t crc;        // chunk checksums
+    uint64_t inflate;    // including the Adler-32 check and Huffman table building
+    uint64_t huffman;    // building the tables of dynamic blocks, part of inflate
+    uint64_t unfilter;   // including Adam7 deinterlacing
+    uint64_t convert;    // pixel format conversion
+    uint64_t total;
+
+    DecodeTimings() : io(0), parse(0), crc(0), inflate(0), huffman(0), unfilter(0), convert(0), total(0)
+    {}
+};
+
+// --------------------------------------------------------
+// Decode statistics
+//
+// Counted by every decode at the cost of a few additions per chunk, deflate 
+// block and match; literals are not counted one by one but derived from the 
+// inflated size. Building the library with PNG_DISABLE_STATS defined removes 
+// the counters and the stage timers, the statistics then stay zero.
+
+struct DecodeStats {
+    // the chunk types known to the decoder, counted in that order, with one more for all other types
+    static const size_t CHUNK_TYPES = 18;
+
+    uint64_t bytes_read;        // file bytes walked, less than the file size when a decode stops early
+    uint64_t chunks[CHUNK_TYPES + 1];
+    uint64_t idat_bytes;        // compressed image data
+    uint64_t inflated_bytes;    // filtered image data, less than its full size when a decode stops early
+    uint64_t stored_blocks;
+    uint64_t fixed_blocks;
+    uint64_t dynamic_blocks;
+    uint64_t literals;
+    uint64_t matches;
+    uint64_t match_bytes;       // bytes copied by matches
+    DecodeTimings timings;
+
+    DecodeStats();
+
+    uint64_t chunk_count(ChunkType type) const;
+    // chunks of types not listed in ChunkType
+    uint64_t unknown_chunks() const { return chunks[CHUNK_TYPES]; }
+    // 0 without matches
+    double average_match_length() const { return matches ? static_cast<double>(match_bytes) / matches : 0.0; }
+};
+
+class Decoder;
+class BatchDecoder;
+
 class PNGImage {
 public:
     PNGImage();
@@ -19,13 +227,400 @@ public:
     
     ~PNGImage();
     
-    bool open (const std::string& file_name);
-    bool create (size_t width, size_t height);
-    bool save_as (const std::string& file_name);
+    bool open (const std::string& file_name, const DecodeOptions& options = DecodeOptions());
+    // data must stay valid while open() runs
+    bool open (const unsigned char* data, size_t size, const DecodeOptions& options = DecodeOptions());
+    // decodes a part of the image, see Decoder::decode_region
+    bool open_region (const std::string& file_name, size_t x, size_t y, size_t width, size_t height, 
+                      const DecodeOptions& options = DecodeOptions());
+    // a zeroed, non-interlaced image
+    bool create (size_t width, size_t height, ColourType colour_type = ColourType::ATrueColour, size_t bit_depth = 8);
+    // writes the image with its interlace method, and with its palette and transparency
+    bool save_as (const std::string& file_name, const EncodeOptions& options = EncodeOptions()) const;
+    // encodes into png, replacing its contents
+    bool save_as (std::vector<unsigned char>& png, const EncodeOptions& options = EncodeOptions()) const;
 
-    
+    const Header& header() const;
+
+    // decoded image as packed pixel rows of header().row_bytes(width) bytes each
+    const unsigned char* data() const;
+    unsigned char* data();
+    size_t data_size() const;
+
+    // stage timings of the decode that produced this image
+    const DecodeTimings& timings() const;
+    // counters and timings of the decode that produced this image
+    const DecodeStats& stats() const;
     
 private:
+    friend class Decoder;
+    friend class BatchDecoder;
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// --------------------------------------------------------
+// Reusable decoder
+//
+// Keeps the inflate state, Huffman tables and scratch buffers between decodes. 
+// Buffers only grow, so once they fit the largest image seen, decoding into 
+// the same PNGImage performs no heap allocations. A decoder may be used by one 
+// thread at a time.
+
+class Decoder {
+public:
+    explicit Decoder(const DecodeOptions& options = DecodeOptions());
+    ~Decoder();
+
+    // image content is unspecified when decoding fails
+    bool decode (const std::string& file_name, PNGImage& image);
+    // data must stay valid while decode() runs
+    bool decode (const unsigned char* data, size_t size, PNGImage& image);
+
+    // decodes the width x height pixels at x, y, which have to be inside the image, into an image of that size;
+    // the data is inflated only up to the last row of the region and the rest of the file is not read, so 
+    // neither the checksum of the image data nor the chunks after it are verified
+    bool decode_region (const std::string& file_name, size_t x, size_t y, size_t width, size_t height, PNGImage& image);
+    bool decode_region (const unsigned char* data, size_t size, size_t x, size_t y, size_t width, size_t height, 
+                        PNGImage& image);
+
+    // number of times decoder or image buffers had to grow during decode() calls
+    size_t allocations() const;
+
+private:
+    friend class BatchDecoder;
+
+    Decoder(const Decoder&);
+    Decoder& operator= (const Decoder&);
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// --------------------------------------------------------
+// Row by row decoding
+//
+// Inflates image data on demand and keeps only the deflate window and two
+// scanlines, so memory use does not depend on the image height. Rows of
+// interlaced images are returned pass by pass.
+
+class RowReader {
+public:
+    RowReader();
+    ~RowReader();
+
+    bool open (const std::string& file_name, const DecodeOptions& options = DecodeOptions());
+    // data must stay valid until the reader is closed
+    bool open (const unsigned char* data, size_t size, const DecodeOptions& options = DecodeOptions());
+    void close ();
+
+    const Header& header() const;
+
+    // returns next reconstructed scanline without filter byte, nullptr after the last row or on error;
+    // the image data checksum is verified before the last row is returned. Once the last row was 
+    // returned, further calls return nullptr and the accessors below keep describing that row
+    const unsigned char* next_row();
+
+    size_t row_bytes() const;   // size of the last returned row
+    size_t row_width() const;   // pixels in the last returned row
+    size_t pass() const;        // Adam7 pass (1 to 7) of the last returned row, 0 for non-interlaced images
+    size_t y() const;           // image row of the last returned row
+
+private:
+    RowReader(const RowReader&);
+    RowReader& operator= (const RowReader&);
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// --------------------------------------------------------
+// Metadata
+//
+// Opening walks the chunk headers once and records where every chunk is,
+// without reading chunk data or inflating the image. Ancillary chunks are
+// parsed, checksummed and inflated only when their accessor is called, so
+// reading one field costs the chunk walk and that chunk.
+
+enum class ChunkCrc : byte_t
+{
+    Unchecked,   // not verified yet, or checksums are disabled
+    Valid,
+    Invalid
+};
+
+struct ChunkInfo {
+    uint_t type;       // four type letters as a big-endian number, 0x74455874 for tEXt
+    size_t offset;     // of the chunk data in the file
+    uint_t length;     // of the chunk data
+    ChunkCrc crc;
+
+    std::string name() const
+    {
+        return std::string{ char(type >> 24), char(type >> 16), char(type >> 8), char(type) };
+    }
+};
+
+// tEXt, zTXt and iTXt chunks; Latin-1 strings are converted to UTF-8
+struct TextEntry {
+    std::string keyword;
+    std::string text;
+    std::string language;             // iTXt only
+    std::string translated_keyword;   // iTXt only
+};
+
+// pHYs
+struct PhysicalSize {
+    uint_t x;      // pixels per unit
+    uint_t y;
+    bool metre;    // the unit is the metre, otherwise only the aspect ratio is known
+
+    PhysicalSize() : x(0), y(0), metre(false)
+    {}
+};
+
+// tIME, last modification in UTC
+struct Timestamp {
+    ushort_t year;
+    byte_t month;    // 1-12
+    byte_t day;      // 1-31
+    byte_t hour;     // 0-23
+    byte_t minute;   // 0-59
+    byte_t second;   // 0-60 for leap seconds
+
+    Timestamp() : year(0), month(0), day(0), hour(0), minute(0), second(0)
+    {}
+};
+
+class MetadataReader {
+public:
+    MetadataReader();
+    ~MetadataReader();
+
+    // only DecodeOptions::verify_checksums applies, it covers chunk CRCs and compressed text
+    bool open (const std::string& file_name, const DecodeOptions& options = DecodeOptions());
+    // data must stay valid until the reader is closed
+    bool open (const unsigned char* data, size_t size, const DecodeOptions& options = DecodeOptions());
+    void close ();
+
+    const Header& header() const;
+    // every chunk up to IEND in file order, CRC states are updated as chunks are parsed
+    const std::vector<ChunkInfo>& chunks() const;
+
+    // the accessors return false when the chunk is missing or damaged
+
+    // all text chunks in file order, damaged ones are skipped
+    bool text(std::vector<TextEntry>& entries);
+    // first intact text chunk with keyword, only that chunk is inflated
+    bool find_text(const std::string& keyword, TextEntry& entry);
+    bool icc_profile(std::string& name, std::vector<unsigned char>& profile);
+    bool physical_size(PhysicalSize& size);
+    bool time(Timestamp& time);
+    // gAMA, image gamma times 100000
+    bool gamma(uint_t& gamma);
+
+private:
+    MetadataReader(const MetadataReader&);
+    MetadataReader& operator= (const MetadataReader&);
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// --------------------------------------------------------
+// Batch decoding
+//
+// Images are decoded on a work-stealing thread pool, every worker thread 
+// reuses its own Decoder. Results are delivered through a callback on the 
+// worker thread or through futures.
+
+// image to decode: a file or a caller-owned buffer that stays valid until its result is delivered
+struct Source {
+    std::string file_name;
+    const unsigned char* data;
+    size_t size;
+
+    Source(const std::string& file) : file_name(file), data(nullptr), size(0)
+    {}
+
+    Source(const char* file) : file_name(file), data(nullptr), size(0)
+    {}
+
+    Source(const unsigned char* d, size_t s) : file_name(), data(d), size(s)
+    {}
+};
+
+struct BatchOptions {
+    DecodeOptions decode;
+    size_t threads;              // worker threads, 0 for one per hardware thread
+    // limit on image data held by running decodes and by images passed to callbacks, 0 for none;
+    // a single larger image is still decoded when nothing else is in flight
+    size_t max_inflight_bytes;
+
+    BatchOptions() : decode(), threads(0), max_inflight_bytes(0)
+    {}
+};
+
+struct BatchResult {
+    bool ok;
+    PNGImage image;
+
+    BatchResult() : ok(false), image()
+    {}
+};
+
+// called on a worker thread with the position of the source in the batch; the image belongs 
+// to the worker and is reused once the callback returns, it may be moved or swapped out
+typedef std::function<void (size_t index, bool ok, PNGImage& image)> batch_callback_t;
+
+class BatchDecoder {
+public:
+    explicit BatchDecoder(const BatchOptions& options = BatchOptions());
+    ~BatchDecoder();   // waits for the queued decodes
+
+    // queues a decode that reports to callback, which must not throw
+    void decode (const Source& source, size_t index, const batch_callback_t& callback);
+    // queues a decode, the future becomes ready when it completes
+    std::future<BatchResult> decode (const Source& source);
+
+    // blocks until all queued decodes completed
+    void wait();
+
+    size_t threads() const;
+
+private:
+    BatchDecoder(const BatchDecoder&);
+    BatchDecoder& operator= (const BatchDecoder&);
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// decodes all sources, returns once every callback has run
+void decode_batch(const std::vector<Source>& sources, const BatchOptions& options, const batch_callback_t& callback);
+
+// decodes all sources, results are in source order
+std::vector<BatchResult> decode_batch(const std::vector<Source>& sources, const BatchOptions& options = BatchOptions());
+
+// --------------------------------------------------------
+// File loading
+//
+// Reads whole files with a fixed number of reads in flight, through io_uring 
+// on Linux when the kernel allows it, otherwise with pread on I/O threads. 
+// Files are handed out as their reads complete, not in request order.
+
+enum class IoBackend
+{
+    Auto,      // io_uring when available, pread otherwise
+    IoUring,
+    Pread
+};
+
+struct LoadOptions {
+    IoBackend backend;
+    size_t queue_depth;          // reads in flight
+    size_t io_threads;           // threads of the pread backend
+    // file data decode_files() passed to decoders and that is not decoded yet, 0 for no limit;
+    // reading stops while it is exceeded
+    size_t max_buffered_bytes;
+
+    LoadOptions() : backend(IoBackend::Auto), queue_depth(32), io_threads(4), max_buffered_bytes(size_t(256) << 20)
+    {}
+};
+
+// called on the thread that runs load() as files complete; data may be swapped out and kept
+typedef std::function<void (size_t index, bool ok, std::vector<unsigned char>& data)> load_callback_t;
+
+class FileLoader {
+public:
+    explicit FileLoader(const LoadOptions& options = LoadOptions());
+    ~FileLoader();
+
+    // reads the files and returns once every callback ran, false when no backend is available
+    bool load (const std::vector<std::string>& files, const load_callback_t& callback);
+
+    // IoUring or Pread, Auto when the requested backend is not available
+    IoBackend backend() const;
+
+private:
+    FileLoader(const FileLoader&);
+    FileLoader& operator= (const FileLoader&);
+
+    struct Impl;
+    std::unique_ptr<Impl> pImpl;
+};
+
+// reads the files with a FileLoader and decodes each one on a BatchDecoder worker as soon as it
+// is read; returns once every callback ran, false when no backend is available. Files that
+// can't be read are reported with an empty image from the calling thread
+bool decode_files(const std::vector<std::string>& files, const BatchOptions& options, const LoadOptions& load, 
+                  const batch_callback_t& callback);
+
+// --------------------------------------------------------
+// Header probing
+//
+// Reads the signature and the IHDR chunk only, with a single read of their
+// 33 bytes. Nothing is mapped or inflated, so the cost is the file open.
+
+// false when the file can't be read or does not start with a valid header
+bool probe (const std::string& file_name, Header& head);
+bool probe (const unsigned char* data, size_t size, Header& head);
+
+// --------------------------------------------------------
+// Image index
+//
+// Headers, sizes and modification times of the files under a directory,
+// kept in a compact file between runs. An update walks the tree and probes
+// files in parallel; files whose size and modification time match their
+// entry are not opened again.
+
+struct IndexEntry {
+    std::string path;     // relative to the indexed directory, '/' separated
+    uint64_t file_size;
+    int64_t mtime;        // modification time in nanoseconds since the epoch
+    bool ok;              // the file starts with a valid PNG header
+    Header header;
+
+    IndexEntry() : path(), file_size(0), mtime(0), ok(false), header()
+    {}
+};
+
+struct IndexOptions {
+    size_t threads;          // probing threads, 0 for one per hardware thread
+    // only file names ending with it are indexed, compared case-insensitively; empty for every file
+    std::string extension;
+
+    IndexOptions() : threads(0), extension(".png")
+    {}
+};
+
+class ImageIndex {
+public:
+    ImageIndex();
+    ~ImageIndex();
+
+    // a missing index file leaves the index empty and is not an error
+    bool load (const std::string& index_file);
+    // writes a temporary file next to index_file and renames it over index_file
+    bool save (const std::string& index_file) const;
+
+    // rescans directory: new and changed files are probed, entries of files that are gone are dropped;
+    // symbolic links to directories are not followed
+    bool update (const std::string& directory, const IndexOptions& options = IndexOptions());
+
+    // sorted by path
+    const std::vector<IndexEntry>& entries() const;
+    // nullptr when path is not in the index
+    const IndexEntry* find(const std::string& path) const;
+
+    // files opened by the last update, the other entries were reused
+    size_t probed() const;
+
+private:
+    ImageIndex(const ImageIndex&);
+    ImageIndex& operator= (const ImageIndex&);
+
     struct Impl;
     std::unique_ptr<Impl> pImpl;
 };
@@ -37,4 +632,4 @@ struct NotImplemented : std::exception {
 
 } // namespace png
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,1335 @@
+// Decoding benchmark over a synthetic PNG corpus
+//
+// The corpus covers every colour type / bit depth combination the decoder
+// accepts, with and without interlacing, in several sizes and content
+// profiles. Generation is deterministic for a given seed, so runs on
+// different builds decode the same bytes.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <functional>
+#include <queue>
+
+#include "PNGImage.h"
+
+using png::byte_t;
+using png::uint_t;
+
+namespace {
+
+// --------------------------------------------------------
+// Random numbers
+//
+// splitmix64, the standard distributions are not portable across libraries
+
+uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed)
+    {}
+
+    uint64_t next() { return mix64(state++); }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t state;
+};
+
+// --------------------------------------------------------
+// Checksums
+
+uint_t crc32(const byte_t* data, size_t size, uint_t crc = 0)
+{
+    static uint_t table[256];
+    if (table[1] == 0)
+    {
+        for (uint_t n = 0; n < 256; ++n)
+        {
+            uint_t c = n;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint_t adler32(const byte_t* data, size_t size)
+{
+    uint_t s1 = 1, s2 = 0;
+    while (size > 0)
+    {
+        size_t n = std::min<size_t>(size, 5552);
+        size -= n;
+        for (; n > 0; --n) { s1 += *data++; s2 += s1; }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+// --------------------------------------------------------
+// Deflate encoder
+//
+// Greedy LZ77 over hash chains. Like zlib, every block of up to 16384 symbols
+// is written with dynamic or fixed Huffman codes or stored, whichever comes
+// out smallest, so the corpus has all three block types: noise is mostly
+// stored, small images take the fixed code and the rest dynamic codes.
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<byte_t>& output) : out(output), buf(0), bits(0)
+    {}
+
+    void put(uint_t value, size_t count)
+    {
+        buf |= static_cast<uint64_t>(value) << bits;
+        bits += count;
+        for (; bits >= 8; bits -= 8, buf >>= 8) out.push_back(static_cast<byte_t>(buf));
+    }
+
+    // Huffman codes are packed starting from the most significant bit
+    void put_code(uint_t code, size_t length)
+    {
+        uint_t reversed = 0;
+        for (size_t i = 0; i < length; ++i) reversed |= ((code >> i) & 1) << (length - 1 - i);
+        put(reversed, length);
+    }
+
+    void flush() { if (bits > 0) put(0, 8 - bits); }
+
+private:
+    std::vector<byte_t>& out;
+    uint64_t buf;
+    size_t bits;
+};
+
+const uint_t length_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint_t length_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint_t dist_base[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint_t dist_extra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// order in which the code length code lengths are written
+const byte_t clen_order[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+const size_t LIT_CODES  = 286;
+const size_t DIST_CODES = 30;
+const size_t CLEN_CODES = 19;
+const uint_t END_OF_BLOCK = 256;
+
+size_t length_code(size_t length)
+{
+    size_t l = 28;
+    while (length_base[l] > length) --l;
+    return l;
+}
+
+size_t distance_code(size_t distance)
+{
+    size_t d = 29;
+    while (dist_base[d] > distance) --d;
+    return d;
+}
+
+// a literal when length is 0
+struct Token {
+    uint_t length;
+    uint_t value;   // literal byte or match distance
+};
+
+struct HuffmanCode {
+    std::vector<byte_t> lengths;
+    std::vector<uint_t> codes;
+
+    void put(BitWriter& bw, size_t symbol) const { bw.put_code(codes[symbol], lengths[symbol]); }
+};
+
+// canonical codes for lengths, RFC 1951 3.2.2
+HuffmanCode canonical_code(const std::vector<byte_t>& lengths)
+{
+    HuffmanCode code;
+    code.lengths = lengths;
+    code.codes.assign(lengths.size(), 0);
+
+    uint_t counts[16] = {}, next[16] = {};
+    for (byte_t length : lengths) ++counts[length];
+    counts[0] = 0;
+    for (size_t bits = 1; bits < 16; ++bits) next[bits] = (next[bits - 1] + counts[bits - 1]) << 1;
+    for (size_t i = 0; i < lengths.size(); ++i)
+        if (lengths[i]) code.codes[i] = next[lengths[i]]++;
+    return code;
+}
+
+// Huffman code lengths of at most limit bits; frequencies are halved until the 
+// tree fits. At least two symbols get a code, so the code is always complete
+std::vector<byte_t> huffman_lengths(std::vector<uint64_t> freqs, size_t limit)
+{
+    static const size_t NONE = SIZE_MAX;
+    typedef std::pair<uint64_t, size_t> Node;   // weight, node index
+
+    const size_t n = freqs.size();
+    size_t used = std::count_if(freqs.begin(), freqs.end(), [](uint64_t f) { return f > 0; });
+    for (size_t i = 0; used < 2; ++i)
+        if (freqs[i] == 0) { freqs[i] = 1; ++used; }
+
+    std::vector<byte_t> lengths(n, 0);
+    for (;;)
+    {
+        // leaves are nodes 0 to n - 1, every inner node gets a higher index than its children
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        for (size_t i = 0; i < n; ++i)
+            if (freqs[i]) queue.push(Node(freqs[i], i));
+
+        std::vector<size_t> parent(2 * n, NONE);
+        size_t next = n;
+        while (queue.size() > 1)
+        {
+            const Node a = queue.top(); queue.pop();
+            const Node b = queue.top(); queue.pop();
+            parent[a.second] = parent[b.second] = next;
+            queue.push(Node(a.first + b.first, next++));
+        }
+
+        std::vector<size_t> depth(next, 0);
+        size_t max_depth = 0;
+        for (size_t i = next - 1; i-- > 0;)
+        {
+            if (parent[i] == NONE) continue;
+            depth[i] = depth[parent[i]] + 1;
+            if (i < n) max_depth = std::max(max_depth, depth[i]);
+        }
+
+        if (max_depth <= limit)
+        {
+            for (size_t i = 0; i < n; ++i) lengths[i] = static_cast<byte_t>(freqs[i] ? depth[i] : 0);
+            return lengths;
+        }
+        for (uint64_t& f : freqs) if (f) f = (f + 1) / 2;
+    }
+}
+
+HuffmanCode fixed_lit_code()
+{
+    std::vector<byte_t> lengths(288);
+    for (size_t i = 0; i < 288; ++i) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    return canonical_code(lengths);
+}
+
+HuffmanCode fixed_dist_code()
+{
+    return canonical_code(std::vector<byte_t>(DIST_CODES, 5));
+}
+
+// code length symbol with the value of its extra bits
+struct ClenSymbol {
+    uint_t symbol;
+    uint_t extra;
+};
+
+// run-length codes the literal/length and distance code lengths as one sequence
+std::vector<ClenSymbol> encode_lengths(const std::vector<byte_t>& lengths)
+{
+    std::vector<ClenSymbol> symbols;
+    for (size_t i = 0; i < lengths.size();)
+    {
+        const byte_t value = lengths[i];
+        size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == value) ++run;
+        i += run;
+
+        if (value == 0)
+        {
+            for (; run >= 11; run -= std::min<size_t>(run, 138))
+                symbols.push_back(ClenSymbol{ 18, static_cast<uint_t>(std::min<size_t>(run, 138) - 11) });
+            if (run >= 3)
+            {
+                symbols.push_back(ClenSymbol{ 17, static_cast<uint_t>(run - 3) });
+                run = 0;
+            }
+        }
+        else
+        {
+            symbols.push_back(ClenSymbol{ value, 0 });
+            for (--run; run >= 3; run -= std::min<size_t>(run, 6))
+                symbols.push_back(ClenSymbol{ 16, static_cast<uint_t>(std::min<size_t>(run, 6) - 3) });
+        }
+        for (; run > 0; --run) symbols.push_back(ClenSymbol{ value, 0 });
+    }
+    return symbols;
+}
+
+// bits of the block symbols under a code, extra bits included
+uint64_t symbol_bits(const std::vector<uint64_t>& lit_freqs, const std::vector<uint64_t>& dist_freqs,
+                     const HuffmanCode& lit, const HuffmanCode& dist)
+{
+    uint64_t bits = 0;
+    for (size_t i = 0; i < LIT_CODES; ++i)
+        bits += lit_freqs[i] * (lit.lengths[i] + (i > END_OF_BLOCK ? length_extra[i - 257] : 0));
+    for (size_t i = 0; i < DIST_CODES; ++i)
+        bits += dist_freqs[i] * (dist.lengths[i] + dist_extra[i]);
+    return bits;
+}
+
+void put_tokens(BitWriter& bw, const Token* tokens, size_t count, const HuffmanCode& lit, const HuffmanCode& dist)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Token& t = tokens[i];
+        if (t.length == 0)
+        {
+            lit.put(bw, t.value);
+            continue;
+        }
+        const size_t l = length_code(t.length);
+        lit.put(bw, 257 + l);
+        bw.put(static_cast<uint_t>(t.length - length_base[l]), length_extra[l]);
+
+        const size_t d = distance_code(t.value);
+        dist.put(bw, d);
+        bw.put(static_cast<uint_t>(t.value - dist_base[d]), dist_extra[d]);
+    }
+    lit.put(bw, END_OF_BLOCK);
+}
+
+// writes the tokens covering data[begin, end) as the smallest of the three block types
+void put_block(BitWriter& bw, std::vector<byte_t>& out, const Token* tokens, size_t count,
+               const std::vector<byte_t>& data, size_t begin, size_t end, bool last)
+{
+    static const HuffmanCode fixed_lit = fixed_lit_code();
+    static const HuffmanCode fixed_dist = fixed_dist_code();
+    static const size_t MAX_STORED = 65535;
+
+    std::vector<uint64_t> lit_freqs(LIT_CODES, 0), dist_freqs(DIST_CODES, 0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (tokens[i].length == 0) { ++lit_freqs[tokens[i].value]; continue; }
+        ++lit_freqs[257 + length_code(tokens[i].length)];
+        ++dist_freqs[distance_code(tokens[i].value)];
+    }
+    ++lit_freqs[END_OF_BLOCK];
+
+    const HuffmanCode lit = canonical_code(huffman_lengths(lit_freqs, 15));
+    const HuffmanCode dist = canonical_code(huffman_lengths(dist_freqs, 15));
+
+    size_t hlit = LIT_CODES, hdist = DIST_CODES;
+    while (hlit > 257 && lit.lengths[hlit - 1] == 0) --hlit;
+    while (hdist > 1 && dist.lengths[hdist - 1] == 0) --hdist;
+
+    std::vector<byte_t> lengths(lit.lengths.begin(), lit.lengths.begin() + hlit);
+    lengths.insert(lengths.end(), dist.lengths.begin(), dist.lengths.begin() + hdist);
+    const std::vector<ClenSymbol> clen_symbols = encode_lengths(lengths);
+
+    std::vector<uint64_t> clen_freqs(CLEN_CODES, 0);
+    for (const ClenSymbol& s : clen_symbols) ++clen_freqs[s.symbol];
+    const HuffmanCode clen = canonical_code(huffman_lengths(clen_freqs, 7));
+
+    size_t hclen = CLEN_CODES;
+    while (hclen > 4 && clen.lengths[clen_order[hclen - 1]] == 0) --hclen;
+
+    static const uint_t clen_extra[] = { 2, 3, 7 };   // of symbols 16, 17 and 18
+    uint64_t dynamic_bits = 3 + 14 + 3 * hclen + symbol_bits(lit_freqs, dist_freqs, lit, dist);
+    for (const ClenSymbol& s : clen_symbols) dynamic_bits += clen.lengths[s.symbol] + (s.symbol >= 16 ? clen_extra[s.symbol - 16] : 0);
+    const uint64_t fixed_bits = 3 + symbol_bits(lit_freqs, dist_freqs, fixed_lit, fixed_dist);
+    const uint64_t stored_bits = 8 * (end - begin) + 40 * ((end - begin) / MAX_STORED + 1);
+
+    if (stored_bits <= fixed_bits && stored_bits <= dynamic_bits)
+    {
+        // blocks of at most 65535 bytes, LEN and NLEN follow the header at a byte boundary
+        size_t pos = begin;
+        do
+        {
+            const size_t size = std::min(MAX_STORED, end - pos);
+            bw.put(last && pos + size == end ? 1 : 0, 1);
+            bw.put(0, 2);
+            bw.flush();
+            const uint_t len = static_cast<uint_t>(size), nlen = ~len & 0xFFFF;
+            out.push_back(static_cast<byte_t>(len));
+            out.push_back(static_cast<byte_t>(len >> 8));
+            out.push_back(static_cast<byte_t>(nlen));
+            out.push_back(static_cast<byte_t>(nlen >> 8));
+            out.insert(out.end(), data.begin() + pos, data.begin() + pos + size);
+            pos += size;
+        } while (pos < end);
+    }
+    else if (fixed_bits <= dynamic_bits)
+    {
+        bw.put(last ? 1 : 0, 1);
+        bw.put(1, 2);
+        put_tokens(bw, tokens, count, fixed_lit, fixed_dist);
+    }
+    else
+    {
+        bw.put(last ? 1 : 0, 1);
+        bw.put(2, 2);
+        bw.put(static_cast<uint_t>(hlit - 257), 5);
+        bw.put(static_cast<uint_t>(hdist - 1), 5);
+        bw.put(static_cast<uint_t>(hclen - 4), 4);
+        for (size_t i = 0; i < hclen; ++i) bw.put(clen.lengths[clen_order[i]], 3);
+        for (const ClenSymbol& s : clen_symbols)
+        {
+            clen.put(bw, s.symbol);
+            if (s.symbol >= 16) bw.put(s.extra, clen_extra[s.symbol - 16]);
+        }
+        put_tokens(bw, tokens, count, lit, dist);
+    }
+}
+
+std::vector<byte_t> zlib_compress(const std::vector<byte_t>& data)
+{
+    static const size_t WINDOW = 32768;
+    static const size_t HASH_BITS = 15;
+    static const size_t MAX_CHAIN = 32;
+    static const size_t MIN_MATCH = 3;
+    static const size_t MAX_MATCH = 258;
+    static const size_t BLOCK_TOKENS = 16384;
+    static const size_t NONE = SIZE_MAX;
+
+    std::vector<byte_t> out;
+    out.push_back(0x78);
+    out.push_back(0x01);
+
+    std::vector<size_t> head(size_t(1) << HASH_BITS, NONE);
+    std::vector<size_t> prev(WINDOW, NONE);
+    std::vector<Token> tokens;
+    const size_t size = data.size();
+
+    auto hash = [&](size_t i) {
+        return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((size_t(1) << HASH_BITS) - 1);
+    };
+    auto insert = [&](size_t i) {
+        if (i + MIN_MATCH > size) return;
+        size_t h = hash(i);
+        prev[i % WINDOW] = head[h];
+        head[h] = i;
+    };
+
+    for (size_t i = 0; i < size;)
+    {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+
+        if (i + MIN_MATCH <= size)
+        {
+            const size_t limit = std::min(MAX_MATCH, size - i);
+            size_t candidate = head[hash(i)];
+            for (size_t chain = 0; chain < MAX_CHAIN && candidate != NONE && i - candidate <= WINDOW; ++chain)
+            {
+                size_t length = 0;
+                while (length < limit && data[candidate + length] == data[i + length]) ++length;
+                if (length > best_length)
+                {
+                    best_length = length;
+                    best_distance = i - candidate;
+                    if (length == limit) break;
+                }
+                size_t next = prev[candidate % WINDOW];
+                if (next == NONE || next >= candidate) break;
+                candidate = next;
+            }
+        }
+
+        if (best_length >= MIN_MATCH)
+        {
+            tokens.push_back(Token{ static_cast<uint_t>(best_length), static_cast<uint_t>(best_distance) });
+            for (size_t end = i + best_length; i < end; ++i) insert(i);
+        }
+        else
+        {
+            tokens.push_back(Token{ 0, data[i] });
+            insert(i);
+            ++i;
+        }
+    }
+
+    BitWriter bw(out);
+    size_t begin = 0;
+    size_t first = 0;
+    do
+    {
+        const size_t count = std::min(BLOCK_TOKENS, tokens.size() - first);
+        size_t end = begin;
+        for (size_t t = first; t < first + count; ++t) end += tokens[t].length ? tokens[t].length : 1;
+
+        put_block(bw, out, tokens.data() + first, count, data, begin, end, first + count == tokens.size());
+        first += count;
+        begin = end;
+    } while (first < tokens.size());
+    bw.flush();
+
+    uint_t adler = adler32(data.data(), data.size());
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<byte_t>(adler >> shift));
+    return out;
+}
+
+// --------------------------------------------------------
+// Image synthesis
+
+enum Profile { PROFILE_NOISE, PROFILE_GRADIENT, PROFILE_PHOTO, PROFILE_COUNT };
+
+const char* const profile_names[] = { "noise", "gradient", "photo" };
+
+// names of png::PixelFormat values in declaration order
+const char* const pixel_format_names[] = { "native", "rgba8", "rgb8", "grey8", "rgba16" };
+const size_t PIXEL_FORMAT_COUNT = sizeof(pixel_format_names) / sizeof(pixel_format_names[0]);
+
+struct Format {
+    const char* name;
+    byte_t colour_type;
+    byte_t bit_depth;
+    size_t channels;
+};
+
+const Format formats[] = {
+    { "gray1",   0, 1,  1 }, { "gray2",   0, 2,  1 }, { "gray4",   0, 4,  1 },
+    { "gray8",   0, 8,  1 }, { "gray16",  0, 16, 1 },
+    { "rgb8",    2, 8,  3 }, { "rgb16",   2, 16, 3 },
+    { "index1",  3, 1,  1 }, { "index2",  3, 2,  1 }, { "index4",  3, 4,  1 }, { "index8",  3, 8,  1 },
+    { "graya8",  4, 8,  2 }, { "graya16", 4, 16, 2 },
+    { "rgba8",   6, 8,  4 }, { "rgba16",  6, 16, 4 },
+};
+
+// smoothly interpolated lattice noise in [0, 1)
+double value_noise(uint64_t seed, double x, double y)
+{
+    const double fx = std::floor(x), fy = std::floor(y);
+    const int64_t ix = static_cast<int64_t>(fx), iy = static_cast<int64_t>(fy);
+    double tx = x - fx, ty = y - fy;
+    tx = tx * tx * (3 - 2 * tx);
+    ty = ty * ty * (3 - 2 * ty);
+
+    auto lattice = [&](int64_t lx, int64_t ly) {
+        return (mix64(seed ^ mix64(static_cast<uint64_t>(lx) * 0x100000001B3ull ^ static_cast<uint64_t>(ly))) >> 11)
+               * (1.0 / 9007199254740992.0);
+    };
+    const double top    = lattice(ix, iy)     + (lattice(ix + 1, iy)     - lattice(ix, iy))     * tx;
+    const double bottom = lattice(ix, iy + 1) + (lattice(ix + 1, iy + 1) - lattice(ix, iy + 1)) * tx;
+    return top + (bottom - top) * ty;
+}
+
+// returns samples in row order, each in [0, 2^bit_depth)
+std::vector<uint_t> make_samples(const Format& format, Profile profile, size_t width, size_t height, uint64_t seed)
+{
+    const uint_t max_value = (1u << format.bit_depth) - 1;
+    std::vector<uint_t> samples(width * height * format.channels);
+    Random random(seed);
+
+    size_t i = 0;
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            for (size_t c = 0; c < format.channels; ++c, ++i)
+            {
+                double v = 0;
+                switch (profile)
+                {
+                    case PROFILE_NOISE :
+                        v = random.uniform();
+                        break;
+                    case PROFILE_GRADIENT :
+                        v = (static_cast<double>(x) / width + static_cast<double>(y) / height + c * 0.25) / 2.75;
+                        break;
+                    default :
+                    {
+                        const uint64_t channel_seed = seed + c * 7919;
+                        v = 0.60 * value_noise(channel_seed,     x / 96.0, y / 96.0) +
+                            0.28 * value_noise(channel_seed + 1, x / 17.0, y / 17.0) +
+                            0.09 * value_noise(channel_seed + 2, x / 3.0,  y / 3.0) +
+                            0.03 * random.uniform();
+                    }
+                }
+                samples[i] = std::min(max_value, static_cast<uint_t>(v * (max_value + 1)));
+            }
+        }
+    }
+    return samples;
+}
+
+// --------------------------------------------------------
+// PNG writer
+
+struct Adam7Pass { size_t x0, y0, dx, dy; };
+
+const Adam7Pass adam7[] = {
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+};
+
+byte_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return static_cast<byte_t>(a);
+    return static_cast<byte_t>(pb <= pc ? b : c);
+}
+
+// filters row with the type giving the smallest sum of absolute differences, the usual encoder heuristic
+void filter_row(const byte_t* row, const byte_t* prev, size_t size, size_t bpp, std::vector<byte_t>& out)
+{
+    std::vector<byte_t> best, candidate(size + 1);
+    uint64_t best_cost = UINT64_MAX;
+
+    for (byte_t type = 0; type < 5; ++type)
+    {
+        candidate[0] = type;
+        uint64_t cost = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            const int a = i >= bpp ? row[i - bpp] : 0;
+            const int b = prev[i];
+            const int c = i >= bpp ? prev[i - bpp] : 0;
+            int predictor = 0;
+            switch (type)
+            {
+                case 1 : predictor = a; break;
+                case 2 : predictor = b; break;
+                case 3 : predictor = (a + b) / 2; break;
+                case 4 : predictor = paeth(a, b, c); break;
+            }
+            const byte_t value = static_cast<byte_t>(row[i] - predictor);
+            candidate[i + 1] = value;
+            cost += value < 128 ? value : 256 - value;
+        }
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = candidate;
+        }
+    }
+    out.insert(out.end(), best.begin(), best.end());
+}
+
+// packs samples of one row, sub-byte samples start at the most significant bits
+void pack_row(const uint_t* samples, size_t count, size_t bit_depth, byte_t* out)
+{
+    if (bit_depth == 16)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[2 * i]     = static_cast<byte_t>(samples[i] >> 8);
+            out[2 * i + 1] = static_cast<byte_t>(samples[i]);
+        }
+        return;
+    }
+
+    std::memset(out, 0, (count * bit_depth + 7) / 8);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t bit = i * bit_depth;
+        out[bit / 8] |= static_cast<byte_t>(samples[i] << (8 - bit_depth - bit % 8));
+    }
+}
+
+// appends filtered scanlines of a (sub)image with the given sample grid
+void add_scanlines(const std::vector<uint_t>& samples, const Format& format, size_t width,
+                   size_t x0, size_t y0, size_t dx, size_t dy, size_t height, std::vector<byte_t>& out)
+{
+    const size_t pass_width  = x0 < width  ? (width  - x0 + dx - 1) / dx : 0;
+    const size_t pass_height = y0 < height ? (height - y0 + dy - 1) / dy : 0;
+    if (pass_width == 0 || pass_height == 0) return;
+
+    const size_t bits_per_pixel = format.channels * format.bit_depth;
+    const size_t row_bytes = (pass_width * bits_per_pixel + 7) / 8;
+    const size_t bpp = std::max<size_t>(1, bits_per_pixel / 8);
+
+    std::vector<uint_t> row_samples(pass_width * format.channels);
+    std::vector<byte_t> row(row_bytes), prev(row_bytes, 0);
+
+    for (size_t py = 0; py < pass_height; ++py)
+    {
+        const size_t y = y0 + py * dy;
+        for (size_t px = 0; px < pass_width; ++px)
+        {
+            const size_t x = x0 + px * dx;
+            for (size_t c = 0; c < format.channels; ++c)
+                row_samples[px * format.channels + c] = samples[(y * width + x) * format.channels + c];
+        }
+        pack_row(row_samples.data(), row_samples.size(), format.bit_depth, row.data());
+        filter_row(row.data(), prev.data(), row_bytes, bpp, out);
+        prev.swap(row);
+    }
+}
+
+void put_uint(std::vector<byte_t>& out, uint_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<byte_t>(value >> shift));
+}
+
+void put_chunk(std::vector<byte_t>& out, const char* type, const byte_t* data, size_t size)
+{
+    put_uint(out, static_cast<uint_t>(size));
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_uint(out, crc32(out.data() + start, out.size() - start));
+}
+
+std::vector<byte_t> encode_png(const std::vector<uint_t>& samples, const Format& format,
+                               size_t width, size_t height, bool interlace)
+{
+    static const byte_t signature[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+    static const size_t IDAT_SIZE = 8192;   // libpng's default chunk size
+
+    std::vector<byte_t> png(signature, signature + sizeof(signature));
+
+    std::vector<byte_t> ihdr;
+    put_uint(ihdr, static_cast<uint_t>(width));
+    put_uint(ihdr, static_cast<uint_t>(height));
+    ihdr.push_back(format.bit_depth);
+    ihdr.push_back(format.colour_type);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(interlace ? 1 : 0);
+    put_chunk(png, "IHDR", ihdr.data(), ihdr.size());
+
+    if (format.colour_type == 3)
+    {
+        std::vector<byte_t> palette;
+        const size_t entries = size_t(1) << format.bit_depth;
+        for (size_t i = 0; i < entries; ++i)
+        {
+            palette.push_back(static_cast<byte_t>(i * 255 / (entries - 1)));
+            palette.push_back(static_cast<byte_t>(255 - i * 255 / (entries - 1)));
+            palette.push_back(static_cast<byte_t>(i * 97));
+        }
+        put_chunk(png, "PLTE", palette.data(), palette.size());
+    }
+
+    std::vector<byte_t> filtered;
+    if (interlace)
+    {
+        for (const Adam7Pass& pass : adam7)
+            add_scanlines(samples, format, width, pass.x0, pass.y0, pass.dx, pass.dy, height, filtered);
+    }
+    else
+    {
+        add_scanlines(samples, format, width, 0, 0, 1, 1, height, filtered);
+    }
+
+    const std::vector<byte_t> compressed = zlib_compress(filtered);
+    for (size_t pos = 0; pos < compressed.size(); pos += IDAT_SIZE)
+        put_chunk(png, "IDAT", compressed.data() + pos, std::min(IDAT_SIZE, compressed.size() - pos));
+
+    put_chunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+// --------------------------------------------------------
+// Benchmark
+
+struct Sample {
+    std::string name;
+    std::vector<byte_t> png;
+    size_t width;
+    size_t height;
+    size_t raw_bytes;   // unpacked image data without filter bytes
+};
+
+struct Options {
+    std::vector<size_t> sizes;
+    std::vector<Profile> profiles;
+    size_t iterations;
+    uint64_t seed;
+    std::string json_path;
+    std::string corpus_dir;
+    std::vector<size_t> batch_threads;
+    std::vector<std::string> files;
+    png::DecodeOptions decode;
+    std::string dir;
+    size_t queue_depth;
+
+    Options() : sizes(), profiles(), iterations(5), seed(1), json_path(), corpus_dir(), batch_threads(), files(), decode(),
+                dir(), queue_depth(32)
+    {}
+};
+
+struct Result {
+    const Sample* sample;
+    png::DecodeTimings timings;   // per stage medians
+    png::DecodeStats stats;       // counters of the last decode, the same for every one
+};
+
+struct BatchRun {
+    size_t threads;
+    uint64_t ns;                  // median wall time for the whole corpus
+};
+
+std::vector<Sample> generate_corpus(const Options& options)
+{
+    std::vector<Sample> corpus;
+    uint64_t seed = options.seed;
+
+    for (size_t size : options.sizes)
+    {
+        for (Profile profile : options.profiles)
+        {
+            for (const Format& format : formats)
+            {
+                const std::vector<uint_t> samples = make_samples(format, profile, size, size, mix64(seed++));
+                for (int interlace = 0; interlace < 2; ++interlace)
+                {
+                    Sample sample;
+                    std::ostringstream name;
+                    name << format.name << (interlace ? "_adam7_" : "_") << profile_names[profile] << "_" << size;
+                    sample.name = name.str();
+                    sample.png = encode_png(samples, format, size, size, interlace != 0);
+                    sample.width = size;
+                    sample.height = size;
+                    sample.raw_bytes = size * ((size * format.channels * format.bit_depth + 7) / 8);
+                    corpus.push_back(sample);
+                }
+            }
+        }
+    }
+    return corpus;
+}
+
+bool load_file(const std::string& path, Sample& sample)
+{
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) return false;
+    sample.png.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    sample.name = path;
+
+    png::RowReader reader;
+    if (!reader.open(sample.png.data(), sample.png.size())) return false;
+    const png::Header& head = reader.header();
+    sample.width = head.width;
+    sample.height = head.height;
+    sample.raw_bytes = head.height * head.row_bytes(head.width);
+    return true;
+}
+
+uint64_t median(std::vector<uint64_t> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+bool run_sample(const Sample& sample, size_t iterations, const png::DecodeOptions& decode, Result& result)
+{
+    std::vector<uint64_t> parse, crc, inflate, huffman, unfilter, convert, total;
+    png::Decoder decoder(decode);
+    png::PNGImage image;
+
+    // the first decode warms up caches and sizes the decoder buffers, it is not counted
+    for (size_t i = 0; i <= iterations; ++i)
+    {
+        if (!decoder.decode(sample.png.data(), sample.png.size(), image)) return false;
+        if (i == 0) continue;
+
+        const png::DecodeTimings& t = image.timings();
+        parse.push_back(t.parse);
+        crc.push_back(t.crc);
+        inflate.push_back(t.inflate);
+        huffman.push_back(t.huffman);
+        unfilter.push_back(t.unfilter);
+        convert.push_back(t.convert);
+        total.push_back(t.total);
+    }
+
+    result.sample = &sample;
+    result.stats = image.stats();
+    result.timings.parse    = median(parse);
+    result.timings.crc      = median(crc);
+    result.timings.inflate  = median(inflate);
+    result.timings.huffman  = median(huffman);
+    result.timings.unfilter = median(unfilter);
+    result.timings.convert  = median(convert);
+    result.timings.total    = median(total);
+    return true;
+}
+
+// decodes the whole corpus with png::BatchDecoder, the first round is not counted
+bool run_batch(const std::vector<Sample>& corpus, size_t threads, size_t iterations, const png::DecodeOptions& decode, 
+               BatchRun& run)
+{
+    png::BatchOptions options;
+    options.decode = decode;
+    options.threads = threads;
+    png::BatchDecoder decoder(options);
+
+    std::vector<png::Source> sources;
+    for (const Sample& sample : corpus) sources.push_back(png::Source(sample.png.data(), sample.png.size()));
+
+    std::vector<char> failed(corpus.size(), 0);
+    const png::batch_callback_t callback = [&failed](size_t index, bool ok, png::PNGImage&) {
+        failed[index] = !ok;
+    };
+
+    std::vector<uint64_t> total;
+    for (size_t i = 0; i <= iterations; ++i)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < sources.size(); ++n) decoder.decode(sources[n], n, callback);
+        decoder.wait();
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (std::find(failed.begin(), failed.end(), 1) != failed.end()) return false;
+        if (i > 0) total.push_back(ns);
+    }
+
+    run.threads = decoder.threads();
+    run.ns = median(total);
+    return true;
+}
+
+// --------------------------------------------------------
+// Directory throughput
+//
+// Every file of a directory is read and decoded end to end, by png::decode_files 
+// with each I/O backend and by png::BatchDecoder from mapped files. The first 
+// round is not counted, so the files are in the page cache for the timed ones.
+
+struct Directory {
+    std::vector<std::string> files;
+    size_t file_bytes;
+    size_t raw_bytes;
+};
+
+struct DirectoryRun {
+    std::string backend;
+    uint64_t ns;                  // median wall time for all files
+};
+
+bool list_directory(const std::string& dir, Directory& directory)
+{
+    png::ImageIndex index;
+    if (!index.update(dir)) return false;
+
+    directory.file_bytes = 0;
+    directory.raw_bytes = 0;
+    for (const png::IndexEntry& entry : index.entries())
+    {
+        if (!entry.ok) continue;
+        directory.files.push_back(dir + "/" + entry.path);
+        directory.file_bytes += entry.file_size;
+        directory.raw_bytes += entry.header.height * entry.header.row_bytes(entry.header.width);
+    }
+    return true;
+}
+
+// backend is "mapped" or the name of a png::IoBackend
+bool run_directory(const Directory& directory, const std::string& backend, const Options& options, DirectoryRun& run)
+{
+    png::BatchOptions batch;
+    batch.decode = options.decode;
+    batch.threads = options.batch_threads.empty() ? 0 : options.batch_threads[0];
+
+    png::LoadOptions load;
+    load.backend = backend == "io_uring" ? png::IoBackend::IoUring : png::IoBackend::Pread;
+    load.queue_depth = options.queue_depth;
+
+    std::vector<png::Source> sources(directory.files.begin(), directory.files.end());
+    std::vector<char> failed(directory.files.size(), 0);
+    const png::batch_callback_t callback = [&failed](size_t index, bool ok, png::PNGImage&) {
+        failed[index] = !ok;
+    };
+
+    std::vector<uint64_t> total;
+    for (size_t i = 0; i <= options.iterations; ++i)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (backend == "mapped") png::decode_batch(sources, batch, callback);
+        else if (!png::decode_files(directory.files, batch, load, callback)) return false;
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (std::find(failed.begin(), failed.end(), 1) != failed.end()) return false;
+        if (i > 0) total.push_back(ns);
+    }
+
+    run.backend = backend;
+    run.ns = median(total);
+    return true;
+}
+
+struct Stage {
+    const char* name;
+    uint64_t png::DecodeTimings::* field;
+};
+
+const Stage stages[] = {
+    { "parse",    &png::DecodeTimings::parse },
+    { "crc",      &png::DecodeTimings::crc },
+    { "inflate",  &png::DecodeTimings::inflate },
+    { "huffman",  &png::DecodeTimings::huffman },
+    { "unfilter", &png::DecodeTimings::unfilter },
+    { "convert",  &png::DecodeTimings::convert },
+    { "total",    &png::DecodeTimings::total },
+};
+
+// throughput in MB of decoded image data per second
+double mb_per_s(size_t bytes, uint64_t ns)
+{
+    return ns > 0 ? bytes * 1000.0 / ns : 0.0;
+}
+
+void print_text(const std::vector<Result>& results)
+{
+    std::cout << std::left << std::setw(28) << "image" << std::right << std::setw(10) << "MB/s";
+    for (const Stage& stage : stages) std::cout << std::setw(10) << stage.name;
+    std::cout << "   (ns/pixel)\n";
+
+    png::DecodeTimings sum;
+    size_t bytes = 0, pixels = 0;
+
+    for (const Result& r : results)
+    {
+        const size_t image_pixels = r.sample->width * r.sample->height;
+        std::cout << std::left << std::setw(28) << r.sample->name << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << mb_per_s(r.sample->raw_bytes, r.timings.total)
+                  << std::setprecision(3);
+        for (const Stage& stage : stages)
+        {
+            std::cout << std::setw(10) << static_cast<double>(r.timings.*stage.field) / image_pixels;
+            sum.*stage.field += r.timings.*stage.field;
+        }
+        std::cout << "\n";
+
+        bytes += r.sample->raw_bytes;
+        pixels += image_pixels;
+    }
+
+    std::cout << std::left << std::setw(28) << "all" << std::right << std::setprecision(1)
+              << std::setw(10) << mb_per_s(bytes, sum.total) << std::setprecision(3);
+    for (const Stage& stage : stages) std::cout << std::setw(10) << static_cast<double>(sum.*stage.field) / pixels;
+    std::cout << std::endl;
+}
+
+void print_batch(const std::vector<Sample>& corpus, const std::vector<BatchRun>& runs)
+{
+    size_t bytes = 0;
+    for (const Sample& sample : corpus) bytes += sample.raw_bytes;
+
+    std::cout << "\n" << std::left << std::setw(28) << "batch threads" << std::right << std::setw(10) << "MB/s"
+              << std::setw(10) << "ms" << std::setw(10) << "speedup" << "\n";
+    for (const BatchRun& run : runs)
+    {
+        std::cout << std::left << std::setw(28) << run.threads << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << mb_per_s(bytes, run.ns) << std::setw(10) << run.ns / 1e6
+                  << std::setprecision(2) << std::setw(10) << static_cast<double>(runs[0].ns) / run.ns << "\n";
+    }
+    std::cout << std::flush;
+}
+
+void print_directory(const Options& options, const Directory& directory, const std::vector<DirectoryRun>& runs)
+{
+    std::cout << options.dir << ": " << directory.files.size() << " files, " << std::fixed << std::setprecision(1) 
+              << directory.file_bytes / 1e6 << " MB read, " << directory.raw_bytes / 1e6 << " MB decoded\n\n"
+              << std::left << std::setw(28) << "backend" << std::right << std::setw(10) << "files/s" 
+              << std::setw(10) << "read MB/s" << std::setw(10) << "MB/s" << std::setw(10) << "ms" << "\n";
+    for (const DirectoryRun& run : runs)
+    {
+        std::cout << std::left << std::setw(28) << run.backend << std::right << std::setprecision(0)
+                  << std::setw(10) << directory.files.size() * 1e9 / run.ns << std::setprecision(1)
+                  << std::setw(10) << mb_per_s(directory.file_bytes, run.ns) << std::setw(10) << mb_per_s(directory.raw_bytes, run.ns)
+                  << std::setw(10) << run.ns / 1e6 << "\n";
+    }
+    std::cout << std::flush;
+}
+
+void write_directory_json(std::ostream& os, const Options& options, const Directory& directory, 
+                          const std::vector<DirectoryRun>& runs)
+{
+    os << "{\n  \"directory\": \"" << options.dir << "\",\n  \"iterations\": " << options.iterations 
+       << ",\n  \"format\": \"" << pixel_format_names[static_cast<size_t>(options.decode.format)] 
+       << "\",\n  \"queue_depth\": " << options.queue_depth << ",\n  \"files\": " << directory.files.size() 
+       << ",\n  \"file_bytes\": " << directory.file_bytes << ",\n  \"raw_bytes\": " << directory.raw_bytes 
+       << ",\n  \"runs\": [";
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        os << (i ? ",\n" : "\n") << "    {\"backend\": \"" << runs[i].backend << "\", \"ns\": " << runs[i].ns
+           << ", \"files_per_s\": " << std::setprecision(6) << directory.files.size() * 1e9 / runs[i].ns
+           << ", \"read_mb_per_s\": " << mb_per_s(directory.file_bytes, runs[i].ns)
+           << ", \"mb_per_s\": " << mb_per_s(directory.raw_bytes, runs[i].ns) << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+bool write_output(const Options& options, const std::function<void (std::ostream&)>& write)
+{
+    if (options.json_path == "-")
+    {
+        write(std::cout);
+    }
+    else if (!options.json_path.empty())
+    {
+        std::ofstream ofs(options.json_path);
+        write(ofs);
+        if (!ofs)
+        {
+            std::cerr << "Can't write " << options.json_path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int benchmark_directory(const Options& options)
+{
+    Directory directory;
+    if (!list_directory(options.dir, directory))
+    {
+        std::cerr << "Can't list " << options.dir << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> backends = { "mapped", "pread" };
+    png::LoadOptions uring;
+    uring.backend = png::IoBackend::IoUring;
+    if (png::FileLoader(uring).backend() == png::IoBackend::IoUring) backends.insert(backends.begin() + 1, "io_uring");
+    else std::cerr << "io_uring is not available" << std::endl;
+
+    std::vector<DirectoryRun> runs;
+    for (const std::string& backend : backends)
+    {
+        DirectoryRun run;
+        if (!run_directory(directory, backend, options, run))
+        {
+            std::cerr << "Decoding failed with " << backend << std::endl;
+            return 1;
+        }
+        runs.push_back(run);
+    }
+
+    if (options.json_path != "-") print_directory(options, directory, runs);
+    return write_output(options, [&](std::ostream& os) { write_directory_json(os, options, directory, runs); }) ? 0 : 1;
+}
+
+void write_json(std::ostream& os, const Options& options, const std::vector<Result>& results,
+                const std::vector<BatchRun>& runs)
+{
+    os << "{\n  \"seed\": " << options.seed << ",\n  \"iterations\": " << options.iterations 
+       << ",\n  \"format\": \"" << pixel_format_names[static_cast<size_t>(options.decode.format)] << "\",\n  \"images\": [";
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        const size_t pixels = r.sample->width * r.sample->height;
+
+        os << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.sample->name << "\", \"width\": " << r.sample->width
+           << ", \"height\": " << r.sample->height << ", \"file_bytes\": " << r.sample->png.size()
+           << ", \"raw_bytes\": " << r.sample->raw_bytes << ", \"stages\": {";
+
+        for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); ++s)
+        {
+            const uint64_t ns = r.timings.*stages[s].field;
+            os << (s ? ", " : "") << "\"" << stages[s].name << "\": {\"ns\": " << ns
+               << ", \"ns_per_pixel\": " << std::setprecision(6) << static_cast<double>(ns) / pixels
+               << ", \"mb_per_s\": " << mb_per_s(r.sample->raw_bytes, ns) << "}";
+        }
+        const png::DecodeStats& st = r.stats;
+        os << "}, \"deflate\": {\"stored_blocks\": " << st.stored_blocks << ", \"fixed_blocks\": " << st.fixed_blocks
+           << ", \"dynamic_blocks\": " << st.dynamic_blocks << ", \"literals\": " << st.literals
+           << ", \"matches\": " << st.matches << ", \"average_match_length\": " << std::setprecision(3) 
+           << st.average_match_length() << "}}";
+    }
+    os << "\n  ]";
+
+    if (!runs.empty())
+    {
+        size_t bytes = 0;
+        for (const Result& r : results) bytes += r.sample->raw_bytes;
+
+        os << ",\n  \"batch\": [";
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            os << (i ? ",\n" : "\n") << "    {\"threads\": " << runs[i].threads << ", \"ns\": " << runs[i].ns
+               << ", \"mb_per_s\": " << mb_per_s(bytes, runs[i].ns) << "}";
+        }
+        os << "\n  ]";
+    }
+    os << "\n}\n";
+}
+
+void usage()
+{
+    std::cout <<
+        "usage: png_bench [options] [file.png ...]\n"
+        "  --sizes=N,N,...     edge lengths of generated images (default 32,256,1024)\n"
+        "  --profiles=P,...    content of generated images: noise, gradient, photo (default all)\n"
+        "  --iterations=N      timed decodes per image, medians are reported (default 5)\n"
+        "  --seed=N            corpus seed (default 1)\n"
+        "  --json=PATH         write results as JSON, - for stdout\n"
+        "  --corpus-dir=DIR    save the generated images to DIR\n"
+        "  --threads=N,N,...   also decode the whole corpus with png::BatchDecoder on N threads\n"
+        "  --format=F          decoded pixel format: native, rgba8, rgb8, grey8, rgba16 (default native)\n"
+        "  --dir=DIR           only measure reading and decoding every PNG in DIR, per I/O backend,\n"
+        "                      on the first --threads value of threads\n"
+        "  --queue-depth=N     reads in flight for --dir (default 32)\n"
+        "Files given on the command line are benchmarked instead of the generated corpus.\n"
+        "MB/s is measured over the decoded image data.\n";
+}
+
+bool parse_options(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find('=');
+        const std::string key = arg.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            options.files.push_back(arg);
+        }
+        else if (key == "--sizes")
+        {
+            options.sizes.clear();
+            std::istringstream is(value);
+            for (std::string item; std::getline(is, item, ',');)
+            {
+                size_t size = std::strtoul(item.c_str(), nullptr, 10);
+                if (size == 0) return false;
+                options.sizes.push_back(size);
+            }
+        }
+        else if (key == "--profiles")
+        {
+            options.profiles.clear();
+            std::istringstream is(value);
+            for (std::string item; std::getline(is, item, ',');)
+            {
+                const char* const* name = std::find(profile_names, profile_names + PROFILE_COUNT, item);
+                if (name == profile_names + PROFILE_COUNT) return false;
+                options.profiles.push_back(static_cast<Profile>(name - profile_names));
+            }
+        }
+        else if (key == "--threads")
+        {
+            std::istringstream is(value);
+            for (std::string item; std::getline(is, item, ',');)
+            {
+                size_t threads = std::strtoul(item.c_str(), nullptr, 10);
+                if (threads == 0) return false;
+                options.batch_threads.push_back(threads);
+            }
+        }
+        else if (key == "--format")
+        {
+            const char* const* name = std::find(pixel_format_names, pixel_format_names + PIXEL_FORMAT_COUNT, value);
+            if (name == pixel_format_names + PIXEL_FORMAT_COUNT) return false;
+            options.decode.format = static_cast<png::PixelFormat>(name - pixel_format_names);
+        }
+        else if (key == "--iterations")
+        {
+            options.iterations = std::strtoul(value.c_str(), nullptr, 10);
+            if (options.iterations == 0) return false;
+        }
+        else if (key == "--seed")       options.seed = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--json")       options.json_path = value;
+        else if (key == "--corpus-dir") options.corpus_dir = value;
+        else if (key == "--dir")        options.dir = value;
+        else if (key == "--queue-depth")
+        {
+            options.queue_depth = std::strtoul(value.c_str(), nullptr, 10);
+            if (options.queue_depth == 0) return false;
+        }
+        else return false;
+    }
+
+    if (options.sizes.empty()) options.sizes = { 32, 256, 1024 };
+    if (options.profiles.empty()) options.profiles = { PROFILE_NOISE, PROFILE_GRADIENT, PROFILE_PHOTO };
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        usage();
+        return 2;
+    }
+    if (!options.dir.empty()) return benchmark_directory(options);
+
+    std::vector<Sample> corpus;
+    if (options.files.empty())
+    {
+        corpus = generate_corpus(options);
+    }
+    else
+    {
+        for (const std::string& path : options.files)
+        {
+            Sample sample;
+            if (!load_file(path, sample))
+            {
+                std::cerr << "Can't load " << path << std::endl;
+                return 1;
+            }
+            corpus.push_back(sample);
+        }
+    }
+
+    if (!options.corpus_dir.empty())
+    {
+        for (const Sample& sample : corpus)
+        {
+            std::ofstream ofs(options.corpus_dir + "/" + sample.name + ".png", std::ios::out | std::ios::binary);
+            ofs.write(reinterpret_cast<const char*>(sample.png.data()), sample.png.size());
+        }
+    }
+
+    std::vector<Result> results;
+    for (const Sample& sample : corpus)
+    {
+        Result result;
+        if (!run_sample(sample, options.iterations, options.decode, result))
+        {
+            std::cerr << "Decoding failed: " << sample.name << std::endl;
+            return 1;
+        }
+        results.push_back(result);
+    }
+
+    std::vector<BatchRun> runs;
+    for (size_t threads : options.batch_threads)
+    {
+        BatchRun run;
+        if (!run_batch(corpus, threads, options.iterations, options.decode, run))
+        {
+            std::cerr << "Batch decoding failed" << std::endl;
+            return 1;
+        }
+        runs.push_back(run);
+    }
+
+    if (options.json_path != "-")
+    {
+        print_text(results);
+        if (!runs.empty()) print_batch(corpus, runs);
+    }
+
+    return write_output(options, [&](std::ostream& os) { write_json(os, options, results, runs); }) ? 0 : 1;
+}
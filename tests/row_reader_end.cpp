@@ -0,0 +1,98 @@
+// RowReader at the end of an image
+//
+// next_row() keeps returning nullptr once the last row was handed out, and
+// pass() and y() keep describing that row, for interlaced and plain images.
+
+#include "../PNGImage.h"
+
+#include <cstdio>
+
+namespace {
+
+// 13x11 8-bit greyscale, every pixel is y * 16 + x
+const unsigned char interlaced_png[] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, 0x00, 0x00, 0x00, 0x0D, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x0D, 0x00, 0x00, 0x00, 0x0B, 0x08, 0x00, 0x00, 0x00, 0x01, 0xF6, 0xDE, 0x68,
+    0x2B, 0x00, 0x00, 0x00, 0xB0, 0x49, 0x44, 0x41, 0x54, 0x78, 0xDA, 0x01, 0xA5, 0x00, 0x5A, 0xFF,
+    0x00, 0x00, 0x08, 0x00, 0x80, 0x88, 0x00, 0x04, 0x0C, 0x00, 0x84, 0x8C, 0x00, 0x40, 0x44, 0x48,
+    0x4C, 0x00, 0x02, 0x06, 0x0A, 0x00, 0x42, 0x46, 0x4A, 0x00, 0x82, 0x86, 0x8A, 0x00, 0x20, 0x22,
+    0x24, 0x26, 0x28, 0x2A, 0x2C, 0x00, 0x60, 0x62, 0x64, 0x66, 0x68, 0x6A, 0x6C, 0x00, 0xA0, 0xA2,
+    0xA4, 0xA6, 0xA8, 0xAA, 0xAC, 0x00, 0x01, 0x03, 0x05, 0x07, 0x09, 0x0B, 0x00, 0x21, 0x23, 0x25,
+    0x27, 0x29, 0x2B, 0x00, 0x41, 0x43, 0x45, 0x47, 0x49, 0x4B, 0x00, 0x61, 0x63, 0x65, 0x67, 0x69,
+    0x6B, 0x00, 0x81, 0x83, 0x85, 0x87, 0x89, 0x8B, 0x00, 0xA1, 0xA3, 0xA5, 0xA7, 0xA9, 0xAB, 0x00,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x00, 0x30, 0x31,
+    0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x00, 0x50, 0x51, 0x52, 0x53,
+    0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x00, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x00, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+    0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x4B, 0xC6, 0x30, 0x0B, 0x05, 0x40, 0x8C, 0x22, 0x00, 0x00, 0x00,
+    0x00, 0x49, 0x45, 0x4E, 0x44, 0xAE, 0x42, 0x60, 0x82,
+};
+
+const unsigned char plain_png[] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, 0x00, 0x00, 0x00, 0x0D, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x0D, 0x00, 0x00, 0x00, 0x0B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x81, 0xD9, 0x58,
+    0xBD, 0x00, 0x00, 0x00, 0xA5, 0x49, 0x44, 0x41, 0x54, 0x78, 0xDA, 0x01, 0x9A, 0x00, 0x65, 0xFF,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x00, 0x10,
+    0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x00, 0x20, 0x21, 0x22,
+    0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x00, 0x30, 0x31, 0x32, 0x33, 0x34,
+    0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+    0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x00, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5A, 0x5B, 0x5C, 0x00, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
+    0x6B, 0x6C, 0x00, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C,
+    0x00, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x00, 0x90,
+    0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x00, 0xA0, 0xA1, 0xA2,
+    0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0x89, 0x11, 0x30, 0x0B, 0xFF, 0xBE,
+    0x44, 0x65, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4E, 0x44, 0xAE, 0x42, 0x60, 0x82,
+};
+
+bool check(const char* name, const unsigned char* data, size_t size, size_t rows, size_t last_pass, size_t last_y)
+{
+    png::RowReader reader;
+    if (!reader.open(data, size))
+    {
+        std::printf("%s: open failed\n", name);
+        return false;
+    }
+
+    size_t count = 0;
+    while (const unsigned char* row = reader.next_row())
+    {
+        ++count;
+        if (row[0] >> 4 != reader.y())
+        {
+            std::printf("%s: row %zu is image row %d, y() says %zu\n", name, count, row[0] >> 4, reader.y());
+            return false;
+        }
+    }
+    if (count != rows)
+    {
+        std::printf("%s: %zu rows instead of %zu\n", name, count, rows);
+        return false;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (reader.pass() != last_pass || reader.y() != last_y)
+        {
+            std::printf("%s: after the end pass %zu y %zu instead of %zu, %zu\n", name, reader.pass(), reader.y(), 
+                        last_pass, last_y);
+            return false;
+        }
+        if (reader.next_row())
+        {
+            std::printf("%s: a row after the end\n", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = check("interlaced", interlaced_png, sizeof(interlaced_png), 22, 7, 9);
+    ok = check("plain", plain_png, sizeof(plain_png), 11, 0, 10) && ok;
+    std::printf(ok ? "row reader end passed\n" : "row reader end FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+// Stress test of the work-stealing thread pool
+//
+// Tasks submit more tasks from inside the pool while the outside thread keeps
+// submitting, so claims race with steals. Every round has to run every task
+// before wait() returns, and destroying a pool has to run what is still queued.
+// The pool is internal to the library, the translation unit is included whole.
+
+#include "../PNGImage.cpp"
+
+#include <atomic>
+#include <cstdio>
+
+namespace {
+
+const size_t ROUNDS       = 2000;
+const size_t OUTER_TASKS  = 16;
+const size_t INNER_TASKS  = 4;
+
+bool run_rounds(size_t threads)
+{
+    png::ThreadPool pool(threads);
+    std::atomic<size_t> done(0);
+
+    for (size_t round = 0; round < ROUNDS; ++round)
+    {
+        done = 0;
+        for (size_t i = 0; i < OUTER_TASKS; ++i)
+        {
+            pool.submit([&pool, &done] {
+                for (size_t j = 0; j < INNER_TASKS; ++j) pool.submit([&done] { ++done; });
+                ++done;
+            });
+        }
+        pool.wait();
+
+        const size_t expected = OUTER_TASKS * (INNER_TASKS + 1);
+        if (done != expected)
+        {
+            std::printf("%zu threads, round %zu: %zu of %zu tasks ran\n", threads, round, done.load(), expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_on_destruction(size_t threads)
+{
+    std::atomic<size_t> done(0);
+    for (size_t round = 0; round < ROUNDS / 10; ++round)
+    {
+        done = 0;
+        {
+            png::ThreadPool pool(threads);
+            for (size_t i = 0; i < OUTER_TASKS; ++i)
+            {
+                pool.submit([&pool, &done] {
+                    for (size_t j = 0; j < INNER_TASKS; ++j) pool.submit([&done] { ++done; });
+                    ++done;
+                });
+            }
+        }
+
+        const size_t expected = OUTER_TASKS * (INNER_TASKS + 1);
+        if (done != expected)
+        {
+            std::printf("%zu threads, destroyed pool %zu: %zu of %zu tasks ran\n", threads, round, done.load(), expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = true;
+    for (size_t threads : { 1, 2, 4, 8 }) ok = run_rounds(threads) && run_on_destruction(threads) && ok;
+    std::printf(ok ? "thread pool stress passed\n" : "thread pool stress FAILED\n");
+    return ok ? 0 : 1;
+}